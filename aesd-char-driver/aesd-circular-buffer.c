@@ -27,31 +27,33 @@
  *      in aesd_buffer.
  * @return the struct aesd_buffer_entry structure representing the position described by char_offset, or
  * NULL if this position is not available in the buffer (not enough data is written).
+ * Takes O(log n) in the number of entries held, a binary search over their start offsets.
  */
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-	size_t working_offset = char_offset;
-	uint8_t working_out_offs = buffer->out_offs;
+	uint32_t low = 0;
+	uint32_t high = aesd_circular_buffer_count(buffer);
+	struct aesd_buffer_entry *entry;
 
-	if(not buffer->full and buffer->in_offs == buffer->out_offs) {
-		// empty buffer
+	if(high == 0 or char_offset >= aesd_circular_buffer_size(buffer)) {
+		// empty buffer, or not enough data written
 		return NULL;
 	}
 
-	do {
-		if(buffer->entry[working_out_offs].size > working_offset) {
-			// this entry has the desired offset
-			*entry_offset_byte_rtn = working_offset;
-			return &(buffer->entry[working_out_offs]);
-		}
-		working_offset -= buffer->entry[working_out_offs].size;
-		working_out_offs++;
-		if(working_out_offs == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
-			working_out_offs = 0;
+	// binary search on the entry starts for the last entry starting at or before char_offset, the
+	// starts only increase from out_offs so compare offsets relative to the oldest entry
+	while(high - low > 1) {
+		uint32_t middle = low + (high - low) / 2;
+		if(aesd_circular_buffer_offset_of(buffer, middle) <= char_offset) {
+			low = middle;
+		} else {
+			high = middle;
 		}
-	} while(buffer->in_offs != working_out_offs);	
-    return NULL; // Couldn't find the offset within the data in the buffer
+	}
+	entry = aesd_circular_buffer_entry_at(buffer, low);
+	*entry_offset_byte_rtn = char_offset - aesd_circular_buffer_offset_of(buffer, low);
+	return entry;
 }
 
 /**
@@ -65,9 +67,11 @@ const char* aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
 {
 	const char* past_data = buffer->entry[buffer->in_offs].buffptr;
 	buffer->entry[buffer->in_offs] = *add_entry;
+	buffer->entry[buffer->in_offs].start = buffer->end;
+	buffer->end += add_entry->size;
 	buffer->in_offs++;
 
-	if(buffer->in_offs >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+	if(buffer->in_offs >= buffer->capacity) {
 		buffer->in_offs = 0;
 	}
 	if(buffer->in_offs == buffer->out_offs) {
@@ -82,13 +86,143 @@ const char* aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
 }
 
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+* Removes the oldest entry from @param buffer, advancing buffer->out_offs.
+* Any necessary locking must be handled by the caller
+* @return the buffptr of the removed entry, for the caller to release, or NULL if the buffer was empty
+*/
+const char *aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer)
+{
+	const char *past_data;
+
+	if(not buffer->full and buffer->in_offs == buffer->out_offs) {
+		return NULL;
+	}
+	past_data = buffer->entry[buffer->out_offs].buffptr;
+	buffer->entry[buffer->out_offs].buffptr = NULL;
+	buffer->entry[buffer->out_offs].size = 0;
+	buffer->out_offs++;
+	if(buffer->out_offs >= buffer->capacity) {
+		buffer->out_offs = 0;
+	}
+	buffer->full = false;
+	return past_data;
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct holding up to
+* AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
 
+	buffer->entry = buffer->default_entry;
+	buffer->capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
 	buffer->full = false;
 	buffer->in_offs = 0;
 	buffer->out_offs = 0;
+	buffer->end = 0;
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct storing its entries in
+* @param entries, an array of @param capacity entries allocated by the caller.  capacity must be at least 1.
+*/
+void aesd_circular_buffer_init_entries(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entries,
+            uint32_t capacity)
+{
+	aesd_circular_buffer_init(buffer);
+	memset(entries, 0, capacity * sizeof(struct aesd_buffer_entry));
+	buffer->entry = entries;
+	buffer->capacity = capacity;
+}
+
+/**
+* @return the number of entries held in @param buffer
+*/
+uint32_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer)
+{
+	if(buffer->full) {
+		return buffer->capacity;
+	}
+	if(buffer->in_offs >= buffer->out_offs) {
+		return buffer->in_offs - buffer->out_offs;
+	}
+	return buffer->capacity - buffer->out_offs + buffer->in_offs;
+}
+
+/**
+* @return the number of bytes held in @param buffer, all its entries concatenated end to end
+*/
+size_t aesd_circular_buffer_size(const struct aesd_circular_buffer *buffer)
+{
+	if(not buffer->full and buffer->in_offs == buffer->out_offs) {
+		return 0;
+	}
+	return buffer->end - buffer->entry[buffer->out_offs].start;
+}
+
+/**
+* @return the offset of the entry written @param index writes after the oldest one in @param buffer, the
+* number of bytes held before it, which must be at most the number of entries held
+*/
+size_t aesd_circular_buffer_offset_of(struct aesd_circular_buffer *buffer, uint32_t index)
+{
+	struct aesd_buffer_entry *entry = aesd_circular_buffer_entry_at(buffer, index);
+
+	if(entry == NULL) {
+		return aesd_circular_buffer_size(buffer);
+	}
+	return entry->start - buffer->entry[buffer->out_offs].start;
+}
+
+/**
+* @return the entry written @param index writes after the oldest one in @param buffer, or NULL if
+* there are not that many entries
+*/
+struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer, uint32_t index)
+{
+	uint32_t slot;
+
+	if(index >= aesd_circular_buffer_count(buffer)) {
+		return NULL;
+	}
+	slot = buffer->out_offs + index;
+	if(slot >= buffer->capacity or slot < index) {
+		slot -= buffer->capacity;
+	}
+	return &(buffer->entry[slot]);
+}
+
+/**
+* Moves the entries of @param buffer, oldest first, into @param entries, an array of @param capacity entries
+* allocated by the caller, which the buffer uses from then on.  capacity must be at least 1.
+* When more than capacity entries are held the oldest ones are dropped, so the caller must first release
+* the memory of the entries aesd_circular_buffer_entry_at returns for indexes below count - capacity.
+* Any necessary locking must be handled by the caller.
+* @return the entry array previously used, for the caller to free, or NULL if that was buffer->default_entry
+*/
+struct aesd_buffer_entry *aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *entries, uint32_t capacity)
+{
+	struct aesd_buffer_entry *previous = buffer->entry;
+	uint32_t count = aesd_circular_buffer_count(buffer);
+	uint32_t dropped = 0;
+	uint32_t index;
+
+	if(count > capacity) {
+		dropped = count - capacity;
+		count = capacity;
+	}
+	memset(entries, 0, capacity * sizeof(struct aesd_buffer_entry));
+	for(index = 0; index < count; ++index) {
+		entries[index] = *aesd_circular_buffer_entry_at(buffer, dropped + index);
+	}
+
+	buffer->entry = entries;
+	buffer->capacity = capacity;
+	buffer->out_offs = 0;
+	buffer->in_offs = count == capacity ? 0 : count;
+	buffer->full = count == capacity;
+	return previous == buffer->default_entry ? NULL : previous;
 }
@@ -38,9 +38,14 @@ struct aesd_seekto {
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Change the number of writes the device keeps to the uint32_t passed, dropping the oldest ones if fewer
+#define AESDCHAR_IOCRESIZE _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+// When the uint32_t passed isn't 0, reads of this file at the end of the data wait for the next write
+// (fail with EAGAIN under O_NONBLOCK) and its position keeps its place as the oldest writes are dropped
+#define AESDCHAR_IOCFOLLOW _IOW(AESD_IOC_MAGIC, 3, uint32_t)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 3
 
 #endif /* AESD_IOCTL_H */
@@ -0,0 +1,68 @@
+/*
+ * aesd_mmap.h
+ *
+ *  @brief Layout of the read-only mapping of an aesd char device loaded with an arena
+ *
+ * The mapping starts with a page holding struct aesd_mmap_header, followed at arena_offset by the arena
+ * packets are stored in.  Each packet is a struct aesd_mmap_record followed by its data, padded to
+ * AESD_MMAP_ALIGN, and packets follow each other in the order they were written from the oldest at tail,
+ * continuing at the start of the arena after a record sized AESD_MMAP_WRAP or at the end of the arena.
+ *
+ * The device changes the mapping while it is read.  seq is odd while it does, so readers take seq, retry
+ * while it is odd, read the header and the packets and take seq again: if it changed, what was read may
+ * have been overwritten and must be read again.
+ */
+
+#ifndef AESD_MMAP_H
+#define AESD_MMAP_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#endif
+
+#define AESD_MMAP_ALIGN 8
+#define AESD_MMAP_WRAP 0xffffffffu
+
+struct aesd_mmap_record {
+    /**
+     * Bytes of packet data following the record, or AESD_MMAP_WRAP if the next record is at the start of the arena
+     */
+    uint32_t size;
+    uint32_t reserved;
+};
+
+struct aesd_mmap_header {
+    /**
+     * Incremented before and after every change to the header or the arena, odd while one is in progress
+     */
+    uint32_t seq;
+    /**
+     * Packets held in the arena
+     */
+    uint32_t count;
+    /**
+     * Packets held outside the arena, too large for it.  Readers fall back to read() unless this is 0.
+     */
+    uint32_t external;
+    uint32_t reserved;
+    /**
+     * Offset of the arena in the mapping, in bytes
+     */
+    uint64_t arena_offset;
+    /**
+     * Size of the arena in bytes
+     */
+    uint64_t arena_size;
+    /**
+     * Offset in the arena of the record of the oldest packet held
+     */
+    uint64_t tail;
+    /**
+     * Offset in the arena where the record of the next packet goes
+     */
+    uint64_t head;
+};
+
+#endif /* AESD_MMAP_H */
@@ -9,6 +9,9 @@
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
 #include "aesd-circular-buffer.h"
+#include "aesd_mmap.h"
+
+#define AESDCHAR_MAX_CAPACITY (1 << 20) // bounds the entry array at 24MiB on 64 bit
 
 #define AESD_DEBUG 1  //Remove comment on this line to enable debug
 
@@ -31,10 +34,38 @@ struct aesd_dev
      * TODO: Add structure(s) and locks needed to complete assignment requirements
      */
 	struct aesd_circular_buffer buffer;
-	char *temp_write_data;
-	struct mutex lock;
+	char *temp_write_data;   // a write not yet ended by a newline, temp_write_len bytes of temp_write_size
+	size_t temp_write_len;
+	size_t temp_write_size;
+	char *arena;             // arena_size byte ring packets are copied into, NULL if each has its own allocation
+	size_t arena_size;
+	size_t arena_head;       // where the next packet's record goes in arena
+	uint32_t external;       // packets held outside the arena
+	struct aesd_mmap_header *header; // page ahead of the arena, the two are mapped read-only by aesd_mmap
+	wait_queue_head_t wait;  // woken when a write is committed
+	struct mutex lock;       // held by writers
+	seqcount_mutex_t seq;    // bumped by writers around changes to buffer, for readers which don't take lock
     struct cdev cdev;     /* Char device structure      */
 };
 
+/**
+ * Packet data held outside the arena.  Readers may still be copying it when it is dropped, so it is freed
+ * through rcu once they are done.
+ */
+struct aesd_packet
+{
+	struct rcu_head rcu;
+	char data[];
+};
+
+/**
+ * State of one open file of the device
+ */
+struct aesd_file
+{
+	struct aesd_dev *dev;
+	bool follow;   // set with AESDCHAR_IOCFOLLOW
+	size_t base;   // start of the buffer when the position was last updated, for following files
+};
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
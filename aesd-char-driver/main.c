@@ -18,6 +18,13 @@
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
 #include <linux/slab.h>
+#include <linux/mm.h> // kvmalloc, kvfree
+#include <linux/vmalloc.h> // vmalloc_user, remap_vmalloc_range
+#include <linux/version.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/seqlock.h>
+#include <linux/srcu.h>
 #include <linux/uaccess.h> // copy_from_user (and to)
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
@@ -25,21 +32,47 @@
 
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
+static unsigned int capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; // writes kept, can be changed with AESDCHAR_IOCRESIZE
+
+module_param(capacity, uint, S_IRUGO);
+MODULE_PARM_DESC(capacity, "Number of writes kept by the device");
+static unsigned int arena_size = 0; // bytes of the ring packets are stored in, 0 to allocate each one separately
+
+module_param(arena_size, uint, S_IRUGO);
+MODULE_PARM_DESC(arena_size, "Bytes preallocated to store packets in, 0 to allocate each packet separately");
 
 MODULE_AUTHOR("Rob Johnson");
 MODULE_LICENSE("Dual BSD/GPL");
 
 struct aesd_dev aesd_device;
 
+/**
+ * Readers take neither aesd_device.lock nor wait on writers.  They copy the buffer with aesd_buffer_snapshot,
+ * read through the copy and check with read_seqcount_retry that no write changed the buffer meanwhile.
+ * What they read may be dropped or resized away under them, so the memory is freed once their SRCU read
+ * sections end: dropped packets with call_srcu, the entry array after synchronize_srcu.  Packets in the
+ * arena are overwritten in place instead, which the sequence check catches.
+ */
+DEFINE_STATIC_SRCU(aesd_srcu);
+
+/**
+ * Times a read is tried without aesd_device.lock before taking it to hold writes off
+ */
+#define AESD_READ_TRIES 4
+
 int aesd_open(struct inode *inode, struct file *filp)
 {
-	struct aesd_dev *dev;
+	struct aesd_file *file;
 
     PDEBUG("open");
 	
+	file = kzalloc(sizeof(struct aesd_file), GFP_KERNEL);
+	if(file == NULL) {
+		return -ENOMEM;
+	}
 	// save device information
-	dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
-	filp->private_data = dev;
+	file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+	filp->private_data = file;
 
     return 0;
 }
@@ -48,102 +81,475 @@ int aesd_release(struct inode *inode, struct file *filp)
 {
     PDEBUG("release");
 
-	// No hardware to release so can return without action.
+	// No hardware to release, just the per file state
+	kfree(filp->private_data);
 
     return 0;
 }
 
+/**
+ * Copy the fields of aesd_device.buffer describing the entries held to @param snap, all from between the
+ * same two writes.  The entries themselves are still read from aesd_device.buffer's array, so this must be
+ * called in an aesd_srcu read section and what is read through @param snap checked with read_seqcount_retry.
+ * @return the sequence count to check against
+ */
+static unsigned int aesd_buffer_snapshot(struct aesd_circular_buffer *snap)
+{
+	const struct aesd_circular_buffer *buffer = &aesd_device.buffer;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&aesd_device.seq);
+		snap->entry = buffer->entry;
+		snap->capacity = buffer->capacity;
+		snap->in_offs = buffer->in_offs;
+		snap->out_offs = buffer->out_offs;
+		snap->full = buffer->full;
+		snap->end = buffer->end;
+	} while(read_seqcount_retry(&aesd_device.seq, seq));
+	return seq;
+}
+
+/**
+ * @return the offset of the oldest byte held in @param buffer among all the bytes written since it was
+ * initialized, which may wrap like the offsets of the entries
+ */
+static size_t aesd_buffer_start(const struct aesd_circular_buffer *buffer)
+{
+	return buffer->end - aesd_circular_buffer_size(buffer);
+}
+
+/**
+ * @return the offset of the oldest byte held, see aesd_buffer_start
+ */
+static size_t aesd_current_start(void)
+{
+	struct aesd_circular_buffer snap;
+	unsigned int seq;
+	size_t start;
+	int idx;
+
+	idx = srcu_read_lock(&aesd_srcu);
+	do {
+		seq = aesd_buffer_snapshot(&snap);
+		start = aesd_buffer_start(&snap);
+	} while(read_seqcount_retry(&aesd_device.seq, seq));
+	srcu_read_unlock(&aesd_srcu, idx);
+	return start;
+}
+
+/**
+ * Positions are relative to the oldest write held, so as writes are dropped the same position moves on
+ * through the data.  Following files keep their place instead, starting over at the oldest write if theirs
+ * was dropped.
+ * @return the current position in @param buffer of @param file, which was at @param f_pos when last updated
+ */
+static loff_t aesd_file_pos(const struct aesd_file *file, const struct aesd_circular_buffer *buffer, loff_t f_pos)
+{
+	size_t pos;
+
+	if(not READ_ONCE(file->follow)) {
+		return f_pos;
+	}
+	pos = READ_ONCE(file->base) + (size_t)f_pos - aesd_buffer_start(buffer);
+	if(pos > aesd_circular_buffer_size(buffer)) {
+		// dropped, or before the start once the difference wrapped
+		pos = 0;
+	}
+	return pos;
+}
+
+/**
+ * Copy up to @param count bytes from the position @param f_pos of @param file to @param buf, bringing the
+ * position up to date, see aesd_file_pos.  Must be called in an aesd_srcu read section.
+ * @param end set to the end of the data read from, which changes with the next write
+ * @return the bytes copied, 0 at the end of the data, -EFAULT, or -EAGAIN if a write changed the buffer
+ * while it was read, which can't happen with aesd_device.lock held
+ */
+static ssize_t aesd_read_once(struct aesd_file *file, char __user *buf, size_t count, loff_t *f_pos, size_t *end)
+{
+	struct aesd_circular_buffer snap;
+	struct aesd_buffer_entry *entry;
+	const char *data = NULL;
+	size_t read_len = 0;
+	size_t offset;
+	unsigned int seq;
+	loff_t pos;
+
+	seq = aesd_buffer_snapshot(&snap);
+	pos = aesd_file_pos(file, &snap, *f_pos);
+	entry = aesd_circular_buffer_find_entry_offset_for_fpos(&snap, pos, &offset);
+	if(entry != NULL) { // data is valid
+		data = entry->buffptr + offset;
+		read_len = min(count, entry->size - offset);
+	}
+	// only dereference data once the entry it came from is known to be whole
+	if(read_seqcount_retry(&aesd_device.seq, seq)) {
+		return -EAGAIN;
+	}
+	if(copy_to_user(buf, data, read_len) != 0) {
+		// copy failed
+		return -EFAULT;
+	}
+	// an arena packet may have been overwritten while it was copied
+	if(read_seqcount_retry(&aesd_device.seq, seq)) {
+		return -EAGAIN;
+	}
+
+	*f_pos = pos + read_len;
+	WRITE_ONCE(file->base, aesd_buffer_start(&snap));
+	*end = snap.end;
+	return read_len;
+}
+
 ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
                 loff_t *f_pos)
 {
-    ssize_t retval = 0;
-	size_t offset;	
-	struct aesd_buffer_entry* entry = aesd_circular_buffer_find_entry_offset_for_fpos(&aesd_device.buffer, *f_pos, &offset); 
-	size_t read_len;
+    ssize_t retval = -EAGAIN;
+	struct aesd_file *file = filp->private_data;
+	size_t end;
+	int tries;
+	int idx;
     
 	PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
-	
-	if(mutex_lock_interruptible(&aesd_device.lock) != 0) {
-		// couldn't lock
-		return -ERESTARTSYS;
+
+	idx = srcu_read_lock(&aesd_srcu);
+	for(;;) {
+		for(tries = 0; retval == -EAGAIN and tries < AESD_READ_TRIES; ++tries) {
+			retval = aesd_read_once(file, buf, count, f_pos, &end);
+		}
+		if(retval == -EAGAIN) {
+			// writes keep changing the buffer under the read, hold them off
+			if(mutex_lock_interruptible(&aesd_device.lock) != 0) {
+				// couldn't lock
+				retval = -ERESTARTSYS;
+				break;
+			}
+			retval = aesd_read_once(file, buf, count, f_pos, &end);
+			mutex_unlock(&aesd_device.lock);
+		}
+		if(retval != 0 or not READ_ONCE(file->follow)) {
+			break;
+		}
+
+		// at the end of the data, wait for the next write outside the read section, resizes wait for it
+		srcu_read_unlock(&aesd_srcu, idx);
+		if(filp->f_flags & O_NONBLOCK) {
+			return -EAGAIN;
+		}
+		if(wait_event_interruptible(aesd_device.wait, READ_ONCE(aesd_device.buffer.end) != end) != 0) {
+			return -ERESTARTSYS;
+		}
+		idx = srcu_read_lock(&aesd_srcu);
+		retval = -EAGAIN;
 	}
+	srcu_read_unlock(&aesd_srcu, idx);
+    return retval;
+}
 
-	if(entry != NULL) { // data is valid
-		size_t data_available = entry->size - offset;
-		if(data_available > count) {
-			read_len = count;
-		} else {
-			read_len = data_available;
+/**
+ * Readable once there is data past the position of the file, which for following files is when a read
+ * won't wait.  Writes never wait.
+ */
+static __poll_t aesd_poll(struct file *filp, struct poll_table_struct *wait)
+{
+	struct aesd_file *file = filp->private_data;
+	__poll_t mask = EPOLLOUT | EPOLLWRNORM;
+	struct aesd_circular_buffer snap;
+	unsigned int seq;
+	bool readable;
+	int idx;
+
+	poll_wait(filp, &aesd_device.wait, wait);
+	idx = srcu_read_lock(&aesd_srcu);
+	do {
+		seq = aesd_buffer_snapshot(&snap);
+		readable = aesd_file_pos(file, &snap, filp->f_pos) < aesd_circular_buffer_size(&snap);
+	} while(read_seqcount_retry(&aesd_device.seq, seq));
+	srcu_read_unlock(&aesd_srcu, idx);
+	if(readable) {
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+	return mask;
+}
+
+static bool aesd_in_arena(const char *buffptr)
+{
+	return buffptr >= aesd_device.arena and buffptr < aesd_device.arena + aesd_device.arena_size;
+}
+
+/**
+ * @return the bytes a @param len byte packet takes in the arena, with its record and padding
+ */
+static size_t aesd_arena_record_size(size_t len)
+{
+	return ALIGN(sizeof(struct aesd_mmap_record) + len, AESD_MMAP_ALIGN);
+}
+
+/**
+ * @return @param size bytes of packet data, to release with aesd_free_packet once held by the buffer or
+ * aesd_packet_kvfree before, or NULL if the memory couldn't be allocated
+ */
+static char *aesd_packet_alloc(size_t size)
+{
+	struct aesd_packet *packet = kvmalloc(struct_size(packet, data, size), GFP_KERNEL);
+
+	return packet != NULL ? packet->data : NULL;
+}
+
+/**
+ * Release the packet data at @param data, which may be NULL, straight away.  Only for data no reader can see.
+ */
+static void aesd_packet_kvfree(const char *data)
+{
+	if(data != NULL) {
+		kvfree(container_of(data, struct aesd_packet, data[0]));
+	}
+}
+
+static void aesd_packet_free_rcu(struct rcu_head *head)
+{
+	kvfree(container_of(head, struct aesd_packet, rcu));
+}
+
+/**
+ * Release the packet data at @param buffptr, which may be NULL, once readers are done with it.  Packets in
+ * the arena need nothing, their space is reused once they are no longer the oldest ones held.
+ */
+static void aesd_free_packet(const char *buffptr)
+{
+	struct aesd_packet *packet;
+
+	if(buffptr == NULL or aesd_in_arena(buffptr)) {
+		return;
+	}
+	if(aesd_device.arena != NULL) {
+		aesd_device.external--;
+	}
+	packet = container_of(buffptr, struct aesd_packet, data[0]);
+	call_srcu(&aesd_srcu, &packet->rcu, aesd_packet_free_rcu);
+}
+
+/**
+ * @return the oldest packet held in the arena, or NULL if it holds none.  Packets too large for the arena
+ * may be held before it.
+ */
+static struct aesd_buffer_entry *aesd_arena_oldest(void)
+{
+	struct aesd_buffer_entry *entry;
+	uint32_t index;
+
+	for(index = 0; index <= aesd_device.external; ++index) {
+		entry = aesd_circular_buffer_entry_at(&aesd_device.buffer, index);
+		if(entry == NULL or aesd_in_arena(entry->buffptr)) {
+			return entry;
 		}
+	}
+	return NULL;
+}
 
-		if(copy_to_user(buf, entry->buffptr + offset, read_len) != 0) {
-			// copy failed
-			retval = -EFAULT;
-			goto read_out;
+/**
+ * Start a change to the packets held, readers retry until aesd_change_end.  Must be called with
+ * aesd_device.lock held, and nothing up to aesd_change_end may sleep.
+ */
+static void aesd_change_begin(void)
+{
+	write_seqcount_begin(&aesd_device.seq);
+	if(aesd_device.header != NULL) {
+		WRITE_ONCE(aesd_device.header->seq, aesd_device.header->seq + 1);
+		smp_wmb();
+	}
+}
+
+/**
+ * Describe the packets held in the header page and end the change aesd_change_begin started
+ */
+static void aesd_change_end(void)
+{
+	struct aesd_mmap_header *header = aesd_device.header;
+	struct aesd_buffer_entry *oldest;
+
+	if(header == NULL) {
+		write_seqcount_end(&aesd_device.seq);
+		return;
+	}
+	header->count = aesd_circular_buffer_count(&aesd_device.buffer) - aesd_device.external;
+	header->external = aesd_device.external;
+	header->head = aesd_device.arena_head;
+	oldest = aesd_arena_oldest();
+	if(oldest != NULL) {
+		header->tail = oldest->buffptr - sizeof(struct aesd_mmap_record) - aesd_device.arena;
+	} else {
+		header->tail = aesd_device.arena_head;
+	}
+	smp_wmb();
+	WRITE_ONCE(header->seq, header->seq + 1);
+	write_seqcount_end(&aesd_device.seq);
+}
+
+/**
+ * Find room in the arena for a @param len byte packet, whose record must fit the arena, dropping the oldest
+ * packets held until there is.  Records are laid out in the order packets were written, as aesd_mmap.h
+ * describes, wrapping back to the start of the arena when one doesn't fit before the end, so the packets
+ * held occupy one span from the oldest arena packet's record up to arena_head, and dropping the oldest is
+ * all it takes to reclaim space.  Packets held outside the arena are dropped in their turn, only while the
+ * new one still doesn't fit, so they are kept as long as the capacity allows when the arena has room.
+ * Must be called with aesd_device.lock held, between aesd_change_begin and aesd_change_end.
+ * @return where to copy the packet
+ */
+static char *aesd_arena_alloc(size_t len)
+{
+	size_t record_size = aesd_arena_record_size(len);
+	size_t pos = aesd_device.arena_head;
+	struct aesd_buffer_entry *oldest;
+	struct aesd_mmap_record *record;
+	size_t tail;
+
+	if(pos + record_size > aesd_device.arena_size) {
+		pos = 0;
+	}
+	// the oldest entry is dropped by aesd_circular_buffer_add_entry anyway once the buffer is full
+	if(aesd_device.buffer.full) {
+		aesd_free_packet(aesd_circular_buffer_remove_entry(&aesd_device.buffer));
+	}
+	while((oldest = aesd_arena_oldest()) != NULL) {
+		tail = oldest->buffptr - sizeof(struct aesd_mmap_record) - aesd_device.arena;
+		if(tail < aesd_device.arena_head) {
+			// held packets in [tail, arena_head), free space after them and before tail
+			if(pos == aesd_device.arena_head or pos + record_size <= tail) {
+				break;
+			}
+		} else if(pos == aesd_device.arena_head and pos + record_size <= tail) {
+			// wrapped, held packets in [tail, arena_size) and [0, arena_head), free space between
+			break;
 		}
-	} else { // at end of circular buffer
-		read_len = 0;
+		// in order, packets outside the arena held before the oldest one in it go first
+		aesd_free_packet(aesd_circular_buffer_remove_entry(&aesd_device.buffer));
+	}
+	if(oldest == NULL) {
+		// nothing in the arena, start over at the beginning
+		pos = 0;
+	} else if(pos != aesd_device.arena_head and aesd_device.arena_head < aesd_device.arena_size) {
+		// readers of the mapping continue at the start
+		record = (struct aesd_mmap_record *)(aesd_device.arena + aesd_device.arena_head);
+		record->size = AESD_MMAP_WRAP;
 	}
+	record = (struct aesd_mmap_record *)(aesd_device.arena + pos);
+	record->size = len;
+	record->reserved = 0;
+	aesd_device.arena_head = pos + record_size;
+	return (char *)(record + 1);
+}
 
-	*f_pos += read_len;
-	retval = read_len;
+/**
+ * Make room for @param count more bytes in aesd_device.temp_write_data.  The allocation at least doubles
+ * when it grows, so building up an N byte write from small pieces copies O(N) bytes in total.  Writes and
+ * entries are allocated with aesd_packet_alloc, on kvmalloc, so writes larger than kmalloc allows fall back
+ * to vmalloc.
+ * @return 0 on success, -ENOMEM if the memory couldn't be allocated, leaving temp_write_data as it was
+ */
+static int aesd_temp_write_reserve(size_t count)
+{
+	size_t needed = aesd_device.temp_write_len + count;
+	size_t new_size;
+	char *grown;
 
-  read_out:	
-	mutex_unlock(&aesd_device.lock);
-    return retval;
+	if(needed < count) {
+		return -ENOMEM; // overflow
+	}
+	if(needed <= aesd_device.temp_write_size) {
+		return 0;
+	}
+	new_size = aesd_device.temp_write_size * 2;
+	if(new_size < needed) {
+		new_size = needed;
+	}
+	grown = aesd_packet_alloc(new_size);
+	if(grown == NULL) {
+		return -ENOMEM;
+	}
+	PDEBUG("kvmalloc #%zu, old #%zu", new_size, aesd_device.temp_write_size);
+	if(aesd_device.temp_write_len > 0) {
+		memcpy(grown, aesd_device.temp_write_data, aesd_device.temp_write_len);
+	}
+	aesd_packet_kvfree(aesd_device.temp_write_data);
+	aesd_device.temp_write_data = grown;
+	aesd_device.temp_write_size = new_size;
+	return 0;
 }
 
 ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
     ssize_t retval = -ENOMEM;
+	char *data;
 	size_t total_count;
-	size_t start_index;
+	bool committed = false;
 
     PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
 	// todo - what is f_pos supposed to do here? Possibly used in next assignment?
+
+	if(count == 0) {
+		return 0;
+	}
 	
 	if(mutex_lock_interruptible(&aesd_device.lock) != 0) {
 		// couldn't lock
 		return -ERESTARTSYS;
 	}
 
-	if(aesd_device.temp_write_data == NULL) {
-		// get memory
-		total_count = count;
-		start_index = 0;
-		aesd_device.temp_write_data = kmalloc(count+1, GFP_KERNEL);
-		memset(aesd_device.temp_write_data, 0, count+1);
-		PDEBUG("kmalloc #%zu", count+1);
-	} else {
-		// get memory for both new and existing
-		size_t previous_count = strlen(aesd_device.temp_write_data); 
-		total_count = count + previous_count;
-		start_index = previous_count;
-		aesd_device.temp_write_data = krealloc(aesd_device.temp_write_data, total_count+1, GFP_KERNEL);
-		memset(&aesd_device.temp_write_data[start_index], 0, count+1);
-		PDEBUG("krealloc #%zu, old #%zu s: %s", count, previous_count, aesd_device.temp_write_data);
-	}
-	
-	if(aesd_device.temp_write_data == NULL) {
+	retval = aesd_temp_write_reserve(count);
+	if(retval != 0) {
 		// failed to allocate memory
-		retval = -ENOMEM;
 		goto write_out;
 	}
 
-	if(copy_from_user(&aesd_device.temp_write_data[start_index], buf, count) != 0) {
-		// copy failed
+	// the length is kept explicitly, the data may contain NUL bytes
+	if(copy_from_user(&aesd_device.temp_write_data[aesd_device.temp_write_len], buf, count) != 0) {
+		// copy failed, the partial copy isn't counted
 		retval = -EFAULT;
 		goto write_out;
 	}
+	aesd_device.temp_write_len += count;
+	total_count = aesd_device.temp_write_len;
 
 	if(aesd_device.temp_write_data[total_count-1] == '\n') {
 		// data is terminated with newline - push to buffer
-		struct aesd_buffer_entry entry = {.size=total_count, .buffptr=aesd_device.temp_write_data};
-		const char* old_data = aesd_circular_buffer_add_entry(&aesd_device.buffer, &entry);
-		PDEBUG("Writing %zu bytes to buffer: %s", total_count, aesd_device.temp_write_data);
-		kfree(old_data); // can be passed to kfree, even if NULL
-		aesd_device.temp_write_data = NULL; // Has been saved to buffer.
+		struct aesd_buffer_entry entry;
+		const char* old_data;
+		bool in_arena = aesd_device.arena != NULL and aesd_arena_record_size(total_count) <= aesd_device.arena_size;
+
+		data = aesd_device.temp_write_data;
+		if(not in_arena and aesd_device.temp_write_size - total_count > total_count / 4) {
+			// over a quarter is slack left from doubling, keep an exact copy instead (one more copy, still linear)
+			char *exact = aesd_packet_alloc(total_count);
+			if(exact != NULL) {
+				memcpy(exact, data, total_count);
+				aesd_packet_kvfree(data);
+				data = exact;
+			}
+		}
+
+		aesd_change_begin();
+		if(in_arena) {
+			// copied into the arena, the staging buffer is kept for the next write
+			data = aesd_arena_alloc(total_count);
+			memcpy(data, aesd_device.temp_write_data, total_count);
+		} else if(aesd_device.arena != NULL) {
+			aesd_device.external++;
+		}
+		entry.size = total_count;
+		entry.buffptr = data;
+		old_data = aesd_circular_buffer_add_entry(&aesd_device.buffer, &entry);
+		PDEBUG("Writing %zu bytes to buffer", total_count);
+		aesd_free_packet(old_data); // can be passed NULL
+		aesd_change_end();
+		committed = true;
+		aesd_device.temp_write_len = 0;
+		if(not in_arena) {
+			aesd_device.temp_write_data = NULL; // Has been saved to buffer.
+			aesd_device.temp_write_size = 0;
+		}
 	}
 	
 	retval = count;
@@ -151,6 +557,9 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
 
   write_out:	
 	mutex_unlock(&aesd_device.lock);
+	if(committed) {
+		wake_up_interruptible(&aesd_device.wait);
+	}
     return retval;
 }
 
@@ -158,21 +567,25 @@ loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
 {
     loff_t newpos = 0;
 	size_t buffer_length = 0;
-	uint8_t index;
-	struct aesd_buffer_entry *entry;
+	struct aesd_file *file = filp->private_data;
+	struct aesd_circular_buffer snap;
+	unsigned int seq;
+	loff_t pos;
+	size_t start;
+	int idx;
     PDEBUG("aesd_llseek off:%lli whence:%i", off, whence);
 
-	// Take mutex
-	if(mutex_lock_interruptible(&aesd_device.lock) != 0) {
-		// couldn't lock
-		return -ERESTARTSYS;
-	}
-
-	// Calculate buffer length
-	AESD_CIRCULAR_BUFFER_FOREACH(entry,&aesd_device.buffer,index) {
-		buffer_length += entry->size;
-	}
-
+	// Calculate buffer length, and for SEEK_CUR where a following file has got to
+	idx = srcu_read_lock(&aesd_srcu);
+	do {
+		seq = aesd_buffer_snapshot(&snap);
+		pos = aesd_file_pos(file, &snap, filp->f_pos);
+		start = aesd_buffer_start(&snap);
+		buffer_length = aesd_circular_buffer_size(&snap);
+	} while(read_seqcount_retry(&aesd_device.seq, seq));
+	srcu_read_unlock(&aesd_srcu, idx);
+	filp->f_pos = pos;
+	WRITE_ONCE(file->base, start);
 
 	// Delegate work to find location to helper function as suggested in assignment video (~8:30)
 	newpos = fixed_size_llseek(filp, off, whence, buffer_length);
@@ -181,18 +594,63 @@ loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
 		filp->f_pos = newpos;
 	}
 
-	// Release mutex
+    return newpos;
+}
+
+/**
+ * Change the number of writes aesd_device keeps to @param new_capacity, dropping the oldest ones if it holds more
+ * @return 0 on success or a negative error code
+ */
+static long aesd_resize(uint32_t new_capacity)
+{
+	struct aesd_buffer_entry *entries;
+	struct aesd_buffer_entry *previous;
+	uint32_t count;
+	uint32_t index;
+
+	if(new_capacity == 0 or new_capacity > AESDCHAR_MAX_CAPACITY) {
+		return -EINVAL;
+	}
+	// allocate before locking, readers and writers don't wait on the allocator
+	entries = kvcalloc(new_capacity, sizeof(struct aesd_buffer_entry), GFP_KERNEL);
+	if(entries == NULL) {
+		return -ENOMEM;
+	}
+
+	if(mutex_lock_interruptible(&aesd_device.lock) != 0) {
+		kvfree(entries);
+		return -ERESTARTSYS;
+	}
+	aesd_change_begin();
+	count = aesd_circular_buffer_count(&aesd_device.buffer);
+	for(index = 0; index + new_capacity < count; ++index) {
+		aesd_free_packet(aesd_circular_buffer_entry_at(&aesd_device.buffer, index)->buffptr);
+	}
+	previous = aesd_circular_buffer_resize(&aesd_device.buffer, entries, new_capacity);
+	aesd_change_end();
 	mutex_unlock(&aesd_device.lock);
 
-    return newpos;
+	PDEBUG("resized to %u writes, %u dropped", new_capacity, count > new_capacity ? count - new_capacity : 0);
+	// readers may still be looking up entries in the previous array
+	synchronize_srcu(&aesd_srcu);
+	kvfree(previous);
+	return 0;
 }
 
 long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	struct aesd_seekto seekto;	
+	struct aesd_buffer_entry *entry;
+	struct aesd_file *file = filp->private_data;
+	struct aesd_circular_buffer snap;
+	unsigned int seq;
+	size_t start = 0;
+	bool valid;
+	int idx;
+	uint32_t new_capacity;
+	uint32_t follow;
 	int retval = 0;
-	int prev_cmd_offset = 0;
-	int i;
+	loff_t prev_cmd_offset = 0;
 
     PDEBUG("aesd_ioctl cmd=%i arg=%ld", cmd, arg);
 
@@ -207,34 +665,51 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			retval = -EFAULT;
 			break;
 		}
-		// Take mutex
-		if(mutex_lock_interruptible(&aesd_device.lock) != 0) {
-			// couldn't lock
-			PDEBUG("couldn't take mutex");
-			retval = -ERESTARTSYS;
-			break;
-		}
-
-		if((seekto.write_cmd >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) or (aesd_device.buffer.entry[seekto.write_cmd].size < seekto.write_cmd_offset)) {
+		idx = srcu_read_lock(&aesd_srcu);
+		do {
+			seq = aesd_buffer_snapshot(&snap);
+			// write_cmd counts from the oldest write kept
+			entry = aesd_circular_buffer_entry_at(&snap, seekto.write_cmd);
+			valid = entry != NULL and entry->size >= seekto.write_cmd_offset;
+			if(valid) {
+				// Bytes in previous entries, kept as running sums by the buffer
+				prev_cmd_offset = aesd_circular_buffer_offset_of(&snap, seekto.write_cmd);
+				start = aesd_buffer_start(&snap);
+			}
+		} while(read_seqcount_retry(&aesd_device.seq, seq));
+		srcu_read_unlock(&aesd_srcu, idx);
+		if(not valid) {
 			PDEBUG("bad argument");
 			retval = -EINVAL;
-			mutex_unlock(&aesd_device.lock);
 			break;
 		}
 
-		// Count bytes in previous entries 
-		for(i = 0; i < seekto.write_cmd; ++i) {
-			prev_cmd_offset += aesd_device.buffer.entry[i].size;
-		}
-
 		PDEBUG("previous f_pos=%lli", filp->f_pos);
 		// Update f_pos
 		filp->f_pos = prev_cmd_offset + seekto.write_cmd_offset;
+		WRITE_ONCE(file->base, start);
 		PDEBUG("new f_pos=%lli", filp->f_pos);
-		
+		break;
 
-		// Release mutex
-		mutex_unlock(&aesd_device.lock);
+		case AESDCHAR_IOCRESIZE:
+		PDEBUG("AESDCHAR_IOCRESIZE");
+		if(copy_from_user(&new_capacity, (const void __user *)arg, sizeof(new_capacity)) != 0) {
+			PDEBUG("Failed to copy arg from userspace.");
+			retval = -EFAULT;
+			break;
+		}
+		retval = aesd_resize(new_capacity);
+		break;
+
+		case AESDCHAR_IOCFOLLOW:
+		PDEBUG("AESDCHAR_IOCFOLLOW");
+		if(copy_from_user(&follow, (const void __user *)arg, sizeof(follow)) != 0) {
+			PDEBUG("Failed to copy arg from userspace.");
+			retval = -EFAULT;
+			break;
+		}
+		WRITE_ONCE(file->base, aesd_current_start());
+		WRITE_ONCE(file->follow, follow != 0);
 		break;
 
 		default:
@@ -244,6 +719,27 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	return retval;
 }
 
+/**
+ * Map the header page and the arena read-only, as aesd_mmap.h describes.  Only a device loaded with an
+ * arena can be mapped.
+ */
+static int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	if(aesd_device.header == NULL) {
+		return -ENODEV;
+	}
+	if(vma->vm_flags & VM_WRITE) {
+		return -EACCES;
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+	// checks the mapping fits the allocation
+	return remap_vmalloc_range(vma, aesd_device.header, vma->vm_pgoff);
+}
+
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
 	.llseek = 	aesd_llseek,
@@ -252,6 +748,8 @@ struct file_operations aesd_fops = {
     .open =     aesd_open,
     .release =  aesd_release,
 	.unlocked_ioctl = aesd_ioctl,
+	.mmap =     aesd_mmap,
+	.poll =     aesd_poll,
 };
 
 static int aesd_setup_cdev(struct aesd_dev *dev)
@@ -274,11 +772,23 @@ int aesd_init_module(void)
 {
     dev_t dev = 0;
     int result;
+	struct aesd_buffer_entry *entries;
+
+	if(capacity == 0 or capacity > AESDCHAR_MAX_CAPACITY) {
+		printk(KERN_WARNING "aesdchar: capacity must be 1 to %u writes\n", AESDCHAR_MAX_CAPACITY);
+		return -EINVAL;
+	}
+	entries = kvcalloc(capacity, sizeof(struct aesd_buffer_entry), GFP_KERNEL);
+	if(entries == NULL) {
+		return -ENOMEM;
+	}
+
     result = alloc_chrdev_region(&dev, aesd_minor, 1,
             "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
+		kvfree(entries);
         return result;
     }
     memset(&aesd_device,0,sizeof(struct aesd_dev));
@@ -286,12 +796,31 @@ int aesd_init_module(void)
     /**
      * TODO: initialize the AESD specific portion of the device
      */
+	aesd_circular_buffer_init_entries(&aesd_device.buffer, entries, capacity);
+	arena_size &= ~(AESD_MMAP_ALIGN - 1);
+	if(arena_size > 0) {
+		// vmalloc_user memory is zeroed and can be mapped to userspace
+		aesd_device.header = vmalloc_user(PAGE_SIZE + PAGE_ALIGN(arena_size));
+		if(aesd_device.header == NULL) {
+			unregister_chrdev_region(dev, 1);
+			kvfree(entries);
+			return -ENOMEM;
+		}
+		aesd_device.arena = (char *)aesd_device.header + PAGE_SIZE;
+		aesd_device.arena_size = arena_size;
+		aesd_device.header->arena_offset = PAGE_SIZE;
+		aesd_device.header->arena_size = arena_size;
+	}
 	mutex_init(&aesd_device.lock);
+	seqcount_mutex_init(&aesd_device.seq, &aesd_device.lock);
+	init_waitqueue_head(&aesd_device.wait);
 	
     result = aesd_setup_cdev(&aesd_device);
 
     if( result ) {
         unregister_chrdev_region(dev, 1);
+		kvfree(entries);
+		vfree(aesd_device.header);
     }
     return result;
 
@@ -299,7 +828,7 @@ int aesd_init_module(void)
 
 void aesd_cleanup_module(void)
 {
-	uint8_t index;
+	uint32_t index;
 	struct aesd_buffer_entry *entry;
 
     dev_t devno = MKDEV(aesd_major, aesd_minor);
@@ -310,10 +839,14 @@ void aesd_cleanup_module(void)
      * TODO: cleanup AESD specific poritions here as necessary
      */
 	AESD_CIRCULAR_BUFFER_FOREACH(entry,&aesd_device.buffer,index) {
-		kfree(entry->buffptr);
+		aesd_free_packet(entry->buffptr);
 	}
+	// the packets are freed from SRCU callbacks, which must all have run before the module goes
+	srcu_barrier(&aesd_srcu);
+	kvfree(aesd_device.buffer.entry);
+	vfree(aesd_device.header);
 
-	kfree(aesd_device.temp_write_data);  // No need to check for NULL, just pass everything in.
+	aesd_packet_kvfree(aesd_device.temp_write_data);  // No need to check for NULL, just pass everything in.
 
     unregister_chrdev_region(devno, 1);
 }
@@ -0,0 +1,235 @@
+/*
+ * aesd-commit.c
+ *
+ * Group commit stage, see aesd-commit.h
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <iso646.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "aesdsocket.h"
+#include "aesd-commit.h"
+#include "aesd-metrics.h"
+#include "aesd-log.h"
+#include "aesd-follow.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX (1024)
+#endif
+
+#define COMMIT_MAX_BATCH (IOV_MAX)
+
+STAILQ_HEAD(commit_queue, aesd_commit_req);
+
+struct commit_stage {
+	pthread_t thread_handle;
+	bool running;
+	bool terminate;
+	unsigned int window_us;
+	struct aesd_storage_handle store;
+
+	pthread_mutex_t lock;
+	pthread_cond_t queued; // signalled when the queue becomes non-empty
+	pthread_cond_t committed; // broadcast when a batch completes
+	struct commit_queue queue;
+
+	struct aesd_commit_stats stats;
+};
+
+static struct commit_stage stage = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.queued = PTHREAD_COND_INITIALIZER,
+	.committed = PTHREAD_COND_INITIALIZER,
+	.store = {.fd = -1},
+};
+
+static void commit_record_batch(int count, size_t bytes)
+{
+	int bucket = 0;
+	while(bucket < AESD_COMMIT_HIST_BUCKETS - 1 and (count >> (bucket + 1)) > 0) {
+		bucket++;
+	}
+	stage.stats.batches++;
+	stage.stats.packets += count;
+	stage.stats.bytes += bytes;
+	stage.stats.batch_hist[bucket]++;
+	if((unsigned long)count > stage.stats.max_batch) {
+		stage.stats.max_batch = count;
+	}
+}
+
+static void commit_complete(struct aesd_commit_req *req, int status)
+{
+	req->status = status;
+	if(req->complete != NULL) {
+		req->complete(req);
+	} else {
+		pthread_mutex_lock(&stage.lock);
+		req->done = true;
+		pthread_mutex_unlock(&stage.lock);
+	}
+}
+
+static void *commit_handler(void *args)
+{
+	(void)args;
+	struct iovec iov[COMMIT_MAX_BATCH];
+	struct aesd_commit_req *batch[COMMIT_MAX_BATCH];
+
+	pthread_mutex_lock(&stage.lock);
+	while(true) {
+		while(STAILQ_EMPTY(&stage.queue) and not stage.terminate) {
+			pthread_cond_wait(&stage.queued, &stage.lock);
+		}
+		if(STAILQ_EMPTY(&stage.queue)) {
+			break; // terminating with nothing left to commit
+		}
+
+		if(stage.window_us > 0 and not stage.terminate) {
+			// let packets from other connections join this batch
+			struct timespec window = {.tv_sec = stage.window_us / 1000000, .tv_nsec = (stage.window_us % 1000000) * 1000};
+			pthread_mutex_unlock(&stage.lock);
+			nanosleep(&window, NULL);
+			pthread_mutex_lock(&stage.lock);
+		}
+
+		int count = 0;
+		size_t bytes = 0;
+		while(count < COMMIT_MAX_BATCH and not STAILQ_EMPTY(&stage.queue)) {
+			struct aesd_commit_req *req = STAILQ_FIRST(&stage.queue);
+			STAILQ_REMOVE_HEAD(&stage.queue, entries);
+			batch[count] = req;
+			iov[count].iov_base = (void*)req->data;
+			iov[count].iov_len = req->len;
+			bytes += req->len;
+			count++;
+		}
+		pthread_mutex_unlock(&stage.lock);
+
+		uint64_t start_ns = aesd_metrics_now();
+		pthread_rwlock_wrlock(&file_rwlock);
+		uint64_t locked_ns = aesd_metrics_now();
+		int status = aesd_storage_writev(&stage.store, iov, count);
+		if(status != 0) {
+			aesd_log(LOG_ERR, "error writing batch of %i packets to file.", count);
+			aesd_metrics_add(AESD_COUNTER_ERRORS, 1);
+		} else {
+			for(int i = 0; i < count; ++i) {
+				aesd_follow_publish(batch[i]->data, batch[i]->len);
+			}
+		}
+		pthread_rwlock_unlock(&file_rwlock);
+		aesd_metrics_observe(AESD_HIST_LOCK_WAIT, locked_ns - start_ns);
+		aesd_metrics_since(AESD_HIST_WRITE, locked_ns);
+
+		for(int i = 0; i < count; ++i) {
+			commit_complete(batch[i], status);
+		}
+
+		pthread_mutex_lock(&stage.lock);
+		commit_record_batch(count, bytes);
+		pthread_cond_broadcast(&stage.committed);
+	}
+	pthread_mutex_unlock(&stage.lock);
+	return (void*)0;
+}
+
+int aesd_commit_start(unsigned int window_us)
+{
+	if(aesd_storage_handle_open(&stage.store) != 0) {
+		aesd_log(LOG_ERR, "error opening the %s store", aesd_storage_name());
+		return -1;
+	}
+
+	STAILQ_INIT(&stage.queue);
+	stage.window_us = window_us;
+	stage.terminate = false;
+	if(aesd_create_thread(&stage.thread_handle, commit_handler, NULL) != 0) {
+		aesd_log(LOG_ERR, "thread creation failed");
+		aesd_storage_handle_close(&stage.store);
+		return -1;
+	}
+	stage.running = true;
+	aesd_log(LOG_INFO, "group commit started with a %u us window", window_us);
+	return 0;
+}
+
+void aesd_commit_stop(void)
+{
+	if(not stage.running) {
+		return;
+	}
+
+	pthread_mutex_lock(&stage.lock);
+	stage.terminate = true;
+	pthread_cond_signal(&stage.queued);
+	pthread_mutex_unlock(&stage.lock);
+	pthread_join(stage.thread_handle, NULL);
+
+	stage.running = false;
+	aesd_storage_handle_close(&stage.store);
+
+	aesd_log(LOG_INFO, "group commit: %lu packets in %lu batches, largest batch %lu",
+			stage.stats.packets, stage.stats.batches, stage.stats.max_batch);
+}
+
+bool aesd_commit_enabled(void)
+{
+	return stage.running;
+}
+
+void aesd_commit_submit(struct aesd_commit_req *req)
+{
+	req->done = false;
+
+	pthread_mutex_lock(&stage.lock);
+	if(stage.running and not stage.terminate) {
+		STAILQ_INSERT_TAIL(&stage.queue, req, entries);
+		pthread_cond_signal(&stage.queued);
+		pthread_mutex_unlock(&stage.lock);
+		return;
+	}
+	pthread_mutex_unlock(&stage.lock);
+
+	// no commit thread to hand this to, write it straight out
+	int status = 0;
+	struct aesd_storage_handle store;
+	int opened = aesd_storage_handle_open(&store);
+	pthread_rwlock_wrlock(&file_rwlock);
+	if(opened != 0 or aesd_storage_write(&store, req->data, req->len) != 0) {
+		aesd_log(LOG_ERR, "error writing data to file.");
+		status = -1;
+	} else {
+		aesd_follow_publish(req->data, req->len);
+	}
+	pthread_rwlock_unlock(&file_rwlock);
+	if(opened == 0) {
+		aesd_storage_handle_close(&store);
+	}
+	commit_complete(req, status);
+}
+
+int aesd_commit_wait(struct aesd_commit_req *req)
+{
+	pthread_mutex_lock(&stage.lock);
+	while(not req->done) {
+		pthread_cond_wait(&stage.committed, &stage.lock);
+	}
+	pthread_mutex_unlock(&stage.lock);
+	return req->status;
+}
+
+void aesd_commit_get_stats(struct aesd_commit_stats *stats)
+{
+	pthread_mutex_lock(&stage.lock);
+	*stats = stage.stats;
+	pthread_mutex_unlock(&stage.lock);
+}
@@ -0,0 +1,75 @@
+/*
+ * aesd-commit.h
+ *
+ * Group commit stage for aesdsocket.  Connections hand complete packets to a single commit thread, which
+ * waits a short window for packets from other connections to arrive, writes the whole batch with one
+ * writev() and one fdatasync() under the write lock, then completes every request in the batch.
+ */
+
+#ifndef AESD_COMMIT_H
+#define AESD_COMMIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/queue.h>
+
+#define AESD_COMMIT_HIST_BUCKETS (11) // batch sizes 1, 2-3, 4-7, ... 512-1023, 1024+
+
+struct aesd_commit_req {
+	const char *data;
+	size_t len;
+	/**
+	 * 0 once committed, -1 if the write failed
+	 */
+	int status;
+	bool done;
+	/**
+	 * Called from the commit thread once the request is complete, or NULL to wait with aesd_commit_wait
+	 */
+	void (*complete)(struct aesd_commit_req *req);
+	void *context;
+	STAILQ_ENTRY(aesd_commit_req) entries;
+};
+
+struct aesd_commit_stats {
+	unsigned long batches;
+	unsigned long packets;
+	unsigned long bytes;
+	unsigned long max_batch;
+	/**
+	 * Number of batches by size, bucket i counts batches of 2^i to 2^(i+1)-1 packets
+	 */
+	unsigned long batch_hist[AESD_COMMIT_HIST_BUCKETS];
+};
+
+/**
+ * Start the commit thread, collecting packets for @param window_us microseconds per batch.
+ * @return 0 on success, -1 on failure
+ */
+int aesd_commit_start(unsigned int window_us);
+
+/**
+ * Commit everything still queued and stop the commit thread.  Safe to call when not started.
+ */
+void aesd_commit_stop(void);
+
+/**
+ * @return true if aesd_commit_start has started the commit thread
+ */
+bool aesd_commit_enabled(void);
+
+/**
+ * Queue @param req, whose data must stay valid until it completes.  If the commit thread isn't running
+ * the packet is written immediately and @param req completed before returning.
+ */
+void aesd_commit_submit(struct aesd_commit_req *req);
+
+/**
+ * Block until @param req, submitted without a completion callback, has been committed.
+ * @return the request status
+ */
+int aesd_commit_wait(struct aesd_commit_req *req);
+
+void aesd_commit_get_stats(struct aesd_commit_stats *stats);
+
+#endif /* AESD_COMMIT_H */
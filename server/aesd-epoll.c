@@ -0,0 +1,646 @@
+/*
+ * aesd-epoll.c
+ *
+ * Edge-triggered epoll reactor for aesdsocket.  A small fixed number of reactor threads each own an
+ * epoll instance watching the shared non-blocking listening socket (EPOLLEXCLUSIVE, so only one reactor
+ * is woken per incoming connection), or in shard mode a listening socket of their own, and the shared
+ * local socket.  Each reactor accepts, frames received data into lines, writes packets
+ * to OUTPUT_FILENAME and streams the read-back reply without ever blocking on a client.  With group commit
+ * running packets are queued instead, and the commit thread hands each connection back to its reactor
+ * through an eventfd once its batch is written.  With an idle timeout each reactor also watches a timerfd
+ * and closes the connections it owns which have gone quiet.
+ */
+
+#define _GNU_SOURCE // accept4, pthread_setaffinity_np
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <iso646.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "aesdsocket.h"
+#include "aesd-reply.h"
+#include "aesd-framer.h"
+#include "aesd-commit.h"
+#include "aesd-metrics.h"
+#include "aesd-log.h"
+#include "aesd-follow.h"
+#include "aesd-timer.h"
+
+#define EPOLL_MAX_EVENTS (64)
+
+struct epoll_conn {
+	int client_fd;
+	struct aesd_storage_handle store;
+	char client_ip[INET6_ADDRSTRLEN];
+
+	struct aesd_framer framer;
+
+	// read-back reply being streamed to the client
+	struct aesd_reply reply;
+	bool replying;
+	bool eof; // client has shut down its side of the connection
+
+	uint64_t accepted_ns; // cleared once the first byte has been received
+	uint64_t request_ns; // start of the request being handled, 0 between requests
+	uint64_t active_ns; // last event on the connection, for idle reaping
+
+	// packet queued with the group commit stage, the connection is idle until it completes
+	struct aesd_commit_req commit;
+	bool committing;
+	struct epoll_reactor *reactor;
+
+	LIST_ENTRY(epoll_conn) entries;
+	STAILQ_ENTRY(epoll_conn) committed_entries;
+};
+
+struct epoll_reactor {
+	pthread_t thread_handle;
+	int listen_fd; // server_fd, or this shard's own SO_REUSEPORT socket
+	int epoll_fd;
+	int wake_fd; // eventfd used to stop the reactor
+	int idle_fd; // timerfd for reaping idle connections, -1 without an idle timeout
+	bool terminate;
+	LIST_HEAD(epoll_conn_list, epoll_conn) conns;
+
+	// the epoll_wait batch being handled, events from batch_next on are still to come
+	struct epoll_event *batch;
+	int batch_next;
+	int batch_count;
+
+	// connections whose group commit has completed, filled by the commit thread
+	int commit_fd; // eventfd signalled when a connection is added
+	pthread_mutex_t committed_lock;
+	STAILQ_HEAD(epoll_committed_list, epoll_conn) committed;
+
+	// read by the metrics admin thread, shows how evenly connections are spread
+	atomic_ulong accepted;
+	atomic_long active;
+	atomic_ulong bytes_in;
+};
+
+static struct epoll_reactor *reactors = NULL;
+static int num_reactors = 0;
+
+// epoll_event.data.ptr markers for the non-connection descriptors
+static char listen_marker;
+static char local_marker;
+static char wake_marker;
+static char commit_marker;
+static char idle_marker;
+
+static int set_nonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if(flags < 0) {
+		return -1;
+	}
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * Drop the events for @param conn still to be handled in its reactor's batch.  One batch can hold an
+ * event which closes a connection, a commit or idle timer event, and then an event for that connection.
+ */
+static void epoll_forget_events(struct epoll_conn *conn)
+{
+	struct epoll_reactor *reactor = conn->reactor;
+	for(int i = reactor->batch_next; i < reactor->batch_count; ++i) {
+		if(reactor->batch[i].data.ptr == conn) {
+			reactor->batch[i].data.ptr = NULL;
+		}
+	}
+}
+
+static void epoll_conn_close(struct epoll_conn *conn)
+{
+	epoll_forget_events(conn);
+	LIST_REMOVE(conn, entries);
+	atomic_fetch_sub_explicit(&conn->reactor->active, 1, memory_order_relaxed);
+	aesd_storage_handle_close(&conn->store);
+	// a follower's socket now belongs to the follow hub, which logs its close
+	if(conn->client_fd >= 0) {
+		close(conn->client_fd); // also removes it from the epoll set
+		aesd_log(LOG_INFO, "Closed connection from %s", conn->client_ip);
+		aesd_metrics_add(AESD_COUNTER_ACTIVE, -1);
+	}
+	aesd_framer_free(&conn->framer);
+	aesd_reply_free(&conn->reply);
+	free(conn);
+}
+
+/**
+ * Group commit completion callback, runs on the commit thread.  Hands the connection back to its reactor.
+ */
+static void epoll_conn_commit_done(struct aesd_commit_req *req)
+{
+	struct epoll_conn *conn = req->context;
+	struct epoll_reactor *reactor = conn->reactor;
+	uint64_t wake = 1;
+
+	pthread_mutex_lock(&reactor->committed_lock);
+	STAILQ_INSERT_TAIL(&reactor->committed, conn, committed_entries);
+	pthread_mutex_unlock(&reactor->committed_lock);
+	if(write(reactor->commit_fd, &wake, sizeof wake) != sizeof wake) {
+		aesd_log(LOG_ERR, "error waking reactor for commit");
+	}
+}
+
+/**
+ * Accept every connection waiting on @param listen_fd
+ */
+static void epoll_accept(struct epoll_reactor *reactor, int listen_fd)
+{
+	while(true) {
+		struct sockaddr_storage their_addr;
+		socklen_t addr_size = sizeof their_addr;
+		int client_fd = accept4(listen_fd, (struct sockaddr*)&their_addr, &addr_size, SOCK_NONBLOCK);
+		if(client_fd < 0) {
+			if(errno == EINTR or errno == ECONNABORTED) {
+				continue;
+			}
+			if(errno != EAGAIN and errno != EWOULDBLOCK and not server_terminate) {
+				aesd_log(LOG_ERR, "accept failed: %s", strerror(errno));
+			}
+			return;
+		}
+
+		struct epoll_conn *conn = calloc(1, sizeof(struct epoll_conn));
+		if(conn == NULL) {
+			aesd_log(LOG_ERR, "Error allocating connection.");
+			close(client_fd);
+			continue;
+		}
+		aesd_metrics_add(AESD_COUNTER_ACCEPTED, 1);
+		conn->client_fd = client_fd;
+		conn->accepted_ns = aesd_metrics_now();
+		conn->active_ns = conn->accepted_ns;
+		conn->reactor = reactor;
+		conn->commit.complete = epoll_conn_commit_done;
+		conn->commit.context = conn;
+		if(config.keep_alive) {
+			// replies are small and sent one per request, don't let Nagle hold them back
+			setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+		}
+		aesd_framer_init(&conn->framer);
+		aesd_reply_init(&conn->reply, config.force_copy_reply);
+
+		if(aesd_addr_string(&their_addr, conn->client_ip, sizeof conn->client_ip) != 0) {
+			aesd_log(LOG_ERR, "inet_ntop failed");
+		}
+
+		if(aesd_storage_handle_open(&conn->store) != 0) {
+			aesd_log(LOG_ERR, "error opening the %s store", aesd_storage_name());
+			close(client_fd);
+			free(conn);
+			continue;
+		}
+
+		LIST_INSERT_HEAD(&reactor->conns, conn, entries);
+		atomic_fetch_add_explicit(&reactor->accepted, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&reactor->active, 1, memory_order_relaxed);
+		aesd_log(LOG_INFO, "Accepted connection from %s", conn->client_ip);
+		aesd_metrics_add(AESD_COUNTER_ACTIVE, 1);
+
+		struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn};
+		if(epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) != 0) {
+			aesd_log(LOG_ERR, "epoll_ctl failed adding client: %s", strerror(errno));
+			epoll_conn_close(conn);
+		}
+	}
+}
+
+/**
+ * Handle the complete requests received so far and start the read-back reply if one is due.
+ * @return 0 on success, -1 if the connection should be closed
+ */
+static int epoll_conn_request(struct epoll_conn *conn, bool eof)
+{
+	if(conn->request_ns == 0) {
+		conn->request_ns = aesd_metrics_now();
+	}
+	int result = aesd_handle_requests(&conn->framer, &conn->store, eof, &conn->reply, &conn->commit);
+
+	if(result <= 0) {
+		conn->request_ns = 0;
+		return result;
+	}
+	if(result == AESD_REQUEST_FOLLOW) {
+		// hand the socket to the follow hub and close the rest of the connection
+		if(epoll_ctl(conn->reactor->epoll_fd, EPOLL_CTL_DEL, conn->client_fd, NULL) == 0 and
+				aesd_follow_add(conn->client_fd, conn->client_ip) == 0) {
+			conn->client_fd = -1;
+		}
+		return -1;
+	}
+	if(result == AESD_REQUEST_COMMITTING) {
+		conn->committing = true;
+	} else {
+		conn->replying = true;
+	}
+	return 0;
+}
+
+/**
+ * Drain the socket until it would block or a complete request has been received.
+ * @return 0 to keep the connection open, -1 to close it
+ */
+static int epoll_conn_recv(struct epoll_conn *conn)
+{
+	while(not conn->replying and not conn->committing) {
+		size_t avail;
+		char *rx_data = aesd_framer_space(&conn->framer, AESD_RECV_LEN, &avail);
+		if(rx_data == NULL) {
+			aesd_log(LOG_ERR, "Error allocating receive buffer, discarding packet.");
+			aesd_metrics_add(AESD_COUNTER_ERRORS, 1);
+			return -1;
+		}
+
+		ssize_t numbytes = recv(conn->client_fd, rx_data, avail, 0);
+		if(numbytes < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			if(errno == EAGAIN or errno == EWOULDBLOCK) {
+				return 0;
+			}
+			return -1;
+		}
+		if(numbytes == 0) {
+			conn->eof = true;
+			if(epoll_conn_request(conn, true) != 0 or not (conn->replying or conn->committing)) {
+				return -1;
+			}
+			return 0;
+		}
+		aesd_log(LOG_DEBUG, "recieved %zi bytes.", numbytes);
+		if(conn->accepted_ns != 0) {
+			aesd_metrics_since(AESD_HIST_FIRST_BYTE, conn->accepted_ns);
+			conn->accepted_ns = 0;
+		}
+		aesd_metrics_add(AESD_COUNTER_BYTES_IN, numbytes);
+		atomic_fetch_add_explicit(&conn->reactor->bytes_in, numbytes, memory_order_relaxed);
+		aesd_framer_commit(&conn->framer, numbytes);
+
+		if(epoll_conn_request(conn, false) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void epoll_conn_event(struct epoll_conn *conn, uint32_t events)
+{
+	if(conn->committing) {
+		return; // the commit thread still references the connection, errors are seen once it's handed back
+	}
+	if(config.idle_timeout_s > 0) {
+		conn->active_ns = aesd_metrics_now();
+	}
+	if(events & EPOLLERR) {
+		epoll_conn_close(conn);
+		return;
+	}
+
+	while(not conn->committing) {
+		if(conn->replying) {
+			size_t sent_before = conn->reply.bytes_sent;
+			int result = aesd_reply_send(&conn->reply, conn->client_fd);
+			aesd_metrics_add(AESD_COUNTER_BYTES_OUT, conn->reply.bytes_sent - sent_before);
+			if(result == 0) {
+				return; // wait for EPOLLOUT
+			}
+			if(result < 0) {
+				aesd_log(LOG_ERR, "error sending reply to %s", conn->client_ip);
+				aesd_metrics_add(AESD_COUNTER_ERRORS, 1);
+			} else {
+				aesd_metrics_since(AESD_HIST_REQUEST, conn->request_ns);
+				conn->request_ns = 0;
+			}
+			if(result < 0 or not config.keep_alive) {
+				// reply failed or complete, either way this connection is finished
+				epoll_conn_close(conn);
+				return;
+			}
+
+			// a pipelined request may already be buffered, answer it before receiving more
+			conn->replying = false;
+			if(epoll_conn_request(conn, conn->eof) != 0 or (conn->eof and not (conn->replying or conn->committing))) {
+				epoll_conn_close(conn);
+				return;
+			}
+			continue;
+		}
+
+		if(epoll_conn_recv(conn) != 0) {
+			epoll_conn_close(conn);
+			return;
+		}
+		if(not conn->replying) {
+			return; // wait for EPOLLIN
+		}
+	}
+}
+
+/**
+ * Continue each connection whose queued packet the commit thread has finished with.
+ */
+static void epoll_committed(struct epoll_reactor *reactor)
+{
+	struct epoll_committed_list committed = STAILQ_HEAD_INITIALIZER(committed);
+	uint64_t count;
+
+	if(read(reactor->commit_fd, &count, sizeof count) < 0 and errno != EAGAIN) {
+		aesd_log(LOG_ERR, "error reading commit eventfd: %s", strerror(errno));
+	}
+	pthread_mutex_lock(&reactor->committed_lock);
+	STAILQ_CONCAT(&committed, &reactor->committed);
+	pthread_mutex_unlock(&reactor->committed_lock);
+
+	while(not STAILQ_EMPTY(&committed)) {
+		struct epoll_conn *conn = STAILQ_FIRST(&committed);
+		STAILQ_REMOVE_HEAD(&committed, committed_entries);
+
+		conn->committing = false;
+		if(epoll_conn_request(conn, conn->eof) != 0 or (conn->eof and not (conn->replying or conn->committing))) {
+			epoll_conn_close(conn);
+			continue;
+		}
+		// edges seen while committing were ignored, so send and receive until the socket would block
+		epoll_conn_event(conn, 0);
+	}
+}
+
+/**
+ * Close each connection which has seen no event for config.idle_timeout_s.  One waiting on the
+ * commit thread is left alone, it can't be freed until it's handed back.  Runs once the batch the
+ * timer fired in has been handled, so connections with events in it count as active and none of
+ * the connections it frees still has an event to come.
+ */
+static void epoll_reap_idle(struct epoll_reactor *reactor)
+{
+	if(aesd_timer_expirations(reactor->idle_fd) == 0) {
+		return;
+	}
+	uint64_t now = aesd_metrics_now();
+	uint64_t timeout_ns = config.idle_timeout_s * 1000000000ULL;
+	struct epoll_conn *conn = LIST_FIRST(&reactor->conns);
+	while(conn != NULL) {
+		struct epoll_conn *next = LIST_NEXT(conn, entries);
+		if(not conn->committing and now - conn->active_ns > timeout_ns) {
+			aesd_log(LOG_INFO, "Closing idle connection from %s", conn->client_ip);
+			epoll_conn_close(conn);
+		}
+		conn = next;
+	}
+}
+
+static void *epoll_reactor_handler(void *args)
+{
+	struct epoll_reactor *reactor = args;
+	struct epoll_event events[EPOLL_MAX_EVENTS];
+
+	while(not reactor->terminate) {
+		int count = epoll_wait(reactor->epoll_fd, events, EPOLL_MAX_EVENTS, -1);
+		if(count < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			aesd_log(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+			break;
+		}
+
+		bool reap = false;
+		reactor->batch = events;
+		reactor->batch_count = count;
+		for(int i = 0; i < count; ++i) {
+			reactor->batch_next = i + 1;
+			if(events[i].data.ptr == NULL) {
+				continue; // its connection was closed earlier in the batch
+			} else if(events[i].data.ptr == &wake_marker) {
+				reactor->terminate = true;
+			} else if(events[i].data.ptr == &commit_marker) {
+				epoll_committed(reactor);
+			} else if(events[i].data.ptr == &idle_marker) {
+				reap = true;
+			} else if(events[i].data.ptr == &listen_marker) {
+				epoll_accept(reactor, reactor->listen_fd);
+			} else if(events[i].data.ptr == &local_marker) {
+				epoll_accept(reactor, local_fd);
+			} else {
+				epoll_conn_event(events[i].data.ptr, events[i].events);
+			}
+		}
+		reactor->batch_count = 0;
+		if(reap) {
+			epoll_reap_idle(reactor);
+		}
+	}
+	return (void*)0;
+}
+
+/**
+ * Open another listening socket bound to server_fd's address, for a shard after the first
+ * @return the socket, or -1 on failure
+ */
+static int epoll_open_shard_listener(void)
+{
+	struct sockaddr_storage addr;
+	socklen_t addr_size = sizeof addr;
+
+	if(getsockname(server_fd, (struct sockaddr*)&addr, &addr_size) != 0) {
+		return -1;
+	}
+	int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0) {
+		return -1;
+	}
+	// dual stack like server_fd, or IPv4 clients would only ever reach the first shard
+	if((addr.ss_family == AF_INET6 and setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &(int){0}, sizeof(int)) < 0) or
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0 or
+			setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0 or
+			bind(fd, (struct sockaddr*)&addr, addr_size) != 0 or listen(fd, NUM_CONNECTIONS) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * Pin reactor @param index to the index'th CPU this process may run on, wrapping around
+ */
+static void epoll_pin_reactor(struct epoll_reactor *reactor, int index)
+{
+	cpu_set_t allowed, pinned;
+	int count;
+
+	if(sched_getaffinity(0, sizeof allowed, &allowed) != 0 or (count = CPU_COUNT(&allowed)) == 0) {
+		return;
+	}
+	index %= count;
+	for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if(CPU_ISSET(cpu, &allowed) and index-- == 0) {
+			CPU_ZERO(&pinned);
+			CPU_SET(cpu, &pinned);
+			if(pthread_setaffinity_np(reactor->thread_handle, sizeof pinned, &pinned) != 0) {
+				aesd_log(LOG_ERR, "error pinning shard to cpu %i", cpu);
+			}
+			return;
+		}
+	}
+}
+
+int epoll_server_start(void)
+{
+	bool sharded = config.mode == AESD_MODE_SHARD;
+
+	if(set_nonblocking(server_fd) != 0 or (local_fd >= 0 and set_nonblocking(local_fd) != 0)) {
+		aesd_log(LOG_ERR, "error setting server socket non-blocking");
+		return -1;
+	}
+
+	reactors = calloc(config.num_threads, sizeof(struct epoll_reactor));
+	if(reactors == NULL) {
+		aesd_log(LOG_ERR, "Error allocating reactors.");
+		return -1;
+	}
+
+	for(num_reactors = 0; num_reactors < config.num_threads; ++num_reactors) {
+		struct epoll_reactor *reactor = &reactors[num_reactors];
+		LIST_INIT(&reactor->conns);
+		STAILQ_INIT(&reactor->committed);
+		pthread_mutex_init(&reactor->committed_lock, NULL);
+
+		reactor->listen_fd = server_fd;
+		reactor->idle_fd = -1;
+		if(sharded and num_reactors > 0) {
+			reactor->listen_fd = epoll_open_shard_listener();
+			if(reactor->listen_fd < 0) {
+				aesd_log(LOG_ERR, "error opening shard listening socket: %s", strerror(errno));
+				return -1;
+			}
+		}
+
+		reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		reactor->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		reactor->commit_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if(reactor->epoll_fd < 0 or reactor->wake_fd < 0 or reactor->commit_fd < 0) {
+			aesd_log(LOG_ERR, "error creating epoll reactor");
+			return -1;
+		}
+
+		struct epoll_event listen_ev = {.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE, .data.ptr = &listen_marker};
+		struct epoll_event wake_ev = {.events = EPOLLIN, .data.ptr = &wake_marker};
+		struct epoll_event commit_ev = {.events = EPOLLIN, .data.ptr = &commit_marker};
+		if(epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->listen_fd, &listen_ev) != 0 or
+				epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->wake_fd, &wake_ev) != 0 or
+				epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->commit_fd, &commit_ev) != 0) {
+			aesd_log(LOG_ERR, "epoll_ctl failed: %s", strerror(errno));
+			return -1;
+		}
+		struct epoll_event local_ev = {.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE, .data.ptr = &local_marker};
+		if(local_fd >= 0 and epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, local_fd, &local_ev) != 0) {
+			aesd_log(LOG_ERR, "epoll_ctl failed: %s", strerror(errno));
+			return -1;
+		}
+		if(config.idle_timeout_s > 0) {
+			struct epoll_event idle_ev = {.events = EPOLLIN, .data.ptr = &idle_marker};
+			reactor->idle_fd = aesd_timer_open(AESD_IDLE_CHECK_MS);
+			if(reactor->idle_fd < 0 or epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->idle_fd, &idle_ev) != 0) {
+				aesd_log(LOG_ERR, "error creating idle timer: %s", strerror(errno));
+				return -1;
+			}
+		}
+
+		if(aesd_create_thread(&reactor->thread_handle, epoll_reactor_handler, reactor) != 0) {
+			aesd_log(LOG_ERR, "thread creation failed");
+			return -1;
+		}
+		if(sharded) {
+			epoll_pin_reactor(reactor, num_reactors);
+		}
+	}
+	aesd_log(LOG_INFO, "%s mode started with %i reactor threads", sharded ? "shard" : "epoll", num_reactors);
+	return 0;
+}
+
+void epoll_server_stop_accepting(void)
+{
+	for(int i = 0; i < num_reactors; ++i) {
+		struct epoll_reactor *reactor = &reactors[i];
+		if(epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, reactor->listen_fd, NULL) != 0 or
+				(local_fd >= 0 and epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, local_fd, NULL) != 0)) {
+			aesd_log(LOG_ERR, "epoll_ctl failed removing listener: %s", strerror(errno));
+		}
+		// server_fd lives on in the replacement, a shard's own socket leaves the SO_REUSEPORT group
+		if(reactor->listen_fd != server_fd) {
+			shutdown(reactor->listen_fd, SHUT_RDWR);
+		}
+	}
+}
+
+void epoll_server_stop(void)
+{
+	for(int i = 0; i < num_reactors; ++i) {
+		uint64_t wake = 1;
+		if(write(reactors[i].wake_fd, &wake, sizeof wake) != sizeof wake) {
+			aesd_log(LOG_ERR, "error waking reactor %i", i);
+		}
+	}
+
+	for(int i = 0; i < num_reactors; ++i) {
+		pthread_join(reactors[i].thread_handle, NULL);
+	}
+	// complete any queued packets before freeing the connections the commit thread refers to
+	aesd_commit_stop();
+
+	for(int i = 0; i < num_reactors; ++i) {
+		struct epoll_reactor *reactor = &reactors[i];
+		while(not LIST_EMPTY(&reactor->conns)) {
+			epoll_conn_close(LIST_FIRST(&reactor->conns));
+		}
+		if(reactor->listen_fd != server_fd) {
+			close(reactor->listen_fd);
+		}
+		if(reactor->idle_fd >= 0) {
+			close(reactor->idle_fd);
+		}
+		close(reactor->commit_fd);
+		close(reactor->wake_fd);
+		close(reactor->epoll_fd);
+		aesd_log(LOG_INFO, "reactor %i accepted %lu connections", i, atomic_load(&reactor->accepted));
+		pthread_mutex_destroy(&reactor->committed_lock);
+	}
+
+	free(reactors);
+	reactors = NULL;
+	num_reactors = 0;
+}
+
+void epoll_server_write_metrics(FILE *out)
+{
+	fprintf(out, "# HELP aesd_reactor_connections_accepted_total Connections accepted by each reactor.\n");
+	fprintf(out, "# TYPE aesd_reactor_connections_accepted_total counter\n");
+	for(int i = 0; i < num_reactors; ++i) {
+		fprintf(out, "aesd_reactor_connections_accepted_total{reactor=\"%i\"} %lu\n", i, atomic_load_explicit(&reactors[i].accepted, memory_order_relaxed));
+	}
+	fprintf(out, "# HELP aesd_reactor_connections_active Connections currently open on each reactor.\n");
+	fprintf(out, "# TYPE aesd_reactor_connections_active gauge\n");
+	for(int i = 0; i < num_reactors; ++i) {
+		fprintf(out, "aesd_reactor_connections_active{reactor=\"%i\"} %li\n", i, atomic_load_explicit(&reactors[i].active, memory_order_relaxed));
+	}
+	fprintf(out, "# HELP aesd_reactor_received_bytes_total Bytes received by each reactor.\n");
+	fprintf(out, "# TYPE aesd_reactor_received_bytes_total counter\n");
+	for(int i = 0; i < num_reactors; ++i) {
+		fprintf(out, "aesd_reactor_received_bytes_total{reactor=\"%i\"} %lu\n", i, atomic_load_explicit(&reactors[i].bytes_in, memory_order_relaxed));
+	}
+}
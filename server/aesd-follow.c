@@ -0,0 +1,430 @@
+/*
+ * aesd-follow.c
+ *
+ * Follow hub, see aesd-follow.h
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <iso646.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include "aesdsocket.h"
+#include "aesd-follow.h"
+#include "aesd-metrics.h"
+#include "aesd-log.h"
+
+#define FOLLOW_QUEUE_DEPTH (256) // packets a follower may fall behind before it is disconnected
+#define FOLLOW_MAX_IOV (64) // packets sent per writev()
+#define FOLLOW_MAX_EVENTS (64)
+#define FOLLOW_READ_LEN (64 * 1024)
+
+/**
+ * One written packet, shared by every follower it was queued for
+ */
+struct follow_packet {
+	atomic_int refs;
+	size_t len;
+	char data[];
+};
+
+struct follower {
+	int fd;
+	char client_ip[INET6_ADDRSTRLEN];
+	// ring of queued packets, head advanced by publishers and tail by the hub thread, both under hub.lock
+	struct follow_packet *queue[FOLLOW_QUEUE_DEPTH];
+	unsigned int head;
+	unsigned int tail;
+	bool lagged; // the queue overflowed, disconnect
+	size_t sent; // bytes of the packet at tail already sent, hub thread only
+	LIST_ENTRY(follower) entries;
+};
+
+struct follow_hub {
+	pthread_t thread_handle;
+	bool running;
+	atomic_bool terminate;
+	int epoll_fd;
+	int wake_fd;
+	pthread_mutex_t lock;
+	LIST_HEAD(follower_list, follower) followers;
+	atomic_int count; // followers in the list, checked by publishers without the lock
+	atomic_bool wake_pending; // coalesces wakes from a burst of publishes
+};
+
+static struct follow_hub hub = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.epoll_fd = -1,
+	.wake_fd = -1,
+};
+
+static char wake_marker;
+
+static struct follow_packet *packet_alloc(size_t len)
+{
+	struct follow_packet *packet = malloc(sizeof(struct follow_packet) + len);
+	if(packet != NULL) {
+		atomic_init(&packet->refs, 1);
+		packet->len = len;
+	}
+	return packet;
+}
+
+static void packet_release(struct follow_packet *packet)
+{
+	if(atomic_fetch_sub_explicit(&packet->refs, 1, memory_order_acq_rel) == 1) {
+		free(packet);
+	}
+}
+
+/**
+ * @return the whole of the store as a packet, or NULL on error.  Call with file_rwlock held.
+ */
+static struct follow_packet *snapshot_file(void)
+{
+	struct aesd_storage_handle store;
+	if(aesd_storage_handle_open(&store) != 0) {
+		return NULL;
+	}
+	size_t cap = FOLLOW_READ_LEN;
+	struct follow_packet *packet = packet_alloc(cap);
+	if(packet == NULL) {
+		aesd_storage_handle_close(&store);
+		return NULL;
+	}
+	packet->len = 0;
+
+	while(true) {
+		if(packet->len == cap) {
+			cap *= 2;
+			struct follow_packet *grown = realloc(packet, sizeof(struct follow_packet) + cap);
+			if(grown == NULL) {
+				break;
+			}
+			packet = grown;
+		}
+		ssize_t numbytes = aesd_storage_read(&store, packet->data + packet->len, cap - packet->len);
+		if(numbytes < 0) {
+			break;
+		}
+		if(numbytes == 0) {
+			aesd_storage_handle_close(&store);
+			return packet;
+		}
+		packet->len += numbytes;
+	}
+	aesd_storage_handle_close(&store);
+	free(packet);
+	return NULL;
+}
+
+static void wake_hub(void)
+{
+	if(atomic_exchange(&hub.wake_pending, true)) {
+		return;
+	}
+	uint64_t wake = 1;
+	if(write(hub.wake_fd, &wake, sizeof wake) != sizeof wake) {
+		aesd_log(LOG_ERR, "error waking follow hub");
+	}
+}
+
+static void follower_close(struct follower *follower)
+{
+	pthread_mutex_lock(&hub.lock);
+	LIST_REMOVE(follower, entries);
+	atomic_fetch_sub(&hub.count, 1);
+	pthread_mutex_unlock(&hub.lock);
+
+	while(follower->tail != follower->head) {
+		packet_release(follower->queue[follower->tail++ % FOLLOW_QUEUE_DEPTH]);
+	}
+	close(follower->fd); // also removes it from the epoll set
+	if(follower->lagged) {
+		aesd_log(LOG_INFO, "Disconnected follower %s, it fell %i packets behind", follower->client_ip, FOLLOW_QUEUE_DEPTH);
+		aesd_metrics_add(AESD_COUNTER_FOLLOW_LAGGED, 1);
+	}
+	aesd_log(LOG_INFO, "Closed connection from %s", follower->client_ip);
+	aesd_metrics_add(AESD_COUNTER_FOLLOWERS, -1);
+	aesd_metrics_add(AESD_COUNTER_ACTIVE, -1);
+	free(follower);
+}
+
+/**
+ * Send as much of @param follower's queue as the socket takes
+ * @return 0 if the follower is still connected, -1 if it was closed
+ */
+static int follower_flush(struct follower *follower)
+{
+	struct iovec iov[FOLLOW_MAX_IOV];
+
+	while(true) {
+		// packets between tail and head stay put until this thread advances tail, only the indices need the lock
+		pthread_mutex_lock(&hub.lock);
+		bool lagged = follower->lagged;
+		unsigned int head = follower->head;
+		pthread_mutex_unlock(&hub.lock);
+		if(lagged) {
+			follower_close(follower);
+			return -1;
+		}
+
+		int count = 0;
+		for(unsigned int i = follower->tail; i != head and count < FOLLOW_MAX_IOV; ++i, ++count) {
+			struct follow_packet *packet = follower->queue[i % FOLLOW_QUEUE_DEPTH];
+			size_t skip = count == 0 ? follower->sent : 0;
+			iov[count].iov_base = packet->data + skip;
+			iov[count].iov_len = packet->len - skip;
+		}
+		if(count == 0) {
+			return 0;
+		}
+
+		ssize_t numbytes = writev(follower->fd, iov, count);
+		if(numbytes < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			if(errno == EAGAIN or errno == EWOULDBLOCK) {
+				return 0; // EPOLLOUT resumes it
+			}
+			follower_close(follower);
+			return -1;
+		}
+		aesd_metrics_add(AESD_COUNTER_BYTES_OUT, numbytes);
+
+		// release the packets sent in full
+		size_t done = numbytes;
+		unsigned int tail = follower->tail;
+		for(int i = 0; i < count and done >= iov[i].iov_len; ++i) {
+			done -= iov[i].iov_len;
+			packet_release(follower->queue[tail++ % FOLLOW_QUEUE_DEPTH]);
+			follower->sent = 0;
+		}
+		follower->sent += done;
+		pthread_mutex_lock(&hub.lock);
+		follower->tail = tail;
+		pthread_mutex_unlock(&hub.lock);
+	}
+}
+
+/**
+ * Discard anything @param follower sends, closing it once it disconnects
+ * @return 0 if the follower is still connected, -1 if it was closed
+ */
+static int follower_drain(struct follower *follower)
+{
+	char discard[AESD_RECV_LEN];
+
+	while(true) {
+		ssize_t numbytes = recv(follower->fd, discard, sizeof discard, 0);
+		if(numbytes > 0) {
+			continue;
+		}
+		if(numbytes < 0 and errno == EINTR) {
+			continue;
+		}
+		if(numbytes < 0 and (errno == EAGAIN or errno == EWOULDBLOCK)) {
+			return 0;
+		}
+		follower_close(follower);
+		return -1;
+	}
+}
+
+/**
+ * Clear the events after @param from in @param events for @param follower, which has just been freed
+ */
+static void forget_events(struct epoll_event *events, int from, int count, struct follower *follower)
+{
+	for(int i = from; i < count; ++i) {
+		if(events[i].data.ptr == follower) {
+			events[i].data.ptr = NULL;
+		}
+	}
+}
+
+static void *follow_handler(void *args)
+{
+	(void)args;
+	struct epoll_event events[FOLLOW_MAX_EVENTS];
+
+	while(not atomic_load(&hub.terminate)) {
+		int count = epoll_wait(hub.epoll_fd, events, FOLLOW_MAX_EVENTS, -1);
+		if(count < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			aesd_log(LOG_ERR, "follow epoll_wait failed: %s", strerror(errno));
+			break;
+		}
+
+		for(int i = 0; i < count; ++i) {
+			if(events[i].data.ptr == &wake_marker) {
+				uint64_t wakes;
+				if(read(hub.wake_fd, &wakes, sizeof wakes) < 0 and errno != EAGAIN) {
+					aesd_log(LOG_ERR, "error reading follow wake count");
+				}
+				atomic_store(&hub.wake_pending, false);
+				// packets were published, flush everyone with something queued.  Followers are only removed
+				// by this thread, the lock is just for followers being added.
+				pthread_mutex_lock(&hub.lock);
+				struct follower *follower = LIST_FIRST(&hub.followers);
+				pthread_mutex_unlock(&hub.lock);
+				while(follower != NULL) {
+					pthread_mutex_lock(&hub.lock);
+					struct follower *next = LIST_NEXT(follower, entries);
+					pthread_mutex_unlock(&hub.lock);
+					if(follower_flush(follower) != 0) {
+						forget_events(events, i + 1, count, follower);
+					}
+					follower = next;
+				}
+				continue;
+			}
+
+			struct follower *follower = events[i].data.ptr;
+			if(follower == NULL) {
+				continue;
+			}
+			if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+				if(follower_drain(follower) != 0) {
+					forget_events(events, i + 1, count, follower);
+					continue;
+				}
+			}
+			if((events[i].events & EPOLLOUT) and follower_flush(follower) != 0) {
+				forget_events(events, i + 1, count, follower);
+			}
+		}
+	}
+	return (void*)0;
+}
+
+int aesd_follow_start(void)
+{
+	LIST_INIT(&hub.followers);
+	atomic_store(&hub.terminate, false);
+	hub.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	hub.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	struct epoll_event wake_ev = {.events = EPOLLIN, .data.ptr = &wake_marker};
+	if(hub.epoll_fd < 0 or hub.wake_fd < 0 or epoll_ctl(hub.epoll_fd, EPOLL_CTL_ADD, hub.wake_fd, &wake_ev) != 0) {
+		aesd_log(LOG_ERR, "error creating follow hub: %s", strerror(errno));
+		return -1;
+	}
+	if(aesd_create_thread(&hub.thread_handle, follow_handler, NULL) != 0) {
+		aesd_log(LOG_ERR, "thread creation failed");
+		return -1;
+	}
+	hub.running = true;
+	return 0;
+}
+
+void aesd_follow_stop(void)
+{
+	if(not hub.running) {
+		return;
+	}
+	atomic_store(&hub.terminate, true);
+	wake_hub();
+	pthread_join(hub.thread_handle, NULL);
+	hub.running = false;
+
+	while(not LIST_EMPTY(&hub.followers)) {
+		follower_close(LIST_FIRST(&hub.followers));
+	}
+	close(hub.wake_fd);
+	close(hub.epoll_fd);
+}
+
+int aesd_follow_add(int client_fd, const char *client_ip)
+{
+	if(not hub.running) {
+		return -1;
+	}
+	struct follower *follower = calloc(1, sizeof(struct follower));
+	if(follower == NULL) {
+		aesd_log(LOG_ERR, "Error allocating follower.");
+		return -1;
+	}
+	follower->fd = client_fd;
+	strncpy(follower->client_ip, client_ip, sizeof follower->client_ip - 1);
+
+	int flags = fcntl(client_fd, F_GETFL, 0);
+	if(flags < 0 or fcntl(client_fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+		free(follower);
+		return -1;
+	}
+
+	// every packet is published under the write lock, so holding the read lock across the snapshot and
+	// joining the list puts the follower exactly between the packets it has and the ones it will get
+	pthread_rwlock_rdlock(&file_rwlock);
+	struct follow_packet *snapshot = snapshot_file();
+	if(snapshot == NULL) {
+		pthread_rwlock_unlock(&file_rwlock);
+		aesd_log(LOG_ERR, "error reading data from file.");
+		aesd_metrics_add(AESD_COUNTER_ERRORS, 1);
+		free(follower);
+		return -1;
+	}
+	follower->queue[follower->head++] = snapshot;
+	pthread_mutex_lock(&hub.lock);
+	LIST_INSERT_HEAD(&hub.followers, follower, entries);
+	atomic_fetch_add(&hub.count, 1);
+	pthread_mutex_unlock(&hub.lock);
+	pthread_rwlock_unlock(&file_rwlock);
+
+	aesd_log(LOG_INFO, "%s is following", client_ip);
+	aesd_metrics_add(AESD_COUNTER_FOLLOWERS, 1);
+
+	// edge triggered, flushes run until the socket would block
+	struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = follower};
+	if(epoll_ctl(hub.epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) != 0) {
+		aesd_log(LOG_ERR, "follow epoll_ctl failed: %s", strerror(errno));
+		// the hub may already be flushing it, have it disconnect instead
+		pthread_mutex_lock(&hub.lock);
+		follower->lagged = true;
+		pthread_mutex_unlock(&hub.lock);
+	}
+	wake_hub();
+	return 0;
+}
+
+void aesd_follow_publish(const char *data, size_t len)
+{
+	if(atomic_load_explicit(&hub.count, memory_order_relaxed) == 0 or len == 0) {
+		return;
+	}
+	struct follow_packet *packet = packet_alloc(len);
+	if(packet == NULL) {
+		aesd_log(LOG_ERR, "Error allocating follow packet.");
+		return;
+	}
+	memcpy(packet->data, data, len);
+
+	pthread_mutex_lock(&hub.lock);
+	struct follower *follower;
+	LIST_FOREACH(follower, &hub.followers, entries) {
+		if(follower->lagged) {
+			continue;
+		}
+		if(follower->head - follower->tail == FOLLOW_QUEUE_DEPTH) {
+			follower->lagged = true;
+			continue;
+		}
+		atomic_fetch_add_explicit(&packet->refs, 1, memory_order_relaxed);
+		follower->queue[follower->head++ % FOLLOW_QUEUE_DEPTH] = packet;
+	}
+	pthread_mutex_unlock(&hub.lock);
+	packet_release(packet);
+	wake_hub();
+}
@@ -0,0 +1,40 @@
+/*
+ * aesd-follow.h
+ *
+ * Follow mode.  A client sending the AESDSOCKET_FOLLOW command is handed to the follow hub, which sends it
+ * the current contents of the store and then every packet written after that, as it is written, until
+ * the client disconnects.  Each written packet is copied once into a reference counted buffer shared by
+ * every follower's queue, and a single hub thread sends to all followers with non-blocking writes.  Queues
+ * are bounded, a follower which falls that far behind is disconnected so writers never wait on it.
+ */
+
+#ifndef AESD_FOLLOW_H
+#define AESD_FOLLOW_H
+
+#include <stddef.h>
+
+/**
+ * Start the hub thread
+ * @return 0 on success, -1 on failure
+ */
+int aesd_follow_start(void);
+
+/**
+ * Stop the hub thread and disconnect every follower
+ */
+void aesd_follow_stop(void);
+
+/**
+ * Take over @param client_fd, connected to @param client_ip, as a follower.  The snapshot of the store it
+ * is sent first is taken under file_rwlock so no packet is missed or sent twice.
+ * @return 0 if the hub now owns client_fd, -1 on failure, in which case the caller still owns it
+ */
+int aesd_follow_add(int client_fd, const char *client_ip);
+
+/**
+ * Queue @param len bytes at @param data, just written to the store, for every follower.  Call with
+ * file_rwlock held for writing, so followers see packets in store order.  Cheap when nobody is following.
+ */
+void aesd_follow_publish(const char *data, size_t len);
+
+#endif /* AESD_FOLLOW_H */
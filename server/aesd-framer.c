@@ -0,0 +1,124 @@
+/*
+ * aesd-framer.c
+ *
+ * Streaming newline framer, see aesd-framer.h
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <iso646.h>
+#include "aesd-framer.h"
+
+#define FRAMER_INITIAL_LEN (4096)
+#define SEEKTO_PREFIX "AESDCHAR_IOCSEEKTO:"
+#define SEEKTO_MAX_LEN (64) // longer than any valid seek command
+#define FOLLOW_COMMAND "AESDSOCKET_FOLLOW"
+
+void aesd_framer_init(struct aesd_framer *framer)
+{
+	memset(framer, 0, sizeof *framer);
+}
+
+void aesd_framer_free(struct aesd_framer *framer)
+{
+	free(framer->buf);
+	aesd_framer_init(framer);
+}
+
+char *aesd_framer_space(struct aesd_framer *framer, size_t min_len, size_t *avail)
+{
+	if(framer->start > 0) {
+		// drop consumed packets so the partial one starts the buffer
+		memmove(framer->buf, framer->buf + framer->start, framer->len - framer->start);
+		framer->len -= framer->start;
+		framer->start = 0;
+	}
+
+	if(framer->cap - framer->len < min_len) {
+		size_t new_cap = framer->cap ? framer->cap : FRAMER_INITIAL_LEN;
+		char *new_buf;
+		while(new_cap - framer->len < min_len) {
+			new_cap *= 2;
+		}
+		new_buf = realloc(framer->buf, new_cap);
+		if(new_buf == NULL) {
+			return NULL;
+		}
+		framer->buf = new_buf;
+		framer->cap = new_cap;
+	}
+
+	*avail = framer->cap - framer->len;
+	return framer->buf + framer->len;
+}
+
+void aesd_framer_commit(struct aesd_framer *framer, size_t count)
+{
+	framer->len += count;
+}
+
+bool aesd_framer_next(struct aesd_framer *framer, const char **line, size_t *len)
+{
+	size_t scan_from = framer->start + framer->scanned;
+	char *newline = NULL;
+
+	if(scan_from < framer->len) {
+		newline = memchr(framer->buf + scan_from, '\n', framer->len - scan_from);
+	}
+	if(newline == NULL) {
+		framer->scanned = framer->len - framer->start;
+		return false;
+	}
+
+	*line = framer->buf + framer->start;
+	*len = newline - *line + 1;
+	framer->start += *len;
+	framer->scanned = 0;
+	return true;
+}
+
+size_t aesd_framer_pending(const struct aesd_framer *framer)
+{
+	return framer->len - framer->start;
+}
+
+size_t aesd_framer_take_partial(struct aesd_framer *framer, const char **data)
+{
+	size_t len = framer->len - framer->start;
+
+	*data = framer->buf + framer->start;
+	framer->start = framer->len;
+	framer->scanned = 0;
+	return len;
+}
+
+bool aesd_parse_seekto(const char *line, size_t len, struct aesd_seekto *seekto)
+{
+	char cmd[SEEKTO_MAX_LEN];
+	unsigned int x,y;
+	const char* seek_cmd = SEEKTO_PREFIX "%u,%u";
+
+	// cheap rejection of ordinary packets before copying out a terminated string for sscanf
+	if(len < strlen(SEEKTO_PREFIX) or len >= SEEKTO_MAX_LEN or memcmp(line, SEEKTO_PREFIX, strlen(SEEKTO_PREFIX)) != 0) {
+		return false;
+	}
+	memcpy(cmd, line, len);
+	cmd[len] = '\0';
+
+	if(sscanf(cmd, seek_cmd, &x, &y) != 2) {
+		return false;
+	}
+	seekto->write_cmd = x;
+	seekto->write_cmd_offset = y;
+	return true;
+}
+
+bool aesd_parse_follow(const char *line, size_t len)
+{
+	// ignore the newline, and a carriage return before it
+	while(len > 0 and (line[len - 1] == '\n' or line[len - 1] == '\r')) {
+		len--;
+	}
+	return len == strlen(FOLLOW_COMMAND) and memcmp(line, FOLLOW_COMMAND, len) == 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * aesd-framer.h
+ *
+ * Streaming newline framer for the aesdsocket protocol.  Received bytes are appended to a growable
+ * buffer which is scanned with memchr() for complete packets, so any number of packets can arrive in
+ * one recv() and a packet may be split across as many recv() calls as needed.  Each byte is scanned once.
+ */
+
+#ifndef AESD_FRAMER_H
+#define AESD_FRAMER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "../aesd-char-driver/aesd_ioctl.h"
+
+struct aesd_framer {
+	char *buf;
+	/**
+	 * Bytes of buf holding received data
+	 */
+	size_t len;
+	size_t cap;
+	/**
+	 * Start of the first packet not yet returned by aesd_framer_next
+	 */
+	size_t start;
+	/**
+	 * Bytes after start already searched for a newline
+	 */
+	size_t scanned;
+};
+
+void aesd_framer_init(struct aesd_framer *framer);
+
+void aesd_framer_free(struct aesd_framer *framer);
+
+/**
+ * Get space to receive at least @param min_len more bytes into, compacting or growing the buffer.
+ * Lines previously returned by aesd_framer_next are invalidated.
+ * @param avail is set to the number of bytes available at the returned location
+ * @return location to receive into, or NULL if memory could not be allocated
+ */
+char *aesd_framer_space(struct aesd_framer *framer, size_t min_len, size_t *avail);
+
+/**
+ * Record that @param count bytes were received into the space returned by aesd_framer_space
+ */
+void aesd_framer_commit(struct aesd_framer *framer, size_t count);
+
+/**
+ * Return the next complete packet, including its terminating newline.
+ * @param line and @param len are set to the packet, which stays valid until the next aesd_framer_space call
+ * @return true if a complete packet was returned, false if more data is needed
+ */
+bool aesd_framer_next(struct aesd_framer *framer, const char **line, size_t *len);
+
+/**
+ * @return number of received bytes not yet terminated by a newline
+ */
+size_t aesd_framer_pending(const struct aesd_framer *framer);
+
+/**
+ * Remove and return any received bytes not yet terminated by a newline
+ * @return number of bytes at @param data
+ */
+size_t aesd_framer_take_partial(struct aesd_framer *framer, const char **data);
+
+/**
+ * Parse an "AESDCHAR_IOCSEEKTO:X,Y" command packet of @param len bytes at @param line
+ * @return true if the packet is a seek command and @param seekto was filled in
+ */
+bool aesd_parse_seekto(const char *line, size_t len, struct aesd_seekto *seekto);
+
+/**
+ * @return true if the packet of @param len bytes at @param line is the "AESDSOCKET_FOLLOW" command
+ */
+bool aesd_parse_follow(const char *line, size_t len);
+
+#endif /* AESD_FRAMER_H */
@@ -0,0 +1,253 @@
+/*
+ * aesd-handoff.c
+ *
+ * Listening socket handoff between an old and a new server, see aesd-handoff.h
+ */
+
+#define _GNU_SOURCE // struct ucred, MSG_CMSG_CLOEXEC
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <iso646.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "aesdsocket.h"
+#include "aesd-handoff.h"
+#include "aesd-log.h"
+
+#define HANDOFF_LISTEN ('L')
+#define HANDOFF_RELEASED ('R')
+
+static struct {
+	// old server side
+	pthread_t thread_handle;
+	bool running;
+	int listen_fd;
+	int replacement_fd; // connection the listening sockets were sent over, -1 until then
+
+	// new server side
+	int previous_fd; // connection to the server the listening sockets were taken from
+} handoff = {
+	.listen_fd = -1,
+	.replacement_fd = -1,
+	.previous_fd = -1,
+};
+
+static void handoff_address(struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof *addr);
+	addr->sun_family = AF_UNIX;
+	strncpy(addr->sun_path, AESD_HANDOFF_PATH, sizeof addr->sun_path - 1);
+}
+
+int aesd_handoff_receive(void)
+{
+	struct sockaddr_un addr;
+	handoff_address(&addr);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0) {
+		aesd_log(LOG_ERR, "error opening handoff socket: %s", strerror(errno));
+		return -1;
+	}
+	if(connect(fd, (struct sockaddr*)&addr, sizeof addr) != 0) {
+		aesd_log(LOG_INFO, "no running server to take over from at %s", AESD_HANDOFF_PATH);
+		close(fd);
+		return -1;
+	}
+	// the old server answers straight away, but may take up to its drain timeout to exit
+	struct timeval timeout = {.tv_sec = AESD_DRAIN_TIMEOUT_S + 5, .tv_usec = 0};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+
+	char tag = 0;
+	char control[CMSG_SPACE(AESD_MAX_LISTENERS * sizeof(int))];
+	struct iovec iov = {.iov_base = &tag, .iov_len = 1};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof control,
+	};
+	ssize_t numbytes = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if(numbytes != 1 or tag != HANDOFF_LISTEN or cmsg == NULL or cmsg->cmsg_level != SOL_SOCKET or
+			cmsg->cmsg_type != SCM_RIGHTS or cmsg->cmsg_len < CMSG_LEN(sizeof(int))) {
+		aesd_log(LOG_ERR, "running server didn't hand over its listening socket");
+		close(fd);
+		return -1;
+	}
+	int listen_fds[AESD_MAX_LISTENERS];
+	int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	memcpy(listen_fds, CMSG_DATA(cmsg), count * sizeof(int));
+	// server_fd always comes first
+	server_fd = listen_fds[0];
+	for(int i = 1; i < count; ++i) {
+		struct sockaddr_storage addr;
+		socklen_t addr_size = sizeof addr;
+		if(getsockname(listen_fds[i], (struct sockaddr*)&addr, &addr_size) == 0 and addr.ss_family == AF_UNIX and local_fd < 0) {
+			local_fd = listen_fds[i];
+		} else {
+			close(listen_fds[i]);
+		}
+	}
+
+	if(recv(fd, &tag, 1, 0) != 1 or tag != HANDOFF_RELEASED) {
+		aesd_log(LOG_ERR, "running server didn't confirm it stopped accepting, starting anyway");
+	}
+	aesd_log(LOG_INFO, "took the listening sockets over from the running server");
+	handoff.previous_fd = fd;
+	return 0;
+}
+
+void aesd_handoff_finish(bool wait_exit)
+{
+	if(handoff.previous_fd < 0) {
+		return;
+	}
+	if(wait_exit) {
+		char buf;
+		ssize_t numbytes;
+		while((numbytes = recv(handoff.previous_fd, &buf, 1, 0)) > 0 or (numbytes < 0 and errno == EINTR)) {
+		}
+		if(numbytes < 0) {
+			aesd_log(LOG_ERR, "previous server is still running, opening the %s store anyway", aesd_storage_name());
+		}
+	}
+	close(handoff.previous_fd);
+	handoff.previous_fd = -1;
+}
+
+/**
+ * Send the listening sockets over @param fd, which must be a connection from a process of the same user
+ * @return 0 on success, -1 on failure
+ */
+static int handoff_send(int fd)
+{
+	struct ucred cred;
+	socklen_t cred_len = sizeof cred;
+	if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 or cred.uid != geteuid()) {
+		aesd_log(LOG_ERR, "refusing handoff to a process of another user");
+		return -1;
+	}
+
+	int listen_fds[AESD_MAX_LISTENERS];
+	int count = aesd_listeners(listen_fds);
+	char tag = HANDOFF_LISTEN;
+	char control[CMSG_SPACE(AESD_MAX_LISTENERS * sizeof(int))];
+	memset(control, 0, sizeof control);
+	struct iovec iov = {.iov_base = &tag, .iov_len = 1};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = CMSG_SPACE(count * sizeof(int)),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), listen_fds, count * sizeof(int));
+
+	if(sendmsg(fd, &msg, MSG_NOSIGNAL) != 1) {
+		aesd_log(LOG_ERR, "error sending listening sockets: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void *handoff_handler(void *args)
+{
+	(void)args;
+	while(not server_terminate) {
+		int fd = accept4(handoff.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if(fd < 0) {
+			if(errno == EINTR or errno == ECONNABORTED) {
+				continue;
+			}
+			if(not server_terminate) {
+				aesd_log(LOG_ERR, "handoff accept failed: %s", strerror(errno));
+			}
+			break;
+		}
+		if(handoff_send(fd) != 0) {
+			close(fd);
+			continue;
+		}
+		handoff.replacement_fd = fd;
+		aesd_log(LOG_INFO, "handed the listening sockets to a new server, draining connections");
+		server_draining = 1;
+		kill(getpid(), SIGTERM);
+		break;
+	}
+	return (void*)0;
+}
+
+int aesd_handoff_start(void)
+{
+	struct sockaddr_un addr;
+	handoff_address(&addr);
+
+	handoff.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(handoff.listen_fd < 0) {
+		aesd_log(LOG_ERR, "error opening handoff socket: %s", strerror(errno));
+		return -1;
+	}
+	// the socket file left by the server this one replaced, or one which crashed
+	unlink(AESD_HANDOFF_PATH);
+	if(bind(handoff.listen_fd, (struct sockaddr*)&addr, sizeof addr) != 0 or listen(handoff.listen_fd, 1) != 0) {
+		aesd_log(LOG_ERR, "error binding %s: %s", AESD_HANDOFF_PATH, strerror(errno));
+		close(handoff.listen_fd);
+		handoff.listen_fd = -1;
+		return -1;
+	}
+	if(aesd_create_thread(&handoff.thread_handle, handoff_handler, NULL) != 0) {
+		aesd_log(LOG_ERR, "thread creation failed");
+		close(handoff.listen_fd);
+		handoff.listen_fd = -1;
+		return -1;
+	}
+	handoff.running = true;
+	return 0;
+}
+
+/**
+ * Wake and join the handoff thread, if it's still running
+ */
+static void handoff_join(void)
+{
+	if(handoff.running) {
+		shutdown(handoff.listen_fd, SHUT_RDWR); // wakes the blocked accept
+		pthread_join(handoff.thread_handle, NULL);
+		handoff.running = false;
+	}
+}
+
+void aesd_handoff_release(void)
+{
+	handoff_join();
+	char tag = HANDOFF_RELEASED;
+	if(handoff.replacement_fd >= 0 and send(handoff.replacement_fd, &tag, 1, MSG_NOSIGNAL) != 1) {
+		aesd_log(LOG_ERR, "error releasing the listening sockets: %s", strerror(errno));
+	}
+}
+
+void aesd_handoff_stop(void)
+{
+	handoff_join();
+	if(handoff.listen_fd >= 0) {
+		close(handoff.listen_fd);
+		handoff.listen_fd = -1;
+		// once handed over the path belongs to the replacement
+		if(handoff.replacement_fd < 0) {
+			unlink(AESD_HANDOFF_PATH);
+		}
+	}
+	if(handoff.replacement_fd >= 0) {
+		close(handoff.replacement_fd);
+		handoff.replacement_fd = -1;
+	}
+}
@@ -0,0 +1,55 @@
+/*
+ * aesd-handoff.h
+ *
+ * Zero-downtime upgrade.  A running server listens on the UNIX socket AESD_HANDOFF_PATH for its
+ * replacement.  A server started with -u connects there and is sent server_fd, and local_fd if open, with
+ * SCM_RIGHTS, so new connections keep queueing on the same listening sockets throughout and none are
+ * refused.  The old server then stops accepting, tells the replacement it may start, finishes the
+ * connections it already has for up to AESD_DRAIN_TIMEOUT_S and exits.
+ *
+ * Handoff protocol, one byte messages on the UNIX socket:
+ *  - 'L' carrying the listening sockets, sent as soon as the replacement connects
+ *  - 'R' once the old server has stopped accepting on them
+ *  - end of file when the old server has closed its store and is about to exit
+ */
+
+#ifndef AESD_HANDOFF_H
+#define AESD_HANDOFF_H
+
+#include <stdbool.h>
+
+#define AESD_HANDOFF_PATH "/var/run/aesdsocket.handoff"
+#define AESD_DRAIN_TIMEOUT_S (30) // how long a replaced server waits for its connections to finish
+
+/**
+ * Take the listening sockets over from the server running on this host, waiting until it has stopped
+ * accepting.  Sets server_fd, and local_fd if the running server had one.
+ * @return 0 on success, -1 if no server is running or its sockets couldn't be handed over
+ */
+int aesd_handoff_receive(void);
+
+/**
+ * Done with the server the listening sockets were taken from.  With @param wait_exit first wait, for at most
+ * a little over AESD_DRAIN_TIMEOUT_S, until it has closed its store, for stores only one process may open.
+ */
+void aesd_handoff_finish(bool wait_exit);
+
+/**
+ * Listen for a replacement server, from a thread of its own.  Once the listening sockets have been sent
+ * to one, server_draining is set and SIGTERM raised so the main thread shuts down through server_cleanup.
+ * @return 0 on success, -1 on failure
+ */
+int aesd_handoff_start(void);
+
+/**
+ * Tell the replacement this server no longer accepts connections on the listening sockets
+ */
+void aesd_handoff_release(void);
+
+/**
+ * Stop listening for a replacement.  If the listening sockets were handed over this also tells the
+ * replacement the store is closed, so call it last.
+ */
+void aesd_handoff_stop(void);
+
+#endif /* AESD_HANDOFF_H */
@@ -0,0 +1,341 @@
+/*
+ * aesd-log.c
+ *
+ * Per-thread log rings drained to syslog by a background thread, see aesd-log.h
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <iso646.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "aesdsocket.h"
+#include "aesd-log.h"
+
+#define LOG_LINE_LEN (256) // longer messages are truncated
+#define LOG_RING_RECORDS (128) // power of two
+#define LOG_DRAIN_INTERVAL_MS (10) // how long a woken drain thread lets messages gather
+#define LOG_DRAIN_BACKSTOP_MS (5000) // longest the drain thread sleeps without being woken
+#define LOG_REPEAT_FLUSH_MS (1000) // longest a run of repeated messages goes unreported
+
+struct log_record {
+	uint64_t time_ns; // CLOCK_MONOTONIC, orders records from different rings
+	int priority;
+	char text[LOG_LINE_LEN];
+};
+
+/**
+ * Single producer, single consumer ring.  Only the owning thread advances head and only the drain thread
+ * advances tail, each publishing with a release store the other side reads with an acquire load.  The owning
+ * thread wakes the drain thread when it finds the tail has caught up with the record it just added.
+ */
+struct log_ring {
+	atomic_uint head;
+	atomic_uint tail;
+	atomic_bool released; // the owning thread has exited, free once drained
+	struct log_ring *next;
+
+	// drain thread only, what this pass will drain
+	unsigned int drain_head;
+	bool drain_released;
+
+	struct log_record records[LOG_RING_RECORDS];
+};
+
+// rings are only ever pushed on the head, and only the drain thread unlinks them, so the list needs no lock
+static _Atomic(struct log_ring*) rings = NULL;
+static __thread struct log_ring *thread_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static atomic_int log_level = LOG_INFO;
+static atomic_bool log_running = false;
+static atomic_bool log_terminate = false;
+static atomic_ulong log_dropped = 0;
+static pthread_t drain_thread_handle;
+static int log_wake_fd = -1; // eventfd the drain thread sleeps on
+
+static const struct {
+	const char *name;
+	int level;
+} level_names[] = {
+	{"err", LOG_ERR},
+	{"warning", LOG_WARNING},
+	{"notice", LOG_NOTICE},
+	{"info", LOG_INFO},
+	{"debug", LOG_DEBUG},
+};
+
+// drain thread state for collapsing repeats
+static struct log_record last_record = {.priority = -1};
+static unsigned long last_repeats = 0;
+static struct timespec last_repeat_start;
+
+void aesd_log_set_level(int level)
+{
+	if(level < LOG_ERR) {
+		level = LOG_ERR;
+	} else if(level > LOG_DEBUG) {
+		level = LOG_DEBUG;
+	}
+	atomic_store(&log_level, level);
+}
+
+int aesd_log_get_level(void)
+{
+	return atomic_load(&log_level);
+}
+
+int aesd_log_parse_level(const char *name)
+{
+	for(size_t i = 0; i < sizeof level_names / sizeof level_names[0]; ++i) {
+		if(strcasecmp(name, level_names[i].name) == 0) {
+			return level_names[i].level;
+		}
+	}
+	return -1;
+}
+
+static void ring_release(void *ring)
+{
+	atomic_store_explicit(&((struct log_ring*)ring)->released, true, memory_order_release);
+}
+
+static void ring_key_create(void)
+{
+	pthread_key_create(&ring_key, ring_release);
+}
+
+/**
+ * @return the calling thread's ring, allocating and publishing it on first use, or NULL if out of memory
+ */
+static struct log_ring *ring_get(void)
+{
+	if(thread_ring != NULL) {
+		return thread_ring;
+	}
+	struct log_ring *ring = calloc(1, sizeof(struct log_ring));
+	if(ring == NULL) {
+		return NULL;
+	}
+	pthread_once(&ring_key_once, ring_key_create);
+	pthread_setspecific(ring_key, ring);
+
+	ring->next = atomic_load(&rings);
+	while(not atomic_compare_exchange_weak(&rings, &ring->next, ring)) {
+	}
+	thread_ring = ring;
+	return ring;
+}
+
+void aesd_log(int priority, const char *fmt, ...)
+{
+	if(LOG_PRI(priority) > atomic_load_explicit(&log_level, memory_order_relaxed)) {
+		return;
+	}
+
+	va_list args;
+	va_start(args, fmt);
+	struct log_ring *ring = atomic_load_explicit(&log_running, memory_order_acquire) ? ring_get() : NULL;
+	if(ring == NULL) {
+		vsyslog(priority, fmt, args);
+		va_end(args);
+		return;
+	}
+
+	unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	if(head - atomic_load_explicit(&ring->tail, memory_order_acquire) == LOG_RING_RECORDS) {
+		atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+		va_end(args);
+		return;
+	}
+	struct log_record *record = &ring->records[head % LOG_RING_RECORDS];
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	record->time_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	record->priority = priority;
+	vsnprintf(record->text, sizeof record->text, fmt, args);
+	va_end(args);
+	// sequentially consistent against the drain thread's tail store and head load in log_pending, so
+	// either it sees this record before it sleeps or this sees the ring was empty and wakes it
+	atomic_store(&ring->head, head + 1);
+	if(atomic_load(&ring->tail) == head) {
+		eventfd_write(log_wake_fd, 1);
+	}
+}
+
+static long elapsed_ms(const struct timespec *since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static void flush_repeats(void)
+{
+	if(last_repeats > 0) {
+		syslog(last_record.priority, "last message repeated %lu times", last_repeats);
+		last_repeats = 0;
+	}
+}
+
+static void emit(const struct log_record *record)
+{
+	if(record->priority == last_record.priority and strcmp(record->text, last_record.text) == 0) {
+		if(last_repeats++ == 0) {
+			clock_gettime(CLOCK_MONOTONIC, &last_repeat_start);
+		}
+		return;
+	}
+	flush_repeats();
+	syslog(record->priority, "%s", record->text);
+	last_record.priority = record->priority;
+	strcpy(last_record.text, record->text);
+}
+
+static void drain_all(void)
+{
+	struct log_ring *head = atomic_load(&rings);
+
+	// snapshot every ring, reading released before head so anything queued before a thread exited is included
+	for(struct log_ring *ring = head; ring != NULL; ring = ring->next) {
+		ring->drain_released = atomic_load_explicit(&ring->released, memory_order_acquire);
+		ring->drain_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	}
+
+	// merge the rings oldest first, so messages from different threads come out in the order they were logged
+	while(true) {
+		struct log_ring *oldest = NULL;
+		for(struct log_ring *ring = head; ring != NULL; ring = ring->next) {
+			unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+			if(tail != ring->drain_head and (oldest == NULL or ring->records[tail % LOG_RING_RECORDS].time_ns <
+					oldest->records[atomic_load_explicit(&oldest->tail, memory_order_relaxed) % LOG_RING_RECORDS].time_ns)) {
+				oldest = ring;
+			}
+		}
+		if(oldest == NULL) {
+			break;
+		}
+		unsigned int tail = atomic_load_explicit(&oldest->tail, memory_order_relaxed);
+		emit(&oldest->records[tail % LOG_RING_RECORDS]);
+		atomic_store(&oldest->tail, tail + 1);
+	}
+
+	// free the rings of exited threads, now empty for good.  The head may be having a new ring pushed in
+	// front of it, leave it for a later pass.
+	struct log_ring *prev = head;
+	while(prev != NULL and prev->next != NULL) {
+		struct log_ring *ring = prev->next;
+		if(ring->drain_released) {
+			prev->next = ring->next;
+			free(ring);
+		} else {
+			prev = ring;
+		}
+	}
+
+	if(last_repeats > 0 and elapsed_ms(&last_repeat_start) >= LOG_REPEAT_FLUSH_MS) {
+		flush_repeats();
+	}
+	unsigned long dropped = atomic_exchange_explicit(&log_dropped, 0, memory_order_relaxed);
+	if(dropped > 0) {
+		flush_repeats();
+		syslog(LOG_WARNING, "dropped %lu log messages, log rings full", dropped);
+	}
+}
+
+/**
+ * @return true if a ring has records added since the last drain, which may not have woken the drain thread
+ */
+static bool log_pending(void)
+{
+	for(struct log_ring *ring = atomic_load(&rings); ring != NULL; ring = ring->next) {
+		if(atomic_load(&ring->head) != atomic_load_explicit(&ring->tail, memory_order_relaxed)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @return how long the drain thread may sleep, until a run of repeats is due to be reported if there is one
+ */
+static int drain_timeout_ms(void)
+{
+	if(last_repeats == 0) {
+		return LOG_DRAIN_BACKSTOP_MS;
+	}
+	long remaining = LOG_REPEAT_FLUSH_MS - elapsed_ms(&last_repeat_start);
+	return remaining > 0 ? remaining : 0;
+}
+
+static void *drain_handler(void *args)
+{
+	(void)args;
+	struct timespec interval = {.tv_sec = 0, .tv_nsec = LOG_DRAIN_INTERVAL_MS * 1000000};
+	struct pollfd pfd = {.fd = log_wake_fd, .events = POLLIN};
+	eventfd_t wakes;
+
+	while(not atomic_load(&log_terminate)) {
+		drain_all();
+		// sleep until a ring goes from empty to non-empty, rather than polling the rings while idle
+		if(not log_pending()) {
+			poll(&pfd, 1, drain_timeout_ms());
+			eventfd_read(log_wake_fd, &wakes);
+		}
+		nanosleep(&interval, NULL);
+	}
+	return NULL;
+}
+
+int aesd_log_start(void)
+{
+	atomic_store(&log_terminate, false);
+	log_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(log_wake_fd < 0) {
+		syslog(LOG_ERR, "error creating log eventfd: %s", strerror(errno));
+		return -1;
+	}
+	if(aesd_create_thread(&drain_thread_handle, drain_handler, NULL) != 0) {
+		syslog(LOG_ERR, "log thread creation failed");
+		close(log_wake_fd);
+		log_wake_fd = -1;
+		return -1;
+	}
+	atomic_store_explicit(&log_running, true, memory_order_release);
+	return 0;
+}
+
+void aesd_log_stop(void)
+{
+	if(not atomic_load(&log_running)) {
+		return;
+	}
+	atomic_store(&log_running, false);
+	atomic_store(&log_terminate, true);
+	eventfd_write(log_wake_fd, 1);
+	pthread_join(drain_thread_handle, NULL);
+	close(log_wake_fd);
+	log_wake_fd = -1;
+
+	// every other thread has finished by now, log what they left behind
+	drain_all();
+	flush_repeats();
+
+	struct log_ring *ring = atomic_exchange(&rings, NULL);
+	while(ring != NULL) {
+		struct log_ring *next = ring->next;
+		free(ring);
+		ring = next;
+	}
+	thread_ring = NULL;
+}
@@ -0,0 +1,46 @@
+/*
+ * aesd-log.h
+ *
+ * Asynchronous logging for aesdsocket.  aesd_log() formats the message into a ring owned by the calling
+ * thread, with no locks and no system calls beyond waking the drain thread when the ring was empty, and
+ * that background thread, otherwise asleep, drains every ring to syslog.  Messages above the runtime log
+ * level are discarded before they are formatted, and runs of identical messages are collapsed into one
+ * "last message repeated" line.  A full ring drops the message rather than blocking, the drops are counted
+ * and reported.
+ */
+
+#ifndef AESD_LOG_H
+#define AESD_LOG_H
+
+#include <syslog.h>
+
+/**
+ * Log @param fmt at syslog @param priority.  Before aesd_log_start and after aesd_log_stop the message
+ * goes straight to syslog.
+ */
+void aesd_log(int priority, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * Set the least important priority logged, LOG_ERR up to LOG_DEBUG.  Safe to call from a signal handler.
+ */
+void aesd_log_set_level(int level);
+
+int aesd_log_get_level(void);
+
+/**
+ * @return the syslog priority named @param name ("err", "warning", "notice", "info" or "debug"), or -1
+ */
+int aesd_log_parse_level(const char *name);
+
+/**
+ * Start the drain thread.  Call after any fork, threads don't survive it.
+ * @return 0 on success, -1 on failure
+ */
+int aesd_log_start(void);
+
+/**
+ * Drain every ring and stop the drain thread
+ */
+void aesd_log_stop(void);
+
+#endif /* AESD_LOG_H */
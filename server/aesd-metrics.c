@@ -0,0 +1,327 @@
+/*
+ * aesd-metrics.c
+ *
+ * Counters, latency histograms and the admin port, see aesd-metrics.h
+ */
+
+#define _GNU_SOURCE // open_memstream
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <iso646.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "aesdsocket.h"
+#include "aesd-commit.h"
+#include "aesd-metrics.h"
+#include "aesd-log.h"
+
+#define HIST_SUB_BITS (2)
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS (40) // ~18 minutes, anything longer lands in the last bucket
+#define HIST_BUCKETS ((HIST_MAX_BITS - 1) * HIST_SUB_BUCKETS + HIST_SUB_BUCKETS)
+#define HIST_EXPORT_MIN_BITS (10) // exported cumulative buckets run from 2^10 ns, about 1 us
+#define HIST_EXPORT_MAX_BITS (35) // to 2^35 ns, about 34 s
+
+#define ADMIN_REQUEST_TIMEOUT_MS (100) // how long a new admin connection has to send an HTTP request
+
+struct metrics_histogram {
+	atomic_ulong buckets[HIST_BUCKETS];
+	atomic_ulong count;
+	atomic_ulong sum_ns;
+};
+
+static atomic_long counters[AESD_NUM_COUNTERS];
+static struct metrics_histogram histograms[AESD_NUM_HISTOGRAMS];
+
+static const struct {
+	const char *name;
+	const char *type;
+	const char *help;
+} counter_info[AESD_NUM_COUNTERS] = {
+	[AESD_COUNTER_ACCEPTED] = {"aesd_connections_accepted_total", "counter", "Connections accepted."},
+	[AESD_COUNTER_ACTIVE] = {"aesd_connections_active", "gauge", "Connections currently open."},
+	[AESD_COUNTER_REQUESTS] = {"aesd_requests_total", "counter", "Packets and seek commands handled."},
+	[AESD_COUNTER_BYTES_IN] = {"aesd_received_bytes_total", "counter", "Bytes received from clients."},
+	[AESD_COUNTER_BYTES_OUT] = {"aesd_sent_bytes_total", "counter", "Reply bytes sent to clients."},
+	[AESD_COUNTER_ERRORS] = {"aesd_errors_total", "counter", "Connections ended or requests failed by an error."},
+	[AESD_COUNTER_SHED] = {"aesd_connections_shed_total", "counter", "Connections refused by the pool overload policy."},
+	[AESD_COUNTER_FOLLOWERS] = {"aesd_followers", "gauge", "Connections following new packets."},
+	[AESD_COUNTER_FOLLOW_LAGGED] = {"aesd_followers_lagged_total", "counter", "Followers disconnected for falling too far behind."},
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+} histogram_info[AESD_NUM_HISTOGRAMS] = {
+	[AESD_HIST_FIRST_BYTE] = {"aesd_first_byte_seconds", "Time from accept to the first received byte."},
+	[AESD_HIST_LOCK_WAIT] = {"aesd_lock_wait_seconds", "Time spent waiting for the output file lock."},
+	[AESD_HIST_WRITE] = {"aesd_write_seconds", "Time writing packets to the output file."},
+	[AESD_HIST_READ_BACK] = {"aesd_read_back_seconds", "Time reading a reply from the output file."},
+	[AESD_HIST_REQUEST] = {"aesd_request_seconds", "Time handling a request until its reply is sent."},
+};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+static pthread_t admin_thread_handle;
+static int admin_fd = -1;
+static atomic_bool admin_terminate = false;
+
+uint64_t aesd_metrics_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void aesd_metrics_add(enum aesd_counter counter, long value)
+{
+	atomic_fetch_add_explicit(&counters[counter], value, memory_order_relaxed);
+}
+
+long aesd_metrics_get(enum aesd_counter counter)
+{
+	return atomic_load_explicit(&counters[counter], memory_order_relaxed);
+}
+
+static int hist_bucket(uint64_t ns)
+{
+	if(ns < HIST_SUB_BUCKETS) {
+		return ns;
+	}
+	int msb = 63 - __builtin_clzll(ns);
+	if(msb >= HIST_MAX_BITS) {
+		return HIST_BUCKETS - 1;
+	}
+	// the bits just below the most significant one pick the sub-bucket
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + ((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/**
+ * @return the largest value, in nanoseconds, recorded in @param bucket
+ */
+static uint64_t hist_bucket_upper(int bucket)
+{
+	if(bucket < HIST_SUB_BUCKETS) {
+		return bucket;
+	}
+	int msb = bucket / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+	uint64_t lower = (uint64_t)(HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS) << (msb - HIST_SUB_BITS);
+	return lower + ((uint64_t)1 << (msb - HIST_SUB_BITS)) - 1;
+}
+
+void aesd_metrics_observe(enum aesd_histogram histogram, uint64_t ns)
+{
+	struct metrics_histogram *hist = &histograms[histogram];
+	atomic_fetch_add_explicit(&hist->buckets[hist_bucket(ns)], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->sum_ns, ns, memory_order_relaxed);
+}
+
+void aesd_metrics_since(enum aesd_histogram histogram, uint64_t start_ns)
+{
+	aesd_metrics_observe(histogram, aesd_metrics_now() - start_ns);
+}
+
+static void write_histogram(FILE *out, enum aesd_histogram histogram)
+{
+	struct metrics_histogram *hist = &histograms[histogram];
+	const char *name = histogram_info[histogram].name;
+	unsigned long buckets[HIST_BUCKETS];
+	unsigned long total = 0;
+
+	for(int i = 0; i < HIST_BUCKETS; ++i) {
+		buckets[i] = atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+		total += buckets[i];
+	}
+
+	fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, histogram_info[histogram].help, name);
+	// cumulative buckets on power of two boundaries, a fixed set so scrapes can be compared
+	unsigned long cumulative = 0;
+	int bucket = 0;
+	for(int bits = HIST_EXPORT_MIN_BITS; bits <= HIST_EXPORT_MAX_BITS; ++bits) {
+		uint64_t le = ((uint64_t)1 << bits) - 1;
+		while(bucket < HIST_BUCKETS and hist_bucket_upper(bucket) <= le) {
+			cumulative += buckets[bucket++];
+		}
+		fprintf(out, "%s_bucket{le=\"%g\"} %lu\n", name, (le + 1) / 1e9, cumulative);
+	}
+	fprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n", name, total);
+	fprintf(out, "%s_sum %.9f\n", name, atomic_load_explicit(&hist->sum_ns, memory_order_relaxed) / 1e9);
+	fprintf(out, "%s_count %lu\n", name, total);
+
+	// quantiles from the full resolution buckets, as the upper bound of the bucket they fall in
+	fprintf(out, "# TYPE %s_quantile gauge\n", name);
+	for(size_t q = 0; q < sizeof quantiles / sizeof quantiles[0]; ++q) {
+		unsigned long rank = (unsigned long)(quantiles[q] * total);
+		unsigned long seen = 0;
+		uint64_t value = 0;
+		for(int i = 0; i < HIST_BUCKETS and total > 0; ++i) {
+			seen += buckets[i];
+			if(seen > rank) {
+				value = hist_bucket_upper(i);
+				break;
+			}
+		}
+		fprintf(out, "%s_quantile{quantile=\"%g\"} %.9f\n", name, quantiles[q], value / 1e9);
+	}
+}
+
+static void write_commit_stats(FILE *out)
+{
+	struct aesd_commit_stats stats;
+	aesd_commit_get_stats(&stats);
+
+	fprintf(out, "# HELP aesd_commit_batches_total Group commit batches written.\n# TYPE aesd_commit_batches_total counter\n");
+	fprintf(out, "aesd_commit_batches_total %lu\n", stats.batches);
+	fprintf(out, "# HELP aesd_commit_packets_total Packets written by group commit.\n# TYPE aesd_commit_packets_total counter\n");
+	fprintf(out, "aesd_commit_packets_total %lu\n", stats.packets);
+	fprintf(out, "# HELP aesd_commit_batch_size Packets per group commit batch.\n# TYPE aesd_commit_batch_size histogram\n");
+	unsigned long cumulative = 0;
+	for(int i = 0; i < AESD_COMMIT_HIST_BUCKETS - 1; ++i) {
+		cumulative += stats.batch_hist[i];
+		fprintf(out, "aesd_commit_batch_size_bucket{le=\"%lu\"} %lu\n", (2UL << i) - 1, cumulative);
+	}
+	fprintf(out, "aesd_commit_batch_size_bucket{le=\"+Inf\"} %lu\n", stats.batches);
+	fprintf(out, "aesd_commit_batch_size_sum %lu\n", stats.packets);
+	fprintf(out, "aesd_commit_batch_size_count %lu\n", stats.batches);
+}
+
+void aesd_metrics_write(FILE *out)
+{
+	for(int i = 0; i < AESD_NUM_COUNTERS; ++i) {
+		fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", counter_info[i].name, counter_info[i].help, counter_info[i].name, counter_info[i].type);
+		fprintf(out, "%s %li\n", counter_info[i].name, atomic_load_explicit(&counters[i], memory_order_relaxed));
+	}
+	for(int i = 0; i < AESD_NUM_HISTOGRAMS; ++i) {
+		write_histogram(out, i);
+	}
+	write_commit_stats(out);
+	if(config.mode == AESD_MODE_EPOLL or config.mode == AESD_MODE_SHARD) {
+		epoll_server_write_metrics(out);
+	}
+}
+
+void aesd_metrics_log(void)
+{
+	static long last_requests = 0;
+	static uint64_t last_ns = 0;
+
+	uint64_t now = aesd_metrics_now();
+	long requests = atomic_load_explicit(&counters[AESD_COUNTER_REQUESTS], memory_order_relaxed);
+	double rate = last_ns == 0 ? 0 : (requests - last_requests) / ((now - last_ns) / 1e9);
+	last_requests = requests;
+	last_ns = now;
+
+	aesd_log(LOG_INFO, "stats: %li accepted, %li active, %li requests (%.1f/s), %li bytes in, %li bytes out, %li errors",
+			atomic_load_explicit(&counters[AESD_COUNTER_ACCEPTED], memory_order_relaxed),
+			atomic_load_explicit(&counters[AESD_COUNTER_ACTIVE], memory_order_relaxed), requests, rate,
+			atomic_load_explicit(&counters[AESD_COUNTER_BYTES_IN], memory_order_relaxed),
+			atomic_load_explicit(&counters[AESD_COUNTER_BYTES_OUT], memory_order_relaxed),
+			atomic_load_explicit(&counters[AESD_COUNTER_ERRORS], memory_order_relaxed));
+}
+
+static void admin_serve(int client_fd)
+{
+	char request[512];
+	ssize_t request_len = 0;
+	char *body = NULL;
+	size_t body_len = 0;
+
+	// scrapers send an HTTP request first, a bare connection (nc) gets the text straight away
+	struct pollfd pfd = {.fd = client_fd, .events = POLLIN};
+	if(poll(&pfd, 1, ADMIN_REQUEST_TIMEOUT_MS) > 0) {
+		request_len = recv(client_fd, request, sizeof request, 0);
+	}
+
+	FILE *out = open_memstream(&body, &body_len);
+	if(out == NULL) {
+		aesd_log(LOG_ERR, "Error allocating metrics buffer.");
+		return;
+	}
+	aesd_metrics_write(out);
+	fclose(out);
+
+	if(request_len >= 4 and memcmp(request, "GET ", 4) == 0) {
+		char header[128];
+		int header_len = snprintf(header, sizeof header,
+				"HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", body_len);
+		send(client_fd, header, header_len, MSG_NOSIGNAL | MSG_MORE);
+	}
+	for(size_t sent = 0; sent < body_len; ) {
+		ssize_t numbytes = send(client_fd, body + sent, body_len - sent, MSG_NOSIGNAL);
+		if(numbytes <= 0) {
+			break;
+		}
+		sent += numbytes;
+	}
+	free(body);
+}
+
+static void *admin_handler(void *args)
+{
+	(void)args;
+	while(not atomic_load(&admin_terminate)) {
+		int client_fd = accept(admin_fd, NULL, NULL);
+		if(client_fd < 0) {
+			if(errno == EINTR or errno == ECONNABORTED) {
+				continue;
+			}
+			if(not atomic_load(&admin_terminate)) {
+				aesd_log(LOG_ERR, "admin accept failed: %s", strerror(errno));
+			}
+			break;
+		}
+		admin_serve(client_fd);
+		close(client_fd);
+	}
+	return (void*)0;
+}
+
+int aesd_metrics_start(int port)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+
+	admin_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(admin_fd < 0) {
+		aesd_log(LOG_ERR, "error opening admin socket");
+		return -1;
+	}
+	if(setsockopt(admin_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0 or
+			bind(admin_fd, (struct sockaddr*)&addr, sizeof addr) != 0 or listen(admin_fd, 4) != 0) {
+		aesd_log(LOG_ERR, "error binding admin port %i: %s", port, strerror(errno));
+		close(admin_fd);
+		admin_fd = -1;
+		return -1;
+	}
+	if(aesd_create_thread(&admin_thread_handle, admin_handler, NULL) != 0) {
+		aesd_log(LOG_ERR, "thread creation failed");
+		close(admin_fd);
+		admin_fd = -1;
+		return -1;
+	}
+	aesd_log(LOG_INFO, "serving metrics on 127.0.0.1 port %i", port);
+	return 0;
+}
+
+void aesd_metrics_stop(void)
+{
+	if(admin_fd < 0) {
+		return;
+	}
+	atomic_store(&admin_terminate, true);
+	shutdown(admin_fd, SHUT_RDWR); // wakes the blocked accept
+	pthread_join(admin_thread_handle, NULL);
+	close(admin_fd);
+	admin_fd = -1;
+}
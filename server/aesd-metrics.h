@@ -0,0 +1,73 @@
+/*
+ * aesd-metrics.h
+ *
+ * In-process counters and latency histograms for aesdsocket.  Everything is a relaxed atomic so the
+ * connection paths can record without taking locks.  Histograms are log-bucketed with four sub-buckets per
+ * power of two nanoseconds, so any recorded latency is known to within 25%.  The current values are served
+ * in the Prometheus text exposition format on a local admin port.
+ */
+
+#ifndef AESD_METRICS_H
+#define AESD_METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+enum aesd_counter {
+	AESD_COUNTER_ACCEPTED,
+	AESD_COUNTER_ACTIVE,		// gauge, connections currently open
+	AESD_COUNTER_REQUESTS,		// packets and seek commands handled
+	AESD_COUNTER_BYTES_IN,
+	AESD_COUNTER_BYTES_OUT,
+	AESD_COUNTER_ERRORS,
+	AESD_COUNTER_SHED,			// connections refused by the pool overload policy
+	AESD_COUNTER_FOLLOWERS,		// gauge, connections in follow mode
+	AESD_COUNTER_FOLLOW_LAGGED,	// followers disconnected for falling behind
+	AESD_NUM_COUNTERS,
+};
+
+enum aesd_histogram {
+	AESD_HIST_FIRST_BYTE,	// accept to first received byte
+	AESD_HIST_LOCK_WAIT,	// waiting for file_rwlock, either side
+	AESD_HIST_WRITE,		// writing packets to OUTPUT_FILENAME
+	AESD_HIST_READ_BACK,	// reading a reply from OUTPUT_FILENAME
+	AESD_HIST_REQUEST,		// handling a request up to its reply being sent
+	AESD_NUM_HISTOGRAMS,
+};
+
+/**
+ * @return CLOCK_MONOTONIC in nanoseconds
+ */
+uint64_t aesd_metrics_now(void);
+
+void aesd_metrics_add(enum aesd_counter counter, long value);
+
+long aesd_metrics_get(enum aesd_counter counter);
+
+void aesd_metrics_observe(enum aesd_histogram histogram, uint64_t ns);
+
+/**
+ * Record the time since @param start_ns, a value returned by aesd_metrics_now
+ */
+void aesd_metrics_since(enum aesd_histogram histogram, uint64_t start_ns);
+
+/**
+ * Write every metric to @param out in the Prometheus text format
+ */
+void aesd_metrics_write(FILE *out);
+
+/**
+ * Log a one line summary of the counters, with the request rate since the previous call
+ */
+void aesd_metrics_log(void);
+
+/**
+ * Serve the metrics to connections on 127.0.0.1 @param port, from a thread of its own.  A plain
+ * connection gets the metrics text, an HTTP GET gets them as an HTTP response.
+ * @return 0 on success, -1 on failure
+ */
+int aesd_metrics_start(int port);
+
+void aesd_metrics_stop(void);
+
+#endif /* AESD_METRICS_H */
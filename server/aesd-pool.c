@@ -0,0 +1,197 @@
+/*
+ * aesd-pool.c
+ *
+ * Bounded worker pool for aesdsocket.  A fixed number of worker threads are started up front and fed
+ * accepted connections through a fixed depth queue, so thread and queue memory stay constant however
+ * many clients connect.  When the queue is full the configured overload policy decides whether the
+ * accept loop waits for room, resets the new connection or replies busy and closes it.  A keep-alive
+ * connection holds its worker while idle, so with -k idle connections are closed after
+ * POOL_KEEP_ALIVE_IDLE_S unless -i gives another timeout.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <iso646.h>
+#include <sys/socket.h>
+#include "aesdsocket.h"
+#include "aesd-metrics.h"
+#include "aesd-log.h"
+
+#define POOL_BUSY_REPLY "ERROR: server busy\n"
+#define POOL_BLOCK_POLL_NS (100 * 1000 * 1000) // how often a blocked submit checks for shutdown
+#define POOL_KEEP_ALIVE_IDLE_S (10) // default idle timeout with -k, idle clients would otherwise fill the pool
+
+struct pool_s {
+	pthread_t *workers;
+	int num_workers;
+
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	bool terminate;
+
+	// circular queue of accepted connections waiting for a worker
+	struct thread_args_s *queue;
+	int queue_depth;
+	int queue_head;
+	int queue_count;
+
+	unsigned long shed_count;
+};
+
+static struct pool_s pool;
+
+static void *pool_worker_handler(void *args)
+{
+	(void)args;
+
+	while(true) {
+		struct thread_args_s conn_args;
+
+		pthread_mutex_lock(&pool.lock);
+		while(pool.queue_count == 0 and not pool.terminate) {
+			pthread_cond_wait(&pool.not_empty, &pool.lock);
+		}
+		if(pool.terminate) {
+			pthread_mutex_unlock(&pool.lock);
+			break;
+		}
+		conn_args = pool.queue[pool.queue_head];
+		pool.queue_head = (pool.queue_head + 1) % pool.queue_depth;
+		pool.queue_count--;
+		pthread_cond_signal(&pool.not_full);
+		pthread_mutex_unlock(&pool.lock);
+
+		connection_handler(&conn_args);
+	}
+	return (void*)0;
+}
+
+/**
+ * Turn away a connection the pool has no room for, according to config.overload_policy
+ */
+static void pool_shed(int client_fd)
+{
+	if(config.overload_policy == AESD_OVERLOAD_RST) {
+		// zero linger time makes close() send RST instead of FIN
+		struct linger linger = {.l_onoff = 1, .l_linger = 0};
+		setsockopt(client_fd, SOL_SOCKET, SO_LINGER, &linger, sizeof linger);
+	} else {
+		send(client_fd, POOL_BUSY_REPLY, strlen(POOL_BUSY_REPLY), MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+	close(client_fd);
+	pool.shed_count++;
+	aesd_metrics_add(AESD_COUNTER_SHED, 1);
+	aesd_log(LOG_WARNING, "connection queue full, shed connection (%lu total)", pool.shed_count);
+}
+
+int pool_server_start(void)
+{
+	memset(&pool, 0, sizeof pool);
+	if(config.keep_alive and config.idle_timeout_s == 0) {
+		config.idle_timeout_s = POOL_KEEP_ALIVE_IDLE_S;
+		aesd_log(LOG_INFO, "closing keep-alive connections idle for %i s", config.idle_timeout_s);
+	}
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.not_empty, NULL);
+	pthread_cond_init(&pool.not_full, NULL);
+
+	pool.queue_depth = config.queue_depth;
+	pool.queue = calloc(pool.queue_depth, sizeof(struct thread_args_s));
+	pool.workers = calloc(config.num_threads, sizeof(pthread_t));
+	if(pool.queue == NULL or pool.workers == NULL) {
+		aesd_log(LOG_ERR, "Error allocating worker pool.");
+		return -1;
+	}
+
+	for(pool.num_workers = 0; pool.num_workers < config.num_threads; ++pool.num_workers) {
+		if(aesd_create_thread(&pool.workers[pool.num_workers], pool_worker_handler, NULL) != 0) {
+			aesd_log(LOG_ERR, "thread creation failed");
+			return -1;
+		}
+	}
+	aesd_log(LOG_INFO, "pool mode started with %i workers and queue depth %i", pool.num_workers, pool.queue_depth);
+	return 0;
+}
+
+void pool_server_submit(int client_fd, const struct sockaddr_storage *their_addr)
+{
+	pthread_mutex_lock(&pool.lock);
+	while(pool.queue_count == pool.queue_depth) {
+		if(config.overload_policy != AESD_OVERLOAD_BLOCK) {
+			pthread_mutex_unlock(&pool.lock);
+			pool_shed(client_fd);
+			return;
+		}
+
+		// stop accepting until a worker frees a slot, waking periodically in case a signal asked us to exit.
+		// The main thread otherwise only takes SIGINT and SIGTERM in ppoll, so let them in while it waits.
+		struct timespec deadline;
+		sigset_t signal_set, old_set;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += POOL_BLOCK_POLL_NS;
+		if(deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		sigemptyset(&signal_set);
+		sigaddset(&signal_set, SIGINT);
+		sigaddset(&signal_set, SIGTERM);
+		pthread_sigmask(SIG_UNBLOCK, &signal_set, &old_set);
+		pthread_cond_timedwait(&pool.not_full, &pool.lock, &deadline);
+		pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+		if(server_terminate) {
+			pthread_mutex_unlock(&pool.lock);
+			close(client_fd);
+			return;
+		}
+	}
+
+	struct thread_args_s *slot = &pool.queue[(pool.queue_head + pool.queue_count) % pool.queue_depth];
+	memset(slot, 0, sizeof *slot);
+	slot->client_fd = client_fd;
+	slot->their_addr = *their_addr;
+	slot->accepted_ns = aesd_metrics_now();
+	pool.queue_count++;
+	pthread_cond_signal(&pool.not_empty);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+int pool_server_queued(void)
+{
+	pthread_mutex_lock(&pool.lock);
+	int queued = pool.queue_count;
+	pthread_mutex_unlock(&pool.lock);
+	return queued;
+}
+
+void pool_server_stop(void)
+{
+	pthread_mutex_lock(&pool.lock);
+	pool.terminate = true;
+	pthread_cond_broadcast(&pool.not_empty);
+	pthread_mutex_unlock(&pool.lock);
+
+	// workers finish the request they are servicing before exiting, an idle keep-alive client sees a close
+	aesd_shutdown_connections(SHUT_RD);
+	for(int i = 0; i < pool.num_workers; ++i) {
+		pthread_join(pool.workers[i], NULL);
+	}
+
+	// connections still waiting in the queue were never serviced
+	while(pool.queue_count > 0) {
+		close(pool.queue[pool.queue_head].client_fd);
+		pool.queue_head = (pool.queue_head + 1) % pool.queue_depth;
+		pool.queue_count--;
+	}
+
+	free(pool.workers);
+	free(pool.queue);
+	pthread_cond_destroy(&pool.not_full);
+	pthread_cond_destroy(&pool.not_empty);
+	pthread_mutex_destroy(&pool.lock);
+}
@@ -0,0 +1,193 @@
+/*
+ * aesd-reply.c
+ *
+ * Zero-copy read-back reply path, see aesd-reply.h
+ */
+
+#define _GNU_SOURCE // splice, pipe2, F_SETPIPE_SZ
+#include <syslog.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <iso646.h>
+#include <sys/socket.h>
+#include "aesd-reply.h"
+
+#define REPLY_PIPE_SIZE (1024 * 1024) // requested pipe size, the kernel may grant less
+#define REPLY_BUF_CHUNK (64 * 1024) // minimum free space offered to each fallback read()
+
+// set once a source has refused splice() so later replies go straight to the copy path
+static atomic_bool splice_unsupported = false;
+
+void aesd_reply_init(struct aesd_reply *reply, bool force_copy)
+{
+	memset(reply, 0, sizeof *reply);
+	reply->pipe_fd[0] = -1;
+	reply->pipe_fd[1] = -1;
+	reply->src_fd = -1;
+	reply->eof = true;
+	reply->force_copy = force_copy;
+}
+
+/**
+ * Splice from the source into the pipe until the source is exhausted or the pipe is full.
+ * @return 0 on success, 1 if the source doesn't support splice, -1 on error
+ */
+static int reply_fill_pipe(struct aesd_reply *reply)
+{
+	if(reply->pipe_fd[0] < 0) {
+		if(pipe2(reply->pipe_fd, O_NONBLOCK | O_CLOEXEC) != 0) {
+			return -1;
+		}
+		// a larger pipe lets a whole reply be staged with one splice, failure just means more round trips
+		fcntl(reply->pipe_fd[1], F_SETPIPE_SZ, REPLY_PIPE_SIZE);
+		reply->syscalls += 2;
+	}
+
+	while(not reply->eof) {
+		ssize_t numbytes = splice(reply->src_fd, NULL, reply->pipe_fd[1], NULL, REPLY_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		reply->syscalls++;
+		if(numbytes > 0) {
+			reply->pipe_len += numbytes;
+		} else if(numbytes == 0) {
+			reply->eof = true;
+		} else if(errno == EINTR) {
+			continue;
+		} else if(errno == EAGAIN) {
+			break; // pipe is full
+		} else if(errno == EINVAL and reply->pipe_len == 0) {
+			return 1;
+		} else {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Read the rest of the source into the copy buffer.
+ * @return 0 on success, -1 on error
+ */
+static int reply_fill_buf(struct aesd_reply *reply)
+{
+	while(not reply->eof) {
+		if(reply->buf_cap - reply->buf_len < REPLY_BUF_CHUNK) {
+			size_t new_cap = reply->buf_cap ? reply->buf_cap * 2 : REPLY_BUF_CHUNK;
+			char *new_buf = realloc(reply->buf, new_cap);
+			if(new_buf == NULL) {
+				return -1;
+			}
+			reply->buf = new_buf;
+			reply->buf_cap = new_cap;
+		}
+
+		ssize_t numbytes = read(reply->src_fd, reply->buf + reply->buf_len, reply->buf_cap - reply->buf_len);
+		reply->syscalls++;
+		if(numbytes > 0) {
+			reply->buf_len += numbytes;
+		} else if(numbytes == 0) {
+			reply->eof = true;
+		} else if(errno != EINTR) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int aesd_reply_fill(struct aesd_reply *reply, int src_fd)
+{
+	reply->src_fd = src_fd;
+	reply->eof = false;
+	reply->pipe_len = 0;
+	reply->buf_len = 0;
+	reply->buf_sent = 0;
+	if(not reply->force_copy and not atomic_load(&splice_unsupported)) {
+		int result = reply_fill_pipe(reply);
+		if(result < 0) {
+			return result;
+		}
+		if(result > 0) {
+			if(not atomic_exchange(&splice_unsupported, true)) {
+				syslog(LOG_INFO, "output file doesn't support splice, copying replies through a buffer");
+			}
+		}
+	}
+	// anything which didn't fit in the pipe is copied so the whole reply is captured now
+	return reply_fill_buf(reply);
+}
+
+int aesd_reply_fill_mem(struct aesd_reply *reply, const struct iovec *iov, int count)
+{
+	size_t len = 0;
+	for(int i = 0; i < count; ++i) {
+		len += iov[i].iov_len;
+	}
+
+	reply->src_fd = -1;
+	reply->eof = true;
+	reply->pipe_len = 0;
+	reply->buf_len = 0;
+	reply->buf_sent = 0;
+	if(reply->buf_cap < len) {
+		char *new_buf = realloc(reply->buf, len);
+		if(new_buf == NULL) {
+			return -1;
+		}
+		reply->buf = new_buf;
+		reply->buf_cap = len;
+	}
+	for(int i = 0; i < count; ++i) {
+		memcpy(reply->buf + reply->buf_len, iov[i].iov_base, iov[i].iov_len);
+		reply->buf_len += iov[i].iov_len;
+	}
+	return 0;
+}
+
+int aesd_reply_send(struct aesd_reply *reply, int sock_fd)
+{
+	ssize_t numbytes;
+
+	while(true) {
+		bool from_pipe = reply->pipe_len > 0;
+
+		if(from_pipe) {
+			bool more = reply->buf_sent < reply->buf_len;
+			numbytes = splice(reply->pipe_fd[0], NULL, sock_fd, NULL, reply->pipe_len, SPLICE_F_MOVE | (more ? SPLICE_F_MORE : 0));
+		} else if(reply->buf_sent < reply->buf_len) {
+			numbytes = send(sock_fd, reply->buf + reply->buf_sent, reply->buf_len - reply->buf_sent, MSG_NOSIGNAL);
+		} else {
+			return 1;
+		}
+		reply->syscalls++;
+
+		if(numbytes < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			if(errno == EAGAIN or errno == EWOULDBLOCK) {
+				return 0;
+			}
+			return -1;
+		}
+
+		if(from_pipe) {
+			reply->pipe_len -= numbytes;
+		} else {
+			reply->buf_sent += numbytes;
+		}
+		reply->bytes_sent += numbytes;
+	}
+}
+
+void aesd_reply_free(struct aesd_reply *reply)
+{
+	if(reply->pipe_fd[0] >= 0) {
+		close(reply->pipe_fd[0]);
+		close(reply->pipe_fd[1]);
+	}
+	free(reply->buf);
+	aesd_reply_init(reply, reply->force_copy);
+}
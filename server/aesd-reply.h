@@ -0,0 +1,82 @@
+/*
+ * aesd-reply.h
+ *
+ * Read-back reply path from the output file to a client socket.  Data is moved with splice() through a
+ * per-reply pipe so it never passes through user space.  Sources which can't be spliced (splice() reports
+ * EINVAL) are read into one large buffer instead, which is still sent with as few syscalls as possible.
+ *
+ * The whole reply is captured by aesd_reply_fill, so it can be called under a lock to take a consistent
+ * snapshot, and then sent to a slow client by aesd_reply_send with the lock released.
+ */
+
+#ifndef AESD_REPLY_H
+#define AESD_REPLY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+struct aesd_reply {
+	/**
+	 * Pipe used to splice from the source to the socket, -1 until first needed
+	 */
+	int pipe_fd[2];
+	/**
+	 * Bytes waiting in the pipe
+	 */
+	size_t pipe_len;
+	/**
+	 * Copy buffer, holding the reply when splice isn't used or whatever didn't fit in the pipe,
+	 * and how much of it has been filled and sent
+	 */
+	char *buf;
+	size_t buf_len;
+	size_t buf_cap;
+	size_t buf_sent;
+	/**
+	 * Source being replied from and whether it has reached end of file
+	 */
+	int src_fd;
+	bool eof;
+	/**
+	 * Set to copy through the buffer even if the source supports splice
+	 */
+	bool force_copy;
+	/**
+	 * Running totals of syscalls issued and bytes sent, for benchmarking
+	 */
+	unsigned long syscalls;
+	size_t bytes_sent;
+};
+
+/**
+ * Initialize @param reply to an idle state.  @param force_copy disables the splice path.
+ */
+void aesd_reply_init(struct aesd_reply *reply, bool force_copy);
+
+/**
+ * Capture a new reply from the current position of @param src_fd to end of file, in the pipe and, for
+ * anything beyond the pipe size, the copy buffer.  Any previous reply must have been completely sent.
+ * @return 0 on success, -1 on error
+ */
+int aesd_reply_fill(struct aesd_reply *reply, int src_fd);
+
+/**
+ * Capture a new reply copied from the @param count buffers in @param iov, for sources held in memory.
+ * Any previous reply must have been completely sent.
+ * @return 0 on success, -1 on error
+ */
+int aesd_reply_fill_mem(struct aesd_reply *reply, const struct iovec *iov, int count);
+
+/**
+ * Send the captured reply to @param sock_fd.  Works with blocking and non-blocking sockets.
+ * @return 1 when the reply is complete, 0 if the socket would block, -1 on error
+ */
+int aesd_reply_send(struct aesd_reply *reply, int sock_fd);
+
+/**
+ * Release the pipe and buffer owned by @param reply.
+ */
+void aesd_reply_free(struct aesd_reply *reply);
+
+#endif /* AESD_REPLY_H */
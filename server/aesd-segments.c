@@ -0,0 +1,475 @@
+/*
+ * aesd-segments.c
+ *
+ * Segmented append-only log, see aesd-segments.h
+ */
+
+#include <stdio.h>
+#include <syslog.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <iso646.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+#include "aesd-segments.h"
+
+#define SEGMENT_MAGIC (0x41455344) // "AESD"
+#define SEGMENT_VERSION (1)
+// each retained packet pins at most one segment, plus the one being appended to
+#define SEGMENT_SLOTS (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 1)
+#define SEGMENT_NAME_FORMAT "%016" PRIx64 ".seg"
+
+struct segment_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t sequence;
+};
+
+/**
+ * Precedes each packet.  check covers the segment's sequence too, so records left behind by the
+ * segment's previous use fail it and end recovery just like a torn write does.
+ */
+struct record_header {
+	uint32_t len;
+	uint32_t check;
+};
+
+struct segment {
+	int fd; // -1 for an unused slot, otherwise open until the log is closed, even while recycled
+	const char *map; // the whole file, read only
+	size_t size;
+	size_t end; // where the next record goes
+	uint64_t sequence;
+	int live; // retained packets in this segment
+	atomic_bool dirty; // appended to since the last flush
+};
+
+static struct segment segments[SEGMENT_SLOTS];
+static atomic_int active = -1;
+static uint64_t next_sequence = 0;
+static char segment_dir[PATH_MAX - 32]; // leaving room for the segment names
+static int dir_fd = -1;
+static atomic_bool dir_dirty = false;
+static bool sync_writes = false;
+
+static struct aesd_circular_buffer segment_index;
+static int entry_segment[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED]; // segment of each segment_index entry
+
+/**
+ * FNV-1a
+ */
+static uint32_t hash_bytes(uint32_t hash, const void *data, size_t len)
+{
+	const unsigned char *bytes = data;
+	for(size_t i = 0; i < len; ++i) {
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+	return hash;
+}
+
+static uint32_t record_check(uint64_t sequence, const char *packet, uint32_t len)
+{
+	uint32_t hash = hash_bytes(2166136261u, &sequence, sizeof sequence);
+	hash = hash_bytes(hash, &len, sizeof len);
+	return hash_bytes(hash, packet, len);
+}
+
+static void segment_path(char *path, uint64_t sequence)
+{
+	snprintf(path, PATH_MAX, "%s/" SEGMENT_NAME_FORMAT, segment_dir, sequence);
+}
+
+/**
+ * Write all of @param count buffers from @param iov at @param offset of @param fd
+ * @return 0 on success, -1 on error
+ */
+static int write_all(int fd, struct iovec *iov, int count, off_t offset)
+{
+	while(count > 0) {
+		ssize_t numbytes = pwritev(fd, iov, count, offset);
+		if(numbytes < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		offset += numbytes;
+		while(count > 0 and (size_t)numbytes >= iov->iov_len) {
+			numbytes -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if(count > 0) {
+			iov->iov_base = (char*)iov->iov_base + numbytes;
+			iov->iov_len -= numbytes;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Size @param seg to at least @param size bytes and map it.  Only for segments with no retained packets,
+ * whose old mapping nothing points into.
+ * @return 0 on success, -1 on error
+ */
+static int segment_map(struct segment *seg, size_t size)
+{
+	if(size > seg->size) {
+		int result = posix_fallocate(seg->fd, 0, size);
+		if(result != 0) {
+			errno = result;
+			return -1;
+		}
+	} else {
+		size = seg->size;
+	}
+	if(seg->map != NULL and size == seg->size) {
+		return 0;
+	}
+	if(seg->map != NULL) {
+		munmap((void*)seg->map, seg->size);
+		seg->map = NULL;
+	}
+	void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, seg->fd, 0);
+	if(map == MAP_FAILED) {
+		return -1;
+	}
+	seg->map = map;
+	seg->size = size;
+	return 0;
+}
+
+static void segment_release(struct segment *seg)
+{
+	if(seg->map != NULL) {
+		munmap((void*)seg->map, seg->size);
+	}
+	if(seg->fd >= 0) {
+		close(seg->fd);
+	}
+	seg->fd = -1;
+	seg->map = NULL;
+	seg->size = 0;
+	seg->end = 0;
+	seg->live = 0;
+	atomic_store(&seg->dirty, false);
+}
+
+static int sync_dir(void)
+{
+	if(sync_writes) {
+		return fsync(dir_fd);
+	}
+	atomic_store(&dir_dirty, true);
+	return 0;
+}
+
+/**
+ * Start appending to a segment with room for a @param record_len byte record, recycling one which holds
+ * no retained packet if there is one
+ * @return 0 on success, -1 on error
+ */
+static int segment_rotate(size_t record_len)
+{
+	char path[PATH_MAX];
+	char old_path[PATH_MAX];
+	int slot = -1;
+
+	for(int i = 0; i < SEGMENT_SLOTS; ++i) {
+		if(i == atomic_load(&active) or segments[i].live > 0) {
+			continue;
+		}
+		if(segments[i].fd >= 0) {
+			slot = i;
+			break;
+		}
+		if(slot < 0) {
+			slot = i;
+		}
+	}
+	if(slot < 0) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	struct segment *seg = &segments[slot];
+	uint64_t sequence = next_sequence;
+	segment_path(path, sequence);
+	if(seg->fd >= 0) {
+		segment_path(old_path, seg->sequence);
+		if(rename(old_path, path) != 0) {
+			return -1;
+		}
+	} else {
+		seg->fd = open(path, O_CREAT | O_RDWR | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if(seg->fd < 0) {
+			return -1;
+		}
+	}
+	seg->sequence = sequence;
+	next_sequence++;
+
+	struct segment_header header = {.magic = SEGMENT_MAGIC, .version = SEGMENT_VERSION, .sequence = sequence};
+	struct iovec iov = {.iov_base = &header, .iov_len = sizeof header};
+	size_t size = sizeof header + record_len > AESD_SEGMENT_SIZE ? sizeof header + record_len : AESD_SEGMENT_SIZE;
+	if(segment_map(seg, size) != 0 or write_all(seg->fd, &iov, 1, 0) != 0) {
+		syslog(LOG_ERR, "error preparing log segment %s: %s", path, strerror(errno));
+		return -1;
+	}
+	seg->end = sizeof header;
+
+	// the segment being left must reach the disk too, before or with the new one
+	int previous = atomic_load(&active);
+	if(previous >= 0 and sync_writes and fdatasync(segments[previous].fd) != 0) {
+		return -1;
+	}
+	atomic_store(&seg->dirty, true);
+	atomic_store(&active, slot);
+	return sync_dir();
+}
+
+/**
+ * Add the packet of @param len bytes at @param packet, in segment @param slot, to the index
+ */
+static void index_add(int slot, const char *packet, size_t len)
+{
+	if(segment_index.full) {
+		segments[entry_segment[segment_index.out_offs]].live--;
+	}
+	struct aesd_buffer_entry entry = {.buffptr = packet, .size = len};
+	entry_segment[segment_index.in_offs] = slot;
+	aesd_circular_buffer_add_entry(&segment_index, &entry);
+	segments[slot].live++;
+}
+
+int aesd_segments_append(const char *packet, size_t len)
+{
+	if(len > UINT32_MAX - sizeof(struct segment_header) - sizeof(struct record_header)) {
+		errno = EFBIG;
+		return -1;
+	}
+	size_t record_len = sizeof(struct record_header) + len;
+
+	// the packet about to be evicted may free the segment this one needs
+	int evicted = segment_index.full ? entry_segment[segment_index.out_offs] : -1;
+	if(evicted >= 0) {
+		segments[evicted].live--;
+	}
+	int slot = atomic_load(&active);
+	if(slot < 0 or segments[slot].end + record_len > segments[slot].size) {
+		if(segment_rotate(record_len) != 0) {
+			if(evicted >= 0) {
+				segments[evicted].live++;
+			}
+			return -1;
+		}
+		slot = atomic_load(&active);
+	}
+	if(evicted >= 0) {
+		segments[evicted].live++; // index_add does the eviction
+	}
+
+	struct segment *seg = &segments[slot];
+	struct record_header header = {.len = len, .check = record_check(seg->sequence, packet, len)};
+	struct iovec iov[2] = {
+		{.iov_base = &header, .iov_len = sizeof header},
+		{.iov_base = (void*)packet, .iov_len = len},
+	};
+	// a failed write leaves end where it was, the next record overwrites whatever got written
+	if(write_all(seg->fd, iov, 2, seg->end) != 0) {
+		return -1;
+	}
+	atomic_store(&seg->dirty, true);
+	if(sync_writes and fdatasync(seg->fd) != 0) {
+		return -1;
+	}
+	index_add(slot, seg->map + seg->end + sizeof header, len);
+	seg->end += record_len;
+	return 0;
+}
+
+/**
+ * Add the records of the segment in @param slot to the index, leaving it ready to append after the last
+ * intact one
+ */
+static void segment_recover(int slot)
+{
+	struct segment *seg = &segments[slot];
+	struct segment_header header;
+	memcpy(&header, seg->map, sizeof header);
+	if(header.magic != SEGMENT_MAGIC or header.version != SEGMENT_VERSION or header.sequence != seg->sequence) {
+		seg->end = seg->size; // never appended to, recycled once it's needed
+		return;
+	}
+
+	size_t offset = sizeof header;
+	while(offset + sizeof(struct record_header) <= seg->size) {
+		struct record_header record;
+		memcpy(&record, seg->map + offset, sizeof record);
+		const char *packet = seg->map + offset + sizeof record;
+		if(record.len == 0 or record.len > seg->size - offset - sizeof record or
+				record.check != record_check(seg->sequence, packet, record.len)) {
+			break;
+		}
+		index_add(slot, packet, record.len);
+		offset += sizeof record + record.len;
+	}
+	seg->end = offset;
+}
+
+static int compare_sequence(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Map the segments already in the directory and rebuild the index from them
+ * @return 0 on success, -1 on error
+ */
+static int segments_recover(void)
+{
+	DIR *dir = fdopendir(dup(dir_fd));
+	if(dir == NULL) {
+		return -1;
+	}
+	uint64_t *found = NULL;
+	size_t count = 0;
+	struct dirent *dirent;
+	while((dirent = readdir(dir)) != NULL) {
+		uint64_t sequence;
+		char name[32];
+		if(sscanf(dirent->d_name, "%16" SCNx64 ".seg", &sequence) != 1) {
+			continue;
+		}
+		snprintf(name, sizeof name, SEGMENT_NAME_FORMAT, sequence);
+		if(strcmp(name, dirent->d_name) != 0) {
+			continue;
+		}
+		uint64_t *grown = realloc(found, (count + 1) * sizeof(uint64_t));
+		if(grown == NULL) {
+			free(found);
+			closedir(dir);
+			return -1;
+		}
+		found = grown;
+		found[count++] = sequence;
+	}
+	closedir(dir);
+	qsort(found, count, sizeof(uint64_t), compare_sequence);
+
+	// anything beyond the newest SEGMENT_SLOTS can't hold a retained packet
+	size_t first = count > SEGMENT_SLOTS ? count - SEGMENT_SLOTS : 0;
+	char path[PATH_MAX];
+	for(size_t i = 0; i < first; ++i) {
+		segment_path(path, found[i]);
+		unlink(path);
+	}
+	int retval = 0;
+	for(size_t i = first; i < count; ++i) {
+		int slot = i - first;
+		struct segment *seg = &segments[slot];
+		struct stat st;
+		segment_path(path, found[i]);
+		seg->sequence = found[i];
+		seg->fd = open(path, O_RDWR | O_CLOEXEC);
+		if(seg->fd < 0 or fstat(seg->fd, &st) != 0) {
+			retval = -1;
+			break;
+		}
+		seg->size = st.st_size;
+		if(seg->size < sizeof(struct segment_header)) {
+			// never got its header, make it a whole segment to be recycled
+			seg->size = 0;
+			if(segment_map(seg, AESD_SEGMENT_SIZE) != 0) {
+				retval = -1;
+				break;
+			}
+			seg->end = seg->size;
+		} else {
+			if(segment_map(seg, seg->size) != 0) {
+				retval = -1;
+				break;
+			}
+			segment_recover(slot);
+		}
+		atomic_store(&active, slot);
+		next_sequence = found[i] + 1;
+	}
+	free(found);
+	return retval;
+}
+
+int aesd_segments_open(const char *dir, bool sync)
+{
+	if(strlen(dir) >= sizeof segment_dir) {
+		syslog(LOG_ERR, "log directory path too long");
+		return -1;
+	}
+	strcpy(segment_dir, dir);
+	sync_writes = sync;
+	for(int i = 0; i < SEGMENT_SLOTS; ++i) {
+		segments[i].fd = -1;
+	}
+	aesd_circular_buffer_init(&segment_index);
+	atomic_store(&active, -1);
+	next_sequence = 0;
+
+	if(mkdir(dir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0 and errno != EEXIST) {
+		syslog(LOG_ERR, "error creating log directory %s: %s", dir, strerror(errno));
+		return -1;
+	}
+	dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(dir_fd < 0 or segments_recover() != 0) {
+		syslog(LOG_ERR, "error opening log directory %s: %s", dir, strerror(errno));
+		aesd_segments_close();
+		return -1;
+	}
+	int packets = segment_index.full ? AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED : segment_index.in_offs;
+	syslog(LOG_INFO, "recovered %i packets from %s", packets, dir);
+	return 0;
+}
+
+void aesd_segments_close(void)
+{
+	for(int i = 0; i < SEGMENT_SLOTS; ++i) {
+		segment_release(&segments[i]);
+	}
+	if(dir_fd >= 0) {
+		close(dir_fd);
+		dir_fd = -1;
+	}
+	atomic_store(&active, -1);
+	aesd_circular_buffer_init(&segment_index);
+}
+
+struct aesd_circular_buffer *aesd_segments_index(void)
+{
+	return &segment_index;
+}
+
+int aesd_segments_flush(void)
+{
+	int retval = 0;
+	// segment descriptors stay open while the log is, so this is safe alongside appends
+	for(int i = 0; i < SEGMENT_SLOTS; ++i) {
+		if(atomic_exchange(&segments[i].dirty, false) and fdatasync(segments[i].fd) != 0) {
+			retval = -1;
+		}
+	}
+	if(atomic_exchange(&dir_dirty, false) and fsync(dir_fd) != 0) {
+		retval = -1;
+	}
+	return retval;
+}
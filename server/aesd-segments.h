@@ -0,0 +1,51 @@
+/*
+ * aesd-segments.h
+ *
+ * Segmented append-only log behind the "log" store.  Packets are appended as checksummed records to
+ * fixed-size segment files in one directory, each named for its sequence number, and read back through
+ * read-only mappings of those files.  Like the driver only the last AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+ * packets are kept: a segment holding none of them is recycled as the next one to append to, renamed and
+ * rewritten in place rather than unlinked, so a steady stream of writes cycles through the same few files.
+ * Opening an existing directory recovers the packets it holds, stopping at the first torn record.
+ *
+ * Callers serialize appends and index access with file_rwlock, aesd_segments_flush may be called at any time.
+ */
+
+#ifndef AESD_SEGMENTS_H
+#define AESD_SEGMENTS_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#define AESD_SEGMENT_SIZE (1024 * 1024) // a packet which doesn't fit gets a segment sized for it
+
+struct aesd_circular_buffer;
+
+/**
+ * Open or create the log in directory @param dir.  With @param sync_writes every append and segment
+ * change is made durable before returning.
+ * @return 0 on success, -1 on failure
+ */
+int aesd_segments_open(const char *dir, bool sync_writes);
+
+void aesd_segments_close(void);
+
+/**
+ * Append the complete packet of @param len bytes at @param packet, evicting the oldest from the index
+ * @return 0 on success, -1 on error
+ */
+int aesd_segments_append(const char *packet, size_t len);
+
+/**
+ * @return the index of the retained packets, oldest first, each entry pointing into a segment mapping.
+ * Valid until the next append.
+ */
+struct aesd_circular_buffer *aesd_segments_index(void);
+
+/**
+ * Flush appended data to stable storage
+ * @return 0 on success, -1 on error
+ */
+int aesd_segments_flush(void);
+
+#endif /* AESD_SEGMENTS_H */
@@ -0,0 +1,656 @@
+/*
+ * aesd-storage.c
+ *
+ * Packet stores, see aesd-storage.h
+ */
+
+#include <syslog.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <iso646.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+#include "../aesd-char-driver/aesd_mmap.h"
+#include "aesd-storage.h"
+#include "aesd-segments.h"
+#include "aesd-reply.h"
+#include "aesdsocket.h"
+
+#define STORAGE_SCAN_LEN (64 * 1024) // chunk read while counting packets for a seek in the file store
+#define CHARDEV_MAP_TRIES (4) // replies taken from the driver's mapping before falling back to read() while it changes
+
+struct storage_ops {
+	const char *name;
+	bool file_backed; // keeps everything in the one file at storage_path
+	int (*handle_open)(struct aesd_storage_handle *handle);
+	void (*handle_close)(struct aesd_storage_handle *handle);
+	int (*writev)(struct aesd_storage_handle *handle, struct iovec *iov, int count);
+	int (*flush)(void);
+	int (*seek)(struct aesd_storage_handle *handle, const struct aesd_seekto *seekto);
+	ssize_t (*read)(struct aesd_storage_handle *handle, char *buf, size_t len);
+	int (*fill_reply)(struct aesd_storage_handle *handle, struct aesd_reply *reply);
+};
+
+static const struct storage_ops *storage = NULL;
+static const char *storage_path = NULL;
+static enum aesd_storage_sync storage_sync = AESD_STORAGE_SYNC_ALWAYS;
+static int flush_fd = -1; // any descriptor on the file store, for flushing it
+static const struct aesd_mmap_header *chardev_map = NULL; // the driver's packets mapped read-only, if it has an arena
+static size_t chardev_map_len = 0;
+
+// the ring and log stores, only touched under file_rwlock
+static struct aesd_circular_buffer ring;
+static struct aesd_circular_buffer *packets = NULL; // index of the packets held, &ring or the log's
+static char *pending = NULL; // a write not yet ended by a newline, like the driver's temp_write_data
+static size_t pending_len = 0;
+static size_t pending_size = 0; // allocated, doubled as it grows so building a write from small pieces is linear
+
+/*
+ * File backed stores, chardev and file
+ */
+
+static int fd_handle_open(struct aesd_storage_handle *handle)
+{
+	handle->pos = 0;
+	handle->fd = open(storage_path, O_CREAT | O_RDWR | O_APPEND | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+	if(handle->fd < 0) {
+		syslog(LOG_ERR, "error opening %s: %s", storage_path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void fd_handle_close(struct aesd_storage_handle *handle)
+{
+	if(handle->fd >= 0) {
+		close(handle->fd);
+		handle->fd = -1;
+	}
+}
+
+/**
+ * Write @param count buffers from @param iov, continuing after short writes
+ */
+static int fd_writev(struct aesd_storage_handle *handle, struct iovec *iov, int count)
+{
+	while(count > 0) {
+		ssize_t numbytes = writev(handle->fd, iov, count);
+		if(numbytes < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		while(count > 0 and (size_t)numbytes >= iov->iov_len) {
+			numbytes -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if(count > 0) {
+			iov->iov_base = (char*)iov->iov_base + numbytes;
+			iov->iov_len -= numbytes;
+		}
+	}
+	return 0;
+}
+
+static int no_flush(void)
+{
+	return 0; // the driver and the ring keep everything in memory
+}
+
+static int chardev_seek(struct aesd_storage_handle *handle, const struct aesd_seekto *seekto)
+{
+	if(seekto == NULL) {
+		return lseek(handle->fd, 0, SEEK_SET) == 0 ? 0 : -1;
+	}
+	return ioctl(handle->fd, AESDCHAR_IOCSEEKTO, seekto) == 0 ? 0 : -1;
+}
+
+static ssize_t fd_read(struct aesd_storage_handle *handle, char *buf, size_t len)
+{
+	ssize_t numbytes;
+	do {
+		numbytes = read(handle->fd, buf, len);
+	} while(numbytes < 0 and errno == EINTR);
+	return numbytes;
+}
+
+static int fd_fill_reply(struct aesd_storage_handle *handle, struct aesd_reply *reply)
+{
+	return aesd_reply_fill(reply, handle->fd);
+}
+
+/**
+ * Map the driver's header page and arena, see aesd_mmap.h.  Without them, on a driver loaded with no arena
+ * or one which predates them, replies are read.
+ */
+static void chardev_map_open(int fd)
+{
+	struct stat st;
+	if(fstat(fd, &st) != 0 or not S_ISCHR(st.st_mode)) {
+		return; // a plain file standing in for the driver
+	}
+	long page_size = sysconf(_SC_PAGESIZE);
+	const struct aesd_mmap_header *header = mmap(NULL, page_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(header == MAP_FAILED) {
+		syslog(LOG_INFO, "%s can't be mapped, replies are read: %s", storage_path, strerror(errno));
+		return;
+	}
+	size_t len = header->arena_offset + header->arena_size;
+	munmap((void*)header, page_size);
+	header = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	if(header == MAP_FAILED) {
+		syslog(LOG_ERR, "error mapping %s: %s", storage_path, strerror(errno));
+		return;
+	}
+	chardev_map = header;
+	chardev_map_len = len;
+	syslog(LOG_INFO, "replying from the %zu byte arena of %s", (size_t)header->arena_size, storage_path);
+}
+
+/**
+ * Take a reply from the position of @param handle out of chardev_map
+ * @return 0 on success, 1 if it changed while being read or holds packets outside the arena, -1 on error
+ */
+static int chardev_map_fill_reply(struct aesd_storage_handle *handle, struct aesd_reply *reply)
+{
+	const volatile struct aesd_mmap_header *header = chardev_map;
+	const char *arena = (const char*)chardev_map + header->arena_offset;
+	size_t arena_size = header->arena_size;
+
+	off_t pos = lseek(handle->fd, 0, SEEK_CUR);
+	if(pos < 0) {
+		return -1;
+	}
+	uint32_t seq = header->seq;
+	atomic_thread_fence(memory_order_acquire);
+	uint32_t count = header->count;
+	size_t off = header->tail;
+	if(seq % 2 != 0 or header->external != 0) {
+		return 1;
+	}
+
+	struct iovec *iov = malloc((count > 0 ? count : 1) * sizeof *iov);
+	if(iov == NULL) {
+		return -1;
+	}
+	int iov_count = 0;
+	size_t skip = pos;
+	for(uint32_t i = 0; i < count; ++i) {
+		if(off + sizeof(struct aesd_mmap_record) > arena_size) {
+			off = 0;
+		}
+		const struct aesd_mmap_record *record = (const struct aesd_mmap_record*)(arena + off);
+		uint32_t size = record->size;
+		if(size == AESD_MMAP_WRAP) {
+			record = (const struct aesd_mmap_record*)arena;
+			off = 0;
+			size = record->size;
+		}
+		// overwritten while it was read, nothing here can be trusted
+		if(size > arena_size - off - sizeof *record) {
+			free(iov);
+			return 1;
+		}
+		if(skip >= size) {
+			skip -= size;
+		} else {
+			iov[iov_count].iov_base = (char*)(record + 1) + skip;
+			iov[iov_count].iov_len = size - skip;
+			iov_count++;
+			skip = 0;
+		}
+		off += (sizeof *record + size + AESD_MMAP_ALIGN - 1) & ~(size_t)(AESD_MMAP_ALIGN - 1);
+	}
+	int status = aesd_reply_fill_mem(reply, iov, iov_count);
+	free(iov);
+	atomic_thread_fence(memory_order_acquire);
+	if(status == 0 and header->seq != seq) {
+		return 1;
+	}
+	return status;
+}
+
+static int chardev_fill_reply(struct aesd_storage_handle *handle, struct aesd_reply *reply)
+{
+	if(chardev_map != NULL) {
+		for(int i = 0; i < CHARDEV_MAP_TRIES; ++i) {
+			int status = chardev_map_fill_reply(handle, reply);
+			if(status <= 0) {
+				return status;
+			}
+		}
+	}
+	return aesd_reply_fill(reply, handle->fd);
+}
+
+static int file_writev(struct aesd_storage_handle *handle, struct iovec *iov, int count)
+{
+	if(fd_writev(handle, iov, count) != 0) {
+		return -1;
+	}
+	return storage_sync == AESD_STORAGE_SYNC_ALWAYS ? fdatasync(handle->fd) : 0;
+}
+
+static int file_flush(void)
+{
+	return fdatasync(flush_fd);
+}
+
+/**
+ * The file keeps every packet, so write_cmd counts newlines from the start of the file
+ */
+static int file_seek(struct aesd_storage_handle *handle, const struct aesd_seekto *seekto)
+{
+	if(seekto == NULL) {
+		return lseek(handle->fd, 0, SEEK_SET) == 0 ? 0 : -1;
+	}
+
+	char *buf = malloc(STORAGE_SCAN_LEN);
+	if(buf == NULL) {
+		return -1;
+	}
+	off_t offset = 0;
+	off_t start = 0; // of packet write_cmd, once found
+	uint32_t packets = 0;
+	int retval = -1;
+
+	while(true) {
+		ssize_t numbytes = pread(handle->fd, buf, STORAGE_SCAN_LEN, offset);
+		if(numbytes < 0 and errno == EINTR) {
+			continue;
+		}
+		if(numbytes <= 0) {
+			break;
+		}
+		for(char *end = buf, *limit = buf + numbytes; end < limit; ) {
+			char *newline = memchr(end, '\n', limit - end);
+			if(newline == NULL) {
+				break;
+			}
+			off_t packet_end = offset + (newline - buf) + 1;
+			if(packets == seekto->write_cmd) {
+				// same bounds as the driver, the offset may be at most the packet's length
+				if(seekto->write_cmd_offset <= packet_end - start) {
+					retval = lseek(handle->fd, start + seekto->write_cmd_offset, SEEK_SET) < 0 ? -1 : 0;
+				}
+				free(buf);
+				return retval;
+			}
+			packets++;
+			if(packets == seekto->write_cmd) {
+				start = packet_end;
+			}
+			end = newline + 1;
+		}
+		offset += numbytes;
+	}
+	free(buf);
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+ * Stores indexing their last packets in memory, the in-process ring and the log
+ */
+
+static int indexed_handle_open(struct aesd_storage_handle *handle)
+{
+	handle->fd = -1;
+	handle->pos = 0;
+	return 0;
+}
+
+static void indexed_handle_close(struct aesd_storage_handle *handle)
+{
+	(void)handle;
+}
+
+static int indexed_entries(void)
+{
+	return aesd_circular_buffer_count(packets);
+}
+
+/**
+ * @return the entry @param index writes after the oldest one
+ */
+static struct aesd_buffer_entry *indexed_entry(int index)
+{
+	return aesd_circular_buffer_entry_at(packets, index);
+}
+
+/**
+ * Add @param len bytes at @param data to the pending write
+ * @return 1 if that completed it, 0 if it still needs its newline, -1 if out of memory
+ */
+static int pending_add(const char *data, size_t len)
+{
+	if(pending_len + len > pending_size) {
+		size_t new_size = pending_size * 2 > pending_len + len ? pending_size * 2 : pending_len + len;
+		char *grown = realloc(pending, new_size);
+		if(grown == NULL) {
+			return -1;
+		}
+		pending = grown;
+		pending_size = new_size;
+	}
+	memcpy(pending + pending_len, data, len);
+	pending_len += len;
+	// like the driver, a write only becomes an entry once it ends with a newline
+	return pending[pending_len - 1] == '\n';
+}
+
+static void pending_reset(void)
+{
+	free(pending);
+	pending = NULL;
+	pending_len = 0;
+	pending_size = 0;
+}
+
+static int ring_writev(struct aesd_storage_handle *handle, struct iovec *iov, int count)
+{
+	(void)handle;
+	for(int i = 0; i < count; ++i) {
+		if(iov[i].iov_len == 0) {
+			continue;
+		}
+		int complete = pending_add(iov[i].iov_base, iov[i].iov_len);
+		if(complete < 0) {
+			return -1;
+		}
+		if(complete) {
+			// the ring takes over the buffer, less the slack left from doubling
+			char *exact = realloc(pending, pending_len);
+			if(exact != NULL) {
+				pending = exact;
+			}
+			struct aesd_buffer_entry entry = {.buffptr = pending, .size = pending_len};
+			free((char*)aesd_circular_buffer_add_entry(&ring, &entry));
+			pending = NULL;
+			pending_len = 0;
+			pending_size = 0;
+		}
+	}
+	return 0;
+}
+
+static int log_writev(struct aesd_storage_handle *handle, struct iovec *iov, int count)
+{
+	(void)handle;
+	for(int i = 0; i < count; ++i) {
+		const char *data = iov[i].iov_base;
+		size_t len = iov[i].iov_len;
+		if(len == 0) {
+			continue;
+		}
+		// whole packets, the usual case, are appended straight from the caller's buffer
+		if(pending_len == 0 and data[len - 1] == '\n') {
+			if(aesd_segments_append(data, len) != 0) {
+				return -1;
+			}
+			continue;
+		}
+		int complete = pending_add(data, len);
+		if(complete < 0) {
+			return -1;
+		}
+		if(complete) {
+			int result = aesd_segments_append(pending, pending_len);
+			pending_reset();
+			if(result != 0) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int indexed_seek(struct aesd_storage_handle *handle, const struct aesd_seekto *seekto)
+{
+	if(seekto == NULL) {
+		handle->pos = 0;
+		return 0;
+	}
+	if(seekto->write_cmd >= (uint32_t)indexed_entries() or indexed_entry(seekto->write_cmd)->size < seekto->write_cmd_offset) {
+		errno = EINVAL;
+		return -1;
+	}
+	handle->pos = aesd_circular_buffer_offset_of(packets, seekto->write_cmd) + seekto->write_cmd_offset;
+	return 0;
+}
+
+static ssize_t indexed_read(struct aesd_storage_handle *handle, char *buf, size_t len)
+{
+	size_t copied = 0;
+	while(copied < len) {
+		size_t entry_offset;
+		struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(packets, handle->pos, &entry_offset);
+		if(entry == NULL) {
+			break;
+		}
+		size_t chunk = entry->size - entry_offset;
+		if(chunk > len - copied) {
+			chunk = len - copied;
+		}
+		memcpy(buf + copied, entry->buffptr + entry_offset, chunk);
+		copied += chunk;
+		handle->pos += chunk;
+	}
+	return copied;
+}
+
+static int indexed_fill_reply(struct aesd_storage_handle *handle, struct aesd_reply *reply)
+{
+	// the index may be sized to any capacity, not just the driver's default
+	int entries = indexed_entries();
+	struct iovec *iov = malloc((entries > 0 ? entries : 1) * sizeof *iov);
+	if(iov == NULL) {
+		return -1;
+	}
+	int count = 0;
+	size_t skip = handle->pos;
+
+	for(int i = 0; i < entries; ++i) {
+		struct aesd_buffer_entry *entry = indexed_entry(i);
+		if(skip >= entry->size) {
+			skip -= entry->size;
+			continue;
+		}
+		iov[count].iov_base = (char*)entry->buffptr + skip;
+		iov[count].iov_len = entry->size - skip;
+		skip = 0;
+		count++;
+	}
+	int status = aesd_reply_fill_mem(reply, iov, count);
+	free(iov);
+	return status;
+}
+
+static const struct storage_ops storage_ops[] = {
+	[AESD_STORAGE_CHARDEV] = {
+		.name = "chardev",
+		.handle_open = fd_handle_open,
+		.handle_close = fd_handle_close,
+		.file_backed = true,
+		.writev = fd_writev,
+		.flush = no_flush,
+		.seek = chardev_seek,
+		.read = fd_read,
+		.fill_reply = chardev_fill_reply,
+	},
+	[AESD_STORAGE_FILE] = {
+		.name = "file",
+		.handle_open = fd_handle_open,
+		.handle_close = fd_handle_close,
+		.file_backed = true,
+		.writev = file_writev,
+		.flush = file_flush,
+		.seek = file_seek,
+		.read = fd_read,
+		.fill_reply = fd_fill_reply,
+	},
+	[AESD_STORAGE_RING] = {
+		.name = "ring",
+		.handle_open = indexed_handle_open,
+		.handle_close = indexed_handle_close,
+		.writev = ring_writev,
+		.flush = no_flush,
+		.seek = indexed_seek,
+		.read = indexed_read,
+		.fill_reply = indexed_fill_reply,
+	},
+	[AESD_STORAGE_LOG] = {
+		.name = "log",
+		.handle_open = indexed_handle_open,
+		.handle_close = indexed_handle_close,
+		.writev = log_writev,
+		.flush = aesd_segments_flush,
+		.seek = indexed_seek,
+		.read = indexed_read,
+		.fill_reply = indexed_fill_reply,
+	},
+};
+
+int aesd_storage_parse_kind(const char *name)
+{
+	for(size_t i = 0; i < sizeof storage_ops / sizeof storage_ops[0]; ++i) {
+		if(strcmp(name, storage_ops[i].name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int aesd_storage_open(enum aesd_storage_kind kind, const char *path, enum aesd_storage_sync sync)
+{
+	storage = &storage_ops[kind];
+	storage_sync = sync;
+	storage_path = NULL;
+	if(kind == AESD_STORAGE_RING) {
+		aesd_circular_buffer_init(&ring);
+		packets = &ring;
+		return 0;
+	}
+	if(kind == AESD_STORAGE_LOG) {
+		storage_path = path != NULL ? path : AESD_STORAGE_LOG_PATH;
+		if(aesd_segments_open(storage_path, sync == AESD_STORAGE_SYNC_ALWAYS) != 0) {
+			return -1;
+		}
+		packets = aesd_segments_index();
+		return 0;
+	}
+
+	storage_path = path != NULL ? path : kind == AESD_STORAGE_CHARDEV ? OUTPUT_FILENAME : AESD_STORAGE_FILE_PATH;
+	// make sure it can be opened before any connection tries, keeping the descriptor for flushes
+	struct aesd_storage_handle handle;
+	if(fd_handle_open(&handle) != 0) {
+		return -1;
+	}
+	flush_fd = handle.fd;
+	if(kind == AESD_STORAGE_CHARDEV) {
+		chardev_map_open(flush_fd);
+	}
+	return 0;
+}
+
+void aesd_storage_close(void)
+{
+	if(storage == &storage_ops[AESD_STORAGE_RING]) {
+		uint32_t index;
+		struct aesd_buffer_entry *entry;
+		AESD_CIRCULAR_BUFFER_FOREACH(entry, &ring, index) {
+			free((char*)entry->buffptr);
+		}
+		aesd_circular_buffer_init(&ring);
+	} else if(storage == &storage_ops[AESD_STORAGE_LOG]) {
+		aesd_segments_close();
+	}
+	pending_reset();
+	packets = NULL;
+	if(chardev_map != NULL) {
+		munmap((void*)chardev_map, chardev_map_len);
+		chardev_map = NULL;
+	}
+	if(flush_fd >= 0) {
+		close(flush_fd);
+		flush_fd = -1;
+	}
+	storage = NULL;
+}
+
+const char *aesd_storage_name(void)
+{
+	return storage->name;
+}
+
+const char *aesd_storage_path(void)
+{
+	return storage->file_backed ? storage_path : NULL;
+}
+
+int aesd_storage_parse_sync(const char *name, enum aesd_storage_sync *sync, unsigned int *interval_ms)
+{
+	char *end;
+	if(strcmp(name, "always") == 0) {
+		*sync = AESD_STORAGE_SYNC_ALWAYS;
+	} else if(strcmp(name, "never") == 0) {
+		*sync = AESD_STORAGE_SYNC_NEVER;
+	} else {
+		unsigned long ms = strtoul(name, &end, 10);
+		if(*name < '0' or *name > '9' or *end != '\0' or ms == 0 or ms > 60 * 60 * 1000) {
+			return -1;
+		}
+		*sync = AESD_STORAGE_SYNC_INTERVAL;
+		*interval_ms = ms;
+	}
+	return 0;
+}
+
+int aesd_storage_handle_open(struct aesd_storage_handle *handle)
+{
+	return storage->handle_open(handle);
+}
+
+void aesd_storage_handle_close(struct aesd_storage_handle *handle)
+{
+	storage->handle_close(handle);
+}
+
+int aesd_storage_writev(struct aesd_storage_handle *handle, struct iovec *iov, int count)
+{
+	return storage->writev(handle, iov, count);
+}
+
+int aesd_storage_write(struct aesd_storage_handle *handle, const char *data, size_t len)
+{
+	struct iovec iov = {.iov_base = (void*)data, .iov_len = len};
+	return storage->writev(handle, &iov, 1);
+}
+
+int aesd_storage_flush(void)
+{
+	return storage->flush();
+}
+
+int aesd_storage_seek(struct aesd_storage_handle *handle, const struct aesd_seekto *seekto)
+{
+	return storage->seek(handle, seekto);
+}
+
+ssize_t aesd_storage_read(struct aesd_storage_handle *handle, char *buf, size_t len)
+{
+	return storage->read(handle, buf, len);
+}
+
+int aesd_storage_fill_reply(struct aesd_storage_handle *handle, struct aesd_reply *reply)
+{
+	return storage->fill_reply(handle, reply);
+}
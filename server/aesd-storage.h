@@ -0,0 +1,126 @@
+/*
+ * aesd-storage.h
+ *
+ * Where aesdsocket keeps its packets.  Four stores share one interface:
+ *  - chardev: the aesdchar driver at OUTPUT_FILENAME, seeks use AESDCHAR_IOCSEEKTO.  When the driver has an
+ *    arena replies are copied out of its read-only mapping instead of read, see aesd_mmap.h
+ *  - file: a plain append-only file keeping every packet, seeks count newlines through the file
+ *  - ring: an in-process circular log built on aesd-circular-buffer.c with the driver's semantics (the last
+ *    AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED packets, partial writes held until their newline), which makes
+ *    no system calls and needs no kernel module
+ *  - log: the same last packets kept durably in a directory of segment files, see aesd-segments.h
+ * How hard the file and log stores push writes to the disk is the sync policy's choice.
+ * Callers serialize access with file_rwlock exactly as they did for OUTPUT_FILENAME: writes exclusively,
+ * seeks and reads shared.
+ */
+
+#ifndef AESD_STORAGE_H
+#define AESD_STORAGE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "../aesd-char-driver/aesd_ioctl.h"
+
+enum aesd_storage_kind {
+	AESD_STORAGE_CHARDEV,
+	AESD_STORAGE_FILE,
+	AESD_STORAGE_RING,
+	AESD_STORAGE_LOG,
+};
+
+enum aesd_storage_sync {
+	AESD_STORAGE_SYNC_ALWAYS, // every write is on the disk before it returns
+	AESD_STORAGE_SYNC_INTERVAL, // aesd_storage_flush is called every so often
+	AESD_STORAGE_SYNC_NEVER, // left to the kernel's writeback
+};
+
+#define AESD_STORAGE_FILE_PATH "/var/tmp/aesdsocketdata" // default path of AESD_STORAGE_FILE
+#define AESD_STORAGE_LOG_PATH "/var/tmp/aesdsocketlog" // default directory of AESD_STORAGE_LOG
+
+/**
+ * One user's view of the store.  Each connection has its own since seeks move only its own read position.
+ */
+struct aesd_storage_handle {
+	int fd; // descriptor on the file backed stores, -1 for the ring
+	size_t pos; // read position in the ring
+};
+
+struct aesd_reply;
+
+/**
+ * Select and open the store, @param path names the file for AESD_STORAGE_CHARDEV and AESD_STORAGE_FILE
+ * or the directory for AESD_STORAGE_LOG, NULL for the default.  @param sync applies to the file and log.
+ * @return 0 on success, -1 on failure
+ */
+int aesd_storage_open(enum aesd_storage_kind kind, const char *path, enum aesd_storage_sync sync);
+
+void aesd_storage_close(void);
+
+/**
+ * @return the name of the open store, "chardev", "file", "ring" or "log"
+ */
+const char *aesd_storage_name(void);
+
+/**
+ * @return the store's kind for @param name, or -1
+ */
+int aesd_storage_parse_kind(const char *name);
+
+/**
+ * Parse the sync policy @param name, "always", "never" or an interval in milliseconds, setting
+ * @param sync and for an interval @param interval_ms
+ * @return 0 on success, -1 if it isn't one
+ */
+int aesd_storage_parse_sync(const char *name, enum aesd_storage_sync *sync, unsigned int *interval_ms);
+
+/**
+ * @return the path of a store kept in one file, for callers doing their own I/O on it, or NULL for the
+ * ring and log
+ */
+const char *aesd_storage_path(void);
+
+/**
+ * Open @param handle positioned at the start of the store
+ * @return 0 on success, -1 on failure
+ */
+int aesd_storage_handle_open(struct aesd_storage_handle *handle);
+
+void aesd_storage_handle_close(struct aesd_storage_handle *handle);
+
+/**
+ * Append each of the @param count buffers in @param iov as one write, in order, syncing them under the
+ * AESD_STORAGE_SYNC_ALWAYS policy.  @param iov is used up continuing after short writes.
+ * @return 0 on success, -1 on error
+ */
+int aesd_storage_writev(struct aesd_storage_handle *handle, struct iovec *iov, int count);
+
+int aesd_storage_write(struct aesd_storage_handle *handle, const char *data, size_t len);
+
+/**
+ * Flush everything appended so far to stable storage, where the store has any.  Needs no lock.
+ * @return 0 on success, -1 on error
+ */
+int aesd_storage_flush(void);
+
+/**
+ * Move @param handle to @param seekto, as AESDCHAR_IOCSEEKTO does, or back to the start if it is NULL.
+ * @param handle may also be any descriptor on a file backed store with pos unused.
+ * @return 0 on success, -1 if the position doesn't exist
+ */
+int aesd_storage_seek(struct aesd_storage_handle *handle, const struct aesd_seekto *seekto);
+
+/**
+ * Read up to @param len bytes from the position of @param handle, advancing it
+ * @return bytes read, 0 at the end of the store, -1 on error
+ */
+ssize_t aesd_storage_read(struct aesd_storage_handle *handle, char *buf, size_t len);
+
+/**
+ * Capture everything from the position of @param handle to the end of the store in @param reply,
+ * see aesd_reply_fill
+ * @return 0 on success, -1 on error
+ */
+int aesd_storage_fill_reply(struct aesd_storage_handle *handle, struct aesd_reply *reply);
+
+#endif /* AESD_STORAGE_H */
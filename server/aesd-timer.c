@@ -0,0 +1,173 @@
+/*
+ * aesd-timer.c
+ *
+ * timerfd scheduler, see aesd-timer.h
+ */
+
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <iso646.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include "aesdsocket.h"
+#include "aesd-timer.h"
+#include "aesd-log.h"
+
+struct timer_job {
+	const char *name;
+	int timer_fd;
+	void (*job)(void *arg);
+	void *arg;
+};
+
+static struct {
+	pthread_t thread_handle;
+	bool running;
+	int epoll_fd;
+	int wake_fd; // eventfd used to stop the scheduler
+	int num_jobs;
+	struct timer_job jobs[AESD_TIMER_MAX_JOBS];
+} scheduler = {
+	.epoll_fd = -1,
+	.wake_fd = -1,
+};
+
+int aesd_timer_open(unsigned int interval_ms)
+{
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(timer_fd < 0) {
+		return -1;
+	}
+	struct timespec interval = {.tv_sec = interval_ms / 1000, .tv_nsec = (interval_ms % 1000) * 1000000L};
+	struct itimerspec spec = {.it_interval = interval, .it_value = interval};
+	if(timerfd_settime(timer_fd, 0, &spec, NULL) != 0) {
+		close(timer_fd);
+		return -1;
+	}
+	return timer_fd;
+}
+
+uint64_t aesd_timer_expirations(int timer_fd)
+{
+	uint64_t expirations;
+	if(read(timer_fd, &expirations, sizeof expirations) != sizeof expirations) {
+		return 0;
+	}
+	return expirations;
+}
+
+int aesd_timer_add(const char *name, unsigned int interval_ms, void (*job)(void *arg), void *arg)
+{
+	if(scheduler.num_jobs == AESD_TIMER_MAX_JOBS or interval_ms == 0) {
+		aesd_log(LOG_ERR, "can't schedule %s", name);
+		return -1;
+	}
+	struct timer_job *entry = &scheduler.jobs[scheduler.num_jobs];
+	entry->timer_fd = aesd_timer_open(interval_ms);
+	if(entry->timer_fd < 0) {
+		aesd_log(LOG_ERR, "error creating timer for %s: %s", name, strerror(errno));
+		return -1;
+	}
+	entry->name = name;
+	entry->job = job;
+	entry->arg = arg;
+	scheduler.num_jobs++;
+	aesd_log(LOG_INFO, "scheduled %s every %u ms", name, interval_ms);
+	return 0;
+}
+
+static void *scheduler_handler(void *args)
+{
+	(void)args;
+	struct epoll_event events[AESD_TIMER_MAX_JOBS + 1];
+
+	while(true) {
+		int count = epoll_wait(scheduler.epoll_fd, events, AESD_TIMER_MAX_JOBS + 1, -1);
+		if(count < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			aesd_log(LOG_ERR, "scheduler epoll_wait failed: %s", strerror(errno));
+			break;
+		}
+		for(int i = 0; i < count; ++i) {
+			if(events[i].data.ptr == NULL) {
+				return (void*)0;
+			}
+			struct timer_job *entry = events[i].data.ptr;
+			uint64_t expirations = aesd_timer_expirations(entry->timer_fd);
+			if(expirations == 0) {
+				continue;
+			}
+			if(expirations > 1) {
+				aesd_log(LOG_DEBUG, "%s ran %lu intervals late", entry->name, expirations - 1);
+			}
+			entry->job(entry->arg);
+		}
+	}
+	return (void*)0;
+}
+
+int aesd_timer_start(void)
+{
+	if(scheduler.num_jobs == 0) {
+		return 0;
+	}
+	scheduler.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	scheduler.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(scheduler.epoll_fd < 0 or scheduler.wake_fd < 0) {
+		aesd_log(LOG_ERR, "error creating scheduler: %s", strerror(errno));
+		aesd_timer_stop();
+		return -1;
+	}
+	struct epoll_event wake_ev = {.events = EPOLLIN, .data.ptr = NULL};
+	if(epoll_ctl(scheduler.epoll_fd, EPOLL_CTL_ADD, scheduler.wake_fd, &wake_ev) != 0) {
+		aesd_log(LOG_ERR, "epoll_ctl failed: %s", strerror(errno));
+		aesd_timer_stop();
+		return -1;
+	}
+	for(int i = 0; i < scheduler.num_jobs; ++i) {
+		struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &scheduler.jobs[i]};
+		if(epoll_ctl(scheduler.epoll_fd, EPOLL_CTL_ADD, scheduler.jobs[i].timer_fd, &ev) != 0) {
+			aesd_log(LOG_ERR, "epoll_ctl failed: %s", strerror(errno));
+			aesd_timer_stop();
+			return -1;
+		}
+	}
+
+	if(aesd_create_thread(&scheduler.thread_handle, scheduler_handler, NULL) != 0) {
+		aesd_log(LOG_ERR, "thread creation failed");
+		aesd_timer_stop();
+		return -1;
+	}
+	scheduler.running = true;
+	return 0;
+}
+
+void aesd_timer_stop(void)
+{
+	if(scheduler.running) {
+		uint64_t wake = 1;
+		if(write(scheduler.wake_fd, &wake, sizeof wake) != sizeof wake) {
+			aesd_log(LOG_ERR, "error waking scheduler");
+		}
+		pthread_join(scheduler.thread_handle, NULL);
+		scheduler.running = false;
+	}
+	for(int i = 0; i < scheduler.num_jobs; ++i) {
+		close(scheduler.jobs[i].timer_fd);
+	}
+	scheduler.num_jobs = 0;
+	if(scheduler.wake_fd >= 0) {
+		close(scheduler.wake_fd);
+		scheduler.wake_fd = -1;
+	}
+	if(scheduler.epoll_fd >= 0) {
+		close(scheduler.epoll_fd);
+		scheduler.epoll_fd = -1;
+	}
+}
@@ -0,0 +1,46 @@
+/*
+ * aesd-timer.h
+ *
+ * Periodic jobs on timerfd.  One scheduler thread sleeps in epoll_wait on a timerfd per job, so between
+ * ticks it costs nothing, and runs each job from that thread when its timer expires.  A tick missed while
+ * a job was running late is folded into the next run rather than run twice.  Event loops which already
+ * wait in epoll can instead add their own timer from aesd_timer_open and handle it inline.
+ */
+
+#ifndef AESD_TIMER_H
+#define AESD_TIMER_H
+
+#include <stdint.h>
+
+#define AESD_TIMER_MAX_JOBS (8)
+
+/**
+ * Run @param job with @param arg every @param interval_ms, starting one interval after aesd_timer_start.
+ * Jobs are added before the scheduler starts.
+ * @return 0 on success, -1 if there are too many jobs or the timer can't be created
+ */
+int aesd_timer_add(const char *name, unsigned int interval_ms, void (*job)(void *arg), void *arg);
+
+/**
+ * Start the scheduler thread, if any jobs have been added
+ * @return 0 on success, -1 on failure
+ */
+int aesd_timer_start(void);
+
+/**
+ * Stop the scheduler thread and remove every job.  A job which is running is finished first.
+ */
+void aesd_timer_stop(void);
+
+/**
+ * @return a non-blocking timerfd expiring every @param interval_ms, or -1 on failure
+ */
+int aesd_timer_open(unsigned int interval_ms);
+
+/**
+ * Consume the expirations of @param timer_fd
+ * @return the number of intervals which passed since the last call, 0 if none
+ */
+uint64_t aesd_timer_expirations(int timer_fd);
+
+#endif /* AESD_TIMER_H */
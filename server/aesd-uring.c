@@ -0,0 +1,1133 @@
+/*
+ * aesd-uring.c
+ *
+ * io_uring engine for aesdsocket.  Like the epoll reactor, a small fixed number of threads each own a
+ * ring and service the connections they accept, but every accept, recv, file write, file read and send
+ * is an io_uring submission so one io_uring_enter() call submits and reaps a whole batch of them:
+ *  - accepts come from one multishot accept per ring on each shared listening socket
+ *  - each connection has one multishot recv which picks buffers from a provided buffer ring
+ *  - packets and replies are staged in slots of a registered buffer area and written or read with
+ *    WRITE_FIXED/READ_FIXED on the store's file, itself a registered file
+ *  - a write which needs a reply is linked to the first read-back read, so both go in one submission
+ *  - on the file store with -y always an fdatasync is linked behind each write, other policies are left
+ *    to the store flush timer
+ * Seek commands are still applied synchronously on a descriptor opened for the connection.  Only the file
+ * backed chardev and file stores work here, with the ring or log the server falls back to thread mode.
+ * Group commit (-g) and the idle timeout (-i) aren't implemented here either, and fall back the same way,
+ * as does a kernel older than 6.0, which lacks multishot recv.
+ * Replies are read without file_rwlock, the driver keeps each packet write atomic with respect to readers.
+ */
+
+#define _GNU_SOURCE // accept4 flags
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <iso646.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+#include "aesdsocket.h"
+#include "aesd-framer.h"
+#include "aesd-metrics.h"
+#include "aesd-log.h"
+#include "aesd-follow.h"
+
+#define URING_ENTRIES (256)
+#define URING_RECV_BUFS (256) // provided buffers per ring, each AESD_RECV_LEN bytes
+#define URING_RECV_GROUP (0)
+#define URING_SLOTS (32) // registered staging slots per ring, connections beyond this use plain buffers
+#define URING_SLOT_LEN (64 * 1024)
+#define URING_DATA_FILE (0) // registered file index of the store's file
+
+// user_data is the connection pointer with the operation in the low bits, for an accept the listener's index
+#define URING_TAG_MASK (7)
+enum uring_tag {
+	URING_TAG_ACCEPT,
+	URING_TAG_WAKE,
+	URING_TAG_CANCEL,
+	URING_TAG_RECV,
+	URING_TAG_WRITE,
+	URING_TAG_READ,
+	URING_TAG_SEND,
+	URING_TAG_SYNC,
+};
+
+enum uring_conn_state {
+	URING_CONN_IDLE,	// waiting for a complete request
+	URING_CONN_WRITING,	// packet write in flight, possibly linked to the first reply read
+	URING_CONN_READING,	// reading the read-back reply into the staging buffer
+	URING_CONN_SENDING,	// sending the staging buffer
+};
+
+struct uring_conn {
+	int client_fd;
+	char client_ip[INET6_ADDRSTRLEN];
+	struct uring_reactor *reactor;
+	struct aesd_framer framer;
+	enum uring_conn_state state;
+	bool eof; // client has shut down its side of the connection
+	bool recv_armed;
+	bool closing;
+	bool following; // a copy of client_fd was handed to the follow hub, which accounts for the connection
+	int inflight; // submissions whose final completion hasn't been reaped
+
+	uint64_t accepted_ns; // cleared once the first byte has been received
+	uint64_t request_ns; // start of the request being handled
+	uint64_t op_ns; // submission of the file write or read in flight
+	uint64_t read_ns; // time spent in reads of the current reply
+
+	// staging buffer for the packet being written and the reply chunk being read and sent
+	char *buf;
+	int slot; // registered slot index, -1 for a plain heap buffer
+	char *write_buf; // heap copy of a packet too large for buf
+	size_t write_len;
+	bool reply_due; // the write in flight is linked to the first reply read
+	bool sync_due; // the write in flight is linked to an fdatasync, which the reply read follows
+
+	// read-back progress
+	int seek_fd; // descriptor positioned by the last seek command, -1 if none
+	bool reply_from_seek;
+	bool reply_eof;
+	off_t reply_off;
+	size_t buf_len;
+	size_t buf_sent;
+
+	LIST_ENTRY(uring_conn) entries;
+};
+
+struct uring_reactor {
+	pthread_t thread_handle;
+	bool started;
+	bool terminate;
+	int ring_fd;
+	int wake_fd; // eventfd used to stop the reactor, or to stop accepting
+	uint64_t wake_value;
+	atomic_bool stop_accepting;
+	atomic_bool stopping;
+	int data_fd;
+	int listen_fds[AESD_MAX_LISTENERS];
+	int num_listen_fds;
+
+	// submission queue
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sqe_tail; // next sqe to fill, published to *sq_tail on submit
+
+	// completion queue
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr;
+	size_t sq_len;
+	void *cq_ptr;
+	size_t cq_len;
+	size_t sqes_len;
+
+	// provided receive buffers
+	struct io_uring_buf_ring *recv_ring;
+	size_t recv_ring_len;
+	char *recv_bufs;
+
+	// registered staging slots
+	char *slots;
+	int free_slots[URING_SLOTS];
+	int num_free_slots;
+
+	LIST_HEAD(uring_conn_list, uring_conn) conns;
+};
+
+static struct uring_reactor *reactors = NULL;
+static int num_reactors = 0;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static uint64_t uring_data(struct uring_conn *conn, enum uring_tag tag)
+{
+	return (uint64_t)(uintptr_t)conn | tag;
+}
+
+/**
+ * Publish the filled sqes and enter the kernel, waiting for @param wait completions
+ * @return 0 on success, -1 on error
+ */
+static int uring_submit(struct uring_reactor *reactor, unsigned wait)
+{
+	__atomic_store_n(reactor->sq_tail, reactor->sqe_tail, __ATOMIC_RELEASE);
+	unsigned to_submit = reactor->sqe_tail - __atomic_load_n(reactor->sq_head, __ATOMIC_ACQUIRE);
+
+	if(to_submit == 0 and wait == 0) {
+		return 0;
+	}
+	if(sys_io_uring_enter(reactor->ring_fd, to_submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0) < 0) {
+		if(errno == EINTR or errno == EBUSY or errno == EAGAIN) {
+			return 0; // completions are pending or the kernel is short of memory, reap and retry
+		}
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Get a zeroed sqe for @param opcode, submitting what's queued if the submission queue is full
+ * @return the sqe, or NULL if none is available
+ */
+static struct io_uring_sqe *uring_get_sqe(struct uring_reactor *reactor, uint8_t opcode, int fd, uint64_t user_data)
+{
+	if(reactor->sqe_tail - __atomic_load_n(reactor->sq_head, __ATOMIC_ACQUIRE) >= reactor->sq_entries) {
+		if(uring_submit(reactor, 0) != 0 or
+				reactor->sqe_tail - __atomic_load_n(reactor->sq_head, __ATOMIC_ACQUIRE) >= reactor->sq_entries) {
+			aesd_log(LOG_ERR, "io_uring submission queue full");
+			return NULL;
+		}
+	}
+
+	unsigned index = reactor->sqe_tail & reactor->sq_mask;
+	struct io_uring_sqe *sqe = &reactor->sqes[index];
+	reactor->sq_array[index] = index;
+	reactor->sqe_tail++;
+
+	memset(sqe, 0, sizeof *sqe);
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = user_data;
+	return sqe;
+}
+
+static void uring_recycle_buffer(struct uring_reactor *reactor, unsigned bid)
+{
+	unsigned short tail = reactor->recv_ring->tail;
+	struct io_uring_buf *buf = &reactor->recv_ring->bufs[tail & (URING_RECV_BUFS - 1)];
+
+	buf->addr = (uint64_t)(uintptr_t)(reactor->recv_bufs + (size_t)bid * AESD_RECV_LEN);
+	buf->len = AESD_RECV_LEN;
+	buf->bid = bid;
+	__atomic_store_n(&reactor->recv_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Arm the multishot accept on listening socket @param index
+ */
+static int uring_arm_accept(struct uring_reactor *reactor, int index)
+{
+	uint64_t user_data = (uint64_t)index * (URING_TAG_MASK + 1) | URING_TAG_ACCEPT;
+	struct io_uring_sqe *sqe = uring_get_sqe(reactor, IORING_OP_ACCEPT, reactor->listen_fds[index], user_data);
+	if(sqe == NULL) {
+		return -1;
+	}
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	return 0;
+}
+
+static int uring_arm_wake(struct uring_reactor *reactor)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(reactor, IORING_OP_READ, reactor->wake_fd, uring_data(NULL, URING_TAG_WAKE));
+	if(sqe == NULL) {
+		return -1;
+	}
+	sqe->addr = (uint64_t)(uintptr_t)&reactor->wake_value;
+	sqe->len = sizeof reactor->wake_value;
+	return 0;
+}
+
+static void uring_cancel_accept(struct uring_reactor *reactor)
+{
+	for(int i = 0; i < reactor->num_listen_fds; ++i) {
+		struct io_uring_sqe *sqe = uring_get_sqe(reactor, IORING_OP_ASYNC_CANCEL, reactor->listen_fds[i], uring_data(NULL, URING_TAG_CANCEL));
+		if(sqe != NULL) {
+			sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+		}
+	}
+}
+
+static int uring_conn_arm_recv(struct uring_conn *conn)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(conn->reactor, IORING_OP_RECV, conn->client_fd, uring_data(conn, URING_TAG_RECV));
+	if(sqe == NULL) {
+		return -1;
+	}
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_RECV_GROUP;
+	conn->recv_armed = true;
+	conn->inflight++;
+	return 0;
+}
+
+/**
+ * Stop servicing @param conn.  Its outstanding socket operations are cancelled, it's freed once they
+ * and any file operation in flight have completed.
+ */
+static void uring_conn_close(struct uring_conn *conn)
+{
+	if(conn->closing) {
+		return;
+	}
+	conn->closing = true;
+
+	struct io_uring_sqe *sqe = uring_get_sqe(conn->reactor, IORING_OP_ASYNC_CANCEL, conn->client_fd, uring_data(NULL, URING_TAG_CANCEL));
+	if(sqe != NULL) {
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	} else {
+		// with no room to cancel, end the socket operations from the socket side, the multishot recv
+		// completes at end of file.  Closing the descriptor wouldn't, the requests hold the file open.
+		shutdown(conn->client_fd, SHUT_RDWR);
+	}
+}
+
+static void uring_conn_free(struct uring_conn *conn)
+{
+	struct uring_reactor *reactor = conn->reactor;
+
+	LIST_REMOVE(conn, entries);
+	close(conn->client_fd);
+	if(conn->seek_fd >= 0) {
+		close(conn->seek_fd);
+	}
+	if(not conn->following) {
+		aesd_log(LOG_INFO, "Closed connection from %s", conn->client_ip);
+		aesd_metrics_add(AESD_COUNTER_ACTIVE, -1);
+	}
+	if(conn->slot >= 0) {
+		reactor->free_slots[reactor->num_free_slots++] = conn->slot;
+	} else {
+		free(conn->buf);
+	}
+	free(conn->write_buf);
+	aesd_framer_free(&conn->framer);
+	free(conn);
+}
+
+/**
+ * Queue a read of the next reply chunk into the staging buffer after what it already holds
+ */
+static int uring_conn_read(struct uring_conn *conn, bool linked)
+{
+	struct uring_reactor *reactor = conn->reactor;
+	uint8_t opcode = conn->slot >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	int fd = conn->reply_from_seek ? conn->seek_fd : URING_DATA_FILE;
+	struct io_uring_sqe *sqe = uring_get_sqe(reactor, opcode, fd, uring_data(conn, URING_TAG_READ));
+	if(sqe == NULL) {
+		return -1;
+	}
+	if(not conn->reply_from_seek) {
+		sqe->flags = IOSQE_FIXED_FILE;
+	}
+	sqe->addr = (uint64_t)(uintptr_t)(conn->buf + conn->buf_len);
+	sqe->len = URING_SLOT_LEN - conn->buf_len;
+	// the seek command left the connection's own descriptor positioned, otherwise read from the start
+	sqe->off = conn->reply_from_seek ? (uint64_t)-1 : (uint64_t)conn->reply_off;
+	sqe->buf_index = 0;
+	if(not linked) {
+		conn->state = URING_CONN_READING; // a linked read leaves the connection writing until the write completes
+		conn->op_ns = aesd_metrics_now();
+	}
+	conn->inflight++;
+	return 0;
+}
+
+static int uring_conn_send(struct uring_conn *conn)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(conn->reactor, IORING_OP_SEND, conn->client_fd, uring_data(conn, URING_TAG_SEND));
+	if(sqe == NULL) {
+		return -1;
+	}
+	sqe->addr = (uint64_t)(uintptr_t)(conn->buf + conn->buf_sent);
+	sqe->len = conn->buf_len - conn->buf_sent;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	conn->state = URING_CONN_SENDING;
+	conn->inflight++;
+	return 0;
+}
+
+static void uring_conn_reset_reply(struct uring_conn *conn, bool from_seek)
+{
+	conn->reply_from_seek = from_seek;
+	conn->reply_eof = false;
+	conn->reply_off = 0;
+	conn->read_ns = 0;
+	conn->buf_len = 0;
+	conn->buf_sent = 0;
+}
+
+/**
+ * Queue the write of one packet, copied so the framer may keep receiving, and if @param reply is set
+ * the first read of the read-back reply linked behind it.
+ */
+static int uring_conn_write(struct uring_conn *conn, const char *packet, size_t len, bool reply)
+{
+	struct uring_reactor *reactor = conn->reactor;
+	struct io_uring_sqe *sqe;
+
+	aesd_log(LOG_DEBUG, "write %zu bytes to buffer", len);
+	// followers get the packet as it's queued, writes from each ring land in submission order.  These writes
+	// don't take file_rwlock, so a follower joining while one is in flight may get that packet twice.
+	aesd_follow_publish(packet, len);
+	if(len <= URING_SLOT_LEN) {
+		memcpy(conn->buf, packet, len);
+		sqe = uring_get_sqe(reactor, conn->slot >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, URING_DATA_FILE, uring_data(conn, URING_TAG_WRITE));
+		if(sqe == NULL) {
+			return -1;
+		}
+		sqe->addr = (uint64_t)(uintptr_t)conn->buf;
+	} else {
+		conn->write_buf = malloc(len);
+		if(conn->write_buf == NULL) {
+			aesd_log(LOG_ERR, "Error allocating packet buffer.");
+			aesd_metrics_add(AESD_COUNTER_ERRORS, 1);
+			return -1;
+		}
+		memcpy(conn->write_buf, packet, len);
+		sqe = uring_get_sqe(reactor, IORING_OP_WRITE, URING_DATA_FILE, uring_data(conn, URING_TAG_WRITE));
+		if(sqe == NULL) {
+			return -1;
+		}
+		sqe->addr = (uint64_t)(uintptr_t)conn->write_buf;
+	}
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->len = len;
+	sqe->off = (uint64_t)-1; // append at the file position
+	conn->write_len = len;
+	conn->op_ns = aesd_metrics_now();
+	sqe->buf_index = 0;
+	conn->state = URING_CONN_WRITING;
+	conn->inflight++;
+
+	// the file store syncs every write under AESD_STORAGE_SYNC_ALWAYS, the chardev never does
+	conn->sync_due = config.storage == AESD_STORAGE_FILE and config.sync == AESD_STORAGE_SYNC_ALWAYS;
+	if(conn->sync_due) {
+		sqe->flags |= IOSQE_IO_LINK;
+		sqe = uring_get_sqe(reactor, IORING_OP_FSYNC, URING_DATA_FILE, uring_data(conn, URING_TAG_SYNC));
+		if(sqe == NULL) {
+			return -1;
+		}
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		conn->inflight++;
+	}
+
+	conn->reply_due = reply;
+	if(reply) {
+		// a short or failed write or sync cancels the linked read
+		sqe->flags |= IOSQE_IO_LINK;
+		uring_conn_reset_reply(conn, false);
+		return uring_conn_read(conn, true);
+	}
+	return 0;
+}
+
+/**
+ * Apply a seek command on the connection's own descriptor, opening it on first use
+ * @return 0 on success, -1 on error
+ */
+static int uring_conn_seek(struct uring_conn *conn, const struct aesd_seekto *seekto)
+{
+	if(conn->seek_fd < 0) {
+		conn->seek_fd = open(aesd_storage_path(), O_RDWR | O_CLOEXEC);
+		if(conn->seek_fd < 0) {
+			aesd_log(LOG_ERR, "error opening %s: %s", aesd_storage_path(), strerror(errno));
+			return -1;
+		}
+	}
+	struct aesd_storage_handle store = {.fd = conn->seek_fd};
+	if(aesd_storage_seek(&store, seekto) != 0) {
+		aesd_log(LOG_ERR, "error handling AESDCHAR_IOCSEEKTO command. seekto cmd=%u offset=%u", seekto->write_cmd, seekto->write_cmd_offset);
+		aesd_metrics_add(AESD_COUNTER_ERRORS, 1);
+		return -1;
+	}
+	uring_conn_reset_reply(conn, true);
+	return 0;
+}
+
+/**
+ * Start the next request buffered for an idle connection, with the same framing as aesd_handle_requests
+ */
+static void uring_conn_advance(struct uring_conn *conn)
+{
+	const char *packet;
+	size_t len;
+	struct aesd_seekto seekto;
+	int result = 0;
+
+	if(conn->state != URING_CONN_IDLE or conn->closing) {
+		return;
+	}
+
+	if(aesd_framer_next(&conn->framer, &packet, &len)) {
+		aesd_metrics_add(AESD_COUNTER_REQUESTS, 1);
+		conn->request_ns = aesd_metrics_now();
+		if(aesd_parse_seekto(packet, len, &seekto)) {
+			aesd_log(LOG_DEBUG, "seek cmd:%u offset %u", seekto.write_cmd, seekto.write_cmd_offset);
+			result = uring_conn_seek(conn, &seekto);
+			if(result == 0) {
+				result = uring_conn_read(conn, false);
+			}
+		} else if(aesd_parse_follow(packet, len)) {
+			// the hub gets its own descriptor, this one is closed along with the rest of the connection
+			int follow_fd = dup(conn->client_fd);
+			if(follow_fd >= 0 and aesd_follow_add(follow_fd, conn->client_ip) == 0) {
+				conn->following = true;
+			} else if(follow_fd >= 0) {
+				close(follow_fd);
+			}
+			result = -1;
+		} else {
+			// without keep-alive, reply once the received data ends on a packet boundary
+			result = uring_conn_write(conn, packet, len, config.keep_alive or aesd_framer_pending(&conn->framer) == 0);
+		}
+	} else if(conn->eof) {
+		conn->request_ns = aesd_metrics_now();
+		len = aesd_framer_take_partial(&conn->framer, &packet);
+		if(len > 0) {
+			// the driver holds the partial write until a newline arrives
+			result = uring_conn_write(conn, packet, len, not config.keep_alive);
+		} else if(config.keep_alive) {
+			// every complete request has been answered already
+			uring_conn_close(conn);
+		} else {
+			uring_conn_reset_reply(conn, false);
+			result = uring_conn_read(conn, false);
+		}
+	}
+
+	if(result != 0) {
+		uring_conn_close(conn);
+	}
+}
+
+static void uring_conn_reply_done(struct uring_conn *conn)
+{
+	aesd_metrics_since(AESD_HIST_REQUEST, conn->request_ns);
+	conn->state = URING_CONN_IDLE;
+	if(not config.keep_alive) {
+		uring_conn_close(conn);
+		return;
+	}
+	// a pipelined request may already be buffered
+	uring_conn_advance(conn);
+}
+
+static void uring_conn_on_recv(struct uring_conn *conn, struct io_uring_cqe *cqe)
+{
+	struct uring_reactor *reactor = conn->reactor;
+
+	if(cqe->flags & IORING_CQE_F_BUFFER) {
+		unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if(cqe->res > 0 and not conn->closing) {
+			size_t avail;
+			char *rx_data = aesd_framer_space(&conn->framer, cqe->res, &avail);
+			if(rx_data == NULL) {
+				aesd_log(LOG_ERR, "Error allocating receive buffer, discarding packet.");
+				aesd_metrics_add(AESD_COUNTER_ERRORS, 1);
+				uring_conn_close(conn);
+			} else {
+				memcpy(rx_data, reactor->recv_bufs + (size_t)bid * AESD_RECV_LEN, cqe->res);
+				aesd_framer_commit(&conn->framer, cqe->res);
+				aesd_log(LOG_DEBUG, "recieved %i bytes.", cqe->res);
+				if(conn->accepted_ns != 0) {
+					aesd_metrics_since(AESD_HIST_FIRST_BYTE, conn->accepted_ns);
+					conn->accepted_ns = 0;
+				}
+				aesd_metrics_add(AESD_COUNTER_BYTES_IN, cqe->res);
+			}
+		}
+		uring_recycle_buffer(reactor, bid);
+	}
+	if(conn->closing) {
+		return;
+	}
+
+	if(cqe->res == 0) {
+		conn->eof = true;
+	} else if(cqe->res < 0 and cqe->res != -ENOBUFS) {
+		uring_conn_close(conn);
+		return;
+	}
+	if(not conn->recv_armed and not conn->eof and uring_conn_arm_recv(conn) != 0) {
+		// the multishot recv ran out of buffers, it's re-armed now some have been recycled
+		uring_conn_close(conn);
+		return;
+	}
+	uring_conn_advance(conn);
+}
+
+/**
+ * The packet write, and its sync if one was linked, has completed
+ */
+static void uring_conn_written(struct uring_conn *conn)
+{
+	aesd_metrics_since(AESD_HIST_WRITE, conn->op_ns);
+	if(conn->reply_due) {
+		conn->state = URING_CONN_READING; // the linked read is under way
+		conn->op_ns = aesd_metrics_now();
+		return;
+	}
+	conn->state = URING_CONN_IDLE;
+	uring_conn_advance(conn);
+}
+
+static void uring_conn_on_write(struct uring_conn *conn, struct io_uring_cqe *cqe)
+{
+	free(conn->write_buf);
+	conn->write_buf = NULL;
+	if(cqe->res < 0 or (size_t)cqe->res != conn->write_len) {
+		aesd_log(LOG_ERR, "error writing data to file.");
+		aesd_metrics_add(AESD_COUNTER_ERRORS, 1);
+		uring_conn_close(conn);
+		return;
+	}
+	if(conn->sync_due) {
+		return; // the linked sync is under way, the write is timed to its completion
+	}
+	uring_conn_written(conn);
+}
+
+static void uring_conn_on_sync(struct uring_conn *conn, struct io_uring_cqe *cqe)
+{
+	if(cqe->res < 0) {
+		if(cqe->res != -ECANCELED) {
+			aesd_log(LOG_ERR, "error syncing data to file.");
+			aesd_metrics_add(AESD_COUNTER_ERRORS, 1);
+		}
+		uring_conn_close(conn);
+		return;
+	}
+	uring_conn_written(conn);
+}
+
+static void uring_conn_on_read(struct uring_conn *conn, struct io_uring_cqe *cqe)
+{
+	int result;
+
+	if(cqe->res < 0) {
+		if(cqe->res != -ECANCELED) {
+			aesd_log(LOG_ERR, "error reading data from file.");
+			aesd_metrics_add(AESD_COUNTER_ERRORS, 1);
+		}
+		uring_conn_close(conn);
+		return;
+	}
+	conn->buf_len += cqe->res;
+	conn->reply_off += cqe->res;
+	conn->read_ns += aesd_metrics_now() - conn->op_ns;
+	if(cqe->res == 0) {
+		conn->reply_eof = true;
+		aesd_metrics_observe(AESD_HIST_READ_BACK, conn->read_ns);
+	}
+
+	// the driver returns at most one packet per read, so fill the buffer before sending it
+	if(conn->reply_eof or conn->buf_len == URING_SLOT_LEN) {
+		if(conn->buf_len == 0) {
+			uring_conn_reply_done(conn);
+			return;
+		}
+		result = uring_conn_send(conn);
+	} else {
+		result = uring_conn_read(conn, false);
+	}
+	if(result != 0) {
+		uring_conn_close(conn);
+	}
+}
+
+static void uring_conn_on_send(struct uring_conn *conn, struct io_uring_cqe *cqe)
+{
+	int result;
+
+	if(cqe->res < 0) {
+		aesd_log(LOG_ERR, "error sending reply to %s", conn->client_ip);
+		aesd_metrics_add(AESD_COUNTER_ERRORS, 1);
+		uring_conn_close(conn);
+		return;
+	}
+	conn->buf_sent += cqe->res;
+	aesd_metrics_add(AESD_COUNTER_BYTES_OUT, cqe->res);
+	if(conn->buf_sent < conn->buf_len) {
+		result = uring_conn_send(conn);
+	} else if(conn->reply_eof) {
+		uring_conn_reply_done(conn);
+		return;
+	} else {
+		conn->buf_len = 0;
+		conn->buf_sent = 0;
+		result = uring_conn_read(conn, false);
+	}
+	if(result != 0) {
+		uring_conn_close(conn);
+	}
+}
+
+static void uring_accept(struct uring_reactor *reactor, struct io_uring_cqe *cqe)
+{
+	if(not (cqe->flags & IORING_CQE_F_MORE) and not reactor->terminate and not server_terminate) {
+		if(uring_arm_accept(reactor, cqe->user_data / (URING_TAG_MASK + 1)) != 0) {
+			aesd_log(LOG_ERR, "error re-arming accept");
+		}
+	}
+	if(cqe->res < 0) {
+		if(cqe->res != -ECANCELED and cqe->res != -ECONNABORTED and not server_terminate) {
+			aesd_log(LOG_ERR, "accept failed: %s", strerror(-cqe->res));
+		}
+		return;
+	}
+
+	int client_fd = cqe->res;
+	struct uring_conn *conn = calloc(1, sizeof(struct uring_conn));
+	if(conn == NULL) {
+		aesd_log(LOG_ERR, "Error allocating connection.");
+		close(client_fd);
+		return;
+	}
+	aesd_metrics_add(AESD_COUNTER_ACCEPTED, 1);
+	conn->client_fd = client_fd;
+	conn->accepted_ns = aesd_metrics_now();
+	conn->reactor = reactor;
+	conn->seek_fd = -1;
+	aesd_framer_init(&conn->framer);
+	if(reactor->num_free_slots > 0) {
+		conn->slot = reactor->free_slots[--reactor->num_free_slots];
+		conn->buf = reactor->slots + (size_t)conn->slot * URING_SLOT_LEN;
+	} else {
+		conn->slot = -1;
+		conn->buf = malloc(URING_SLOT_LEN);
+		if(conn->buf == NULL) {
+			aesd_log(LOG_ERR, "Error allocating connection.");
+			close(client_fd);
+			free(conn);
+			return;
+		}
+	}
+	LIST_INSERT_HEAD(&reactor->conns, conn, entries);
+
+	// multishot accept has nowhere to put each peer address
+	struct sockaddr_storage their_addr;
+	socklen_t addr_size = sizeof their_addr;
+	if(getpeername(client_fd, (struct sockaddr*)&their_addr, &addr_size) != 0 or
+			aesd_addr_string(&their_addr, conn->client_ip, sizeof conn->client_ip) != 0) {
+		aesd_log(LOG_ERR, "inet_ntop failed");
+	}
+	aesd_log(LOG_INFO, "Accepted connection from %s", conn->client_ip);
+	aesd_metrics_add(AESD_COUNTER_ACTIVE, 1);
+	if(config.keep_alive) {
+		// replies are small and sent one per request, don't let Nagle hold them back
+		setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+	}
+
+	if(uring_conn_arm_recv(conn) != 0) {
+		uring_conn_free(conn); // nothing was submitted for it
+	}
+}
+
+static void uring_complete(struct uring_reactor *reactor, struct io_uring_cqe *cqe)
+{
+	enum uring_tag tag = cqe->user_data & URING_TAG_MASK;
+	struct uring_conn *conn = (struct uring_conn*)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_TAG_MASK);
+
+	switch(tag) {
+		case URING_TAG_ACCEPT:
+			uring_accept(reactor, cqe);
+			return;
+		case URING_TAG_WAKE:
+			if(atomic_exchange(&reactor->stop_accepting, false)) {
+				uring_cancel_accept(reactor);
+			}
+			if(atomic_load(&reactor->stopping)) {
+				reactor->terminate = true;
+			} else if(uring_arm_wake(reactor) != 0) {
+				aesd_log(LOG_ERR, "error re-arming wake");
+			}
+			return;
+		case URING_TAG_CANCEL:
+			return;
+		default:
+			break;
+	}
+
+	if(tag != URING_TAG_RECV or not (cqe->flags & IORING_CQE_F_MORE)) {
+		conn->inflight--;
+		if(tag == URING_TAG_RECV) {
+			conn->recv_armed = false;
+		}
+	}
+
+	if(tag == URING_TAG_RECV) {
+		uring_conn_on_recv(conn, cqe);
+	} else if(conn->closing) {
+		free(conn->write_buf);
+		conn->write_buf = NULL;
+	} else if(tag == URING_TAG_WRITE) {
+		uring_conn_on_write(conn, cqe);
+	} else if(tag == URING_TAG_READ) {
+		uring_conn_on_read(conn, cqe);
+	} else if(tag == URING_TAG_SEND) {
+		uring_conn_on_send(conn, cqe);
+	} else if(tag == URING_TAG_SYNC) {
+		uring_conn_on_sync(conn, cqe);
+	}
+
+	if(conn->closing and conn->inflight == 0) {
+		uring_conn_free(conn);
+	}
+}
+
+/**
+ * Reap every available completion
+ */
+static void uring_reap(struct uring_reactor *reactor)
+{
+	unsigned head = *reactor->cq_head;
+	unsigned tail = __atomic_load_n(reactor->cq_tail, __ATOMIC_ACQUIRE);
+
+	while(head != tail) {
+		struct io_uring_cqe cqe = reactor->cqes[head & reactor->cq_mask];
+		head++;
+		// release the entry first, handling it may submit and wait
+		__atomic_store_n(reactor->cq_head, head, __ATOMIC_RELEASE);
+		uring_complete(reactor, &cqe);
+		if(head == tail) {
+			tail = __atomic_load_n(reactor->cq_tail, __ATOMIC_ACQUIRE);
+		}
+	}
+}
+
+static void *uring_reactor_handler(void *args)
+{
+	struct uring_reactor *reactor = args;
+
+	if(uring_arm_wake(reactor) != 0) {
+		return (void*)-1;
+	}
+	for(int i = 0; i < reactor->num_listen_fds; ++i) {
+		if(uring_arm_accept(reactor, i) != 0) {
+			return (void*)-1;
+		}
+	}
+
+	while(not reactor->terminate) {
+		if(uring_submit(reactor, 1) != 0) {
+			aesd_log(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+			break;
+		}
+		uring_reap(reactor);
+	}
+
+	// cancel everything still outstanding and wait for the connections to drain before the memory goes
+	uring_cancel_accept(reactor);
+	struct uring_conn *conn = LIST_FIRST(&reactor->conns);
+	while(conn != NULL) {
+		struct uring_conn *next = LIST_NEXT(conn, entries);
+		uring_conn_close(conn);
+		if(conn->inflight == 0) {
+			uring_conn_free(conn);
+		}
+		conn = next;
+	}
+	while(not LIST_EMPTY(&reactor->conns)) {
+		if(uring_submit(reactor, 1) != 0) {
+			aesd_log(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+			break;
+		}
+		uring_reap(reactor);
+	}
+	return (void*)0;
+}
+
+static void uring_reactor_free(struct uring_reactor *reactor)
+{
+	// closing the ring releases the registered file and buffers
+	if(reactor->ring_fd >= 0) {
+		close(reactor->ring_fd);
+	}
+	if(reactor->sqes != NULL) {
+		munmap(reactor->sqes, reactor->sqes_len);
+	}
+	if(reactor->cq_ptr != NULL and reactor->cq_ptr != reactor->sq_ptr) {
+		munmap(reactor->cq_ptr, reactor->cq_len);
+	}
+	if(reactor->sq_ptr != NULL) {
+		munmap(reactor->sq_ptr, reactor->sq_len);
+	}
+	if(reactor->recv_ring != NULL) {
+		munmap(reactor->recv_ring, reactor->recv_ring_len);
+	}
+	if(reactor->slots != NULL) {
+		munmap(reactor->slots, (size_t)URING_SLOTS * URING_SLOT_LEN);
+	}
+	free(reactor->recv_bufs);
+	if(reactor->wake_fd >= 0) {
+		close(reactor->wake_fd);
+	}
+	if(reactor->data_fd >= 0) {
+		close(reactor->data_fd);
+	}
+}
+
+/**
+ * Create and map the ring for @param reactor and register its file and buffers
+ * @return 0 on success, -1 on failure
+ */
+static int uring_reactor_init(struct uring_reactor *reactor)
+{
+	struct io_uring_params params;
+
+	LIST_INIT(&reactor->conns);
+	reactor->num_listen_fds = aesd_listeners(reactor->listen_fds);
+	reactor->ring_fd = -1;
+	reactor->wake_fd = -1;
+	reactor->data_fd = -1;
+
+	memset(&params, 0, sizeof params);
+	params.flags = IORING_SETUP_COOP_TASKRUN; // the reactor thread reaps its own completions, no need to interrupt it
+	reactor->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+	if(reactor->ring_fd < 0 and errno == EINVAL) {
+		// older kernels don't know the flag
+		memset(&params, 0, sizeof params);
+		reactor->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+	}
+	if(reactor->ring_fd < 0) {
+		aesd_log(LOG_ERR, "io_uring_setup failed: %s", strerror(errno));
+		return -1;
+	}
+
+	reactor->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	reactor->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		if(reactor->cq_len > reactor->sq_len) {
+			reactor->sq_len = reactor->cq_len;
+		}
+		reactor->cq_len = reactor->sq_len;
+	}
+	reactor->sq_ptr = mmap(NULL, reactor->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, reactor->ring_fd, IORING_OFF_SQ_RING);
+	if(reactor->sq_ptr == MAP_FAILED) {
+		reactor->sq_ptr = NULL;
+		return -1;
+	}
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		reactor->cq_ptr = reactor->sq_ptr;
+	} else {
+		reactor->cq_ptr = mmap(NULL, reactor->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, reactor->ring_fd, IORING_OFF_CQ_RING);
+		if(reactor->cq_ptr == MAP_FAILED) {
+			reactor->cq_ptr = NULL;
+			return -1;
+		}
+	}
+	reactor->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	reactor->sqes = mmap(NULL, reactor->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, reactor->ring_fd, IORING_OFF_SQES);
+	if(reactor->sqes == MAP_FAILED) {
+		reactor->sqes = NULL;
+		return -1;
+	}
+
+	char *sq = reactor->sq_ptr;
+	char *cq = reactor->cq_ptr;
+	reactor->sq_head = (unsigned*)(sq + params.sq_off.head);
+	reactor->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	reactor->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+	reactor->sq_entries = *(unsigned*)(sq + params.sq_off.ring_entries);
+	reactor->sq_array = (unsigned*)(sq + params.sq_off.array);
+	reactor->sqe_tail = *reactor->sq_tail;
+	reactor->cq_head = (unsigned*)(cq + params.cq_off.head);
+	reactor->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	reactor->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+	reactor->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	reactor->wake_fd = eventfd(0, EFD_CLOEXEC);
+	reactor->data_fd = open(aesd_storage_path(), O_CREAT | O_RDWR | O_APPEND | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+	if(reactor->wake_fd < 0 or reactor->data_fd < 0) {
+		aesd_log(LOG_ERR, "error opening %s", aesd_storage_path());
+		return -1;
+	}
+	if(sys_io_uring_register(reactor->ring_fd, IORING_REGISTER_FILES, &reactor->data_fd, 1) != 0) {
+		aesd_log(LOG_ERR, "error registering output file: %s", strerror(errno));
+		return -1;
+	}
+
+	// staging slots, registered as one buffer so READ_FIXED/WRITE_FIXED skip pinning pages per request
+	reactor->slots = mmap(NULL, (size_t)URING_SLOTS * URING_SLOT_LEN, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(reactor->slots == MAP_FAILED) {
+		reactor->slots = NULL;
+		return -1;
+	}
+	struct iovec slots_iov = {.iov_base = reactor->slots, .iov_len = (size_t)URING_SLOTS * URING_SLOT_LEN};
+	if(sys_io_uring_register(reactor->ring_fd, IORING_REGISTER_BUFFERS, &slots_iov, 1) != 0) {
+		aesd_log(LOG_ERR, "error registering buffers: %s", strerror(errno));
+		return -1;
+	}
+	for(int i = 0; i < URING_SLOTS; ++i) {
+		reactor->free_slots[i] = URING_SLOTS - 1 - i;
+	}
+	reactor->num_free_slots = URING_SLOTS;
+
+	// provided buffer ring for the multishot recvs
+	reactor->recv_ring_len = URING_RECV_BUFS * sizeof(struct io_uring_buf);
+	reactor->recv_ring = mmap(NULL, reactor->recv_ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	reactor->recv_bufs = malloc((size_t)URING_RECV_BUFS * AESD_RECV_LEN);
+	if(reactor->recv_ring == MAP_FAILED or reactor->recv_bufs == NULL) {
+		if(reactor->recv_ring == MAP_FAILED) {
+			reactor->recv_ring = NULL;
+		}
+		return -1;
+	}
+	struct io_uring_buf_reg reg = {
+		.ring_addr = (uint64_t)(uintptr_t)reactor->recv_ring,
+		.ring_entries = URING_RECV_BUFS,
+		.bgid = URING_RECV_GROUP,
+	};
+	if(sys_io_uring_register(reactor->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+		aesd_log(LOG_ERR, "error registering receive buffer ring: %s", strerror(errno));
+		return -1;
+	}
+	for(unsigned bid = 0; bid < URING_RECV_BUFS; ++bid) {
+		uring_recycle_buffer(reactor, bid);
+	}
+	return 0;
+}
+
+/**
+ * Check the kernel takes multishot recvs, which came after provided buffer rings, with one on a socket pair
+ * through @param reactor before its thread starts.  A kernel without them fails it with EINVAL.
+ * @return 0 if they work, -1 if not
+ */
+static int uring_probe_recv_multishot(struct uring_reactor *reactor)
+{
+	int sv[2];
+	bool more = false;
+	bool done = false;
+
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+		return -1;
+	}
+	// one byte then end of file, so a working multishot recv completes twice and finishes by itself
+	struct io_uring_sqe *sqe = uring_get_sqe(reactor, IORING_OP_RECV, sv[0], uring_data(NULL, URING_TAG_RECV));
+	if(sqe == NULL or write(sv[1], "", 1) != 1) {
+		done = true;
+	} else {
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_RECV_GROUP;
+	}
+	close(sv[1]);
+	while(not done and uring_submit(reactor, 1) == 0) {
+		unsigned head = *reactor->cq_head;
+		while(not done and head != __atomic_load_n(reactor->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &reactor->cqes[head++ & reactor->cq_mask];
+			if(cqe->flags & IORING_CQE_F_BUFFER) {
+				uring_recycle_buffer(reactor, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+			}
+			if(cqe->res > 0 and (cqe->flags & IORING_CQE_F_MORE)) {
+				more = true;
+			}
+			done = not (cqe->flags & IORING_CQE_F_MORE);
+		}
+		__atomic_store_n(reactor->cq_head, head, __ATOMIC_RELEASE);
+	}
+	close(sv[0]);
+	return done and more ? 0 : -1;
+}
+
+int uring_server_start(void)
+{
+	if(aesd_storage_path() == NULL) {
+		aesd_log(LOG_ERR, "io_uring mode needs a store kept in one file, not the %s store", aesd_storage_name());
+		return -1;
+	}
+	if(config.commit_window_us >= 0 or config.idle_timeout_s > 0) {
+		aesd_log(LOG_ERR, "io_uring mode supports neither group commit nor an idle timeout");
+		return -1;
+	}
+
+	reactors = calloc(config.num_threads, sizeof(struct uring_reactor));
+	if(reactors == NULL) {
+		aesd_log(LOG_ERR, "Error allocating reactors.");
+		return -1;
+	}
+
+	// set every ring up before starting any thread, so failing part way can still fall back cleanly
+	for(num_reactors = 0; num_reactors < config.num_threads; ++num_reactors) {
+		if(uring_reactor_init(&reactors[num_reactors]) != 0) {
+			num_reactors++;
+			uring_server_stop();
+			return -1;
+		}
+	}
+	if(uring_probe_recv_multishot(&reactors[0]) != 0) {
+		aesd_log(LOG_ERR, "io_uring multishot recv unsupported, it needs Linux 6.0");
+		uring_server_stop();
+		return -1;
+	}
+
+	for(int i = 0; i < num_reactors; ++i) {
+		if(aesd_create_thread(&reactors[i].thread_handle, uring_reactor_handler, &reactors[i]) != 0) {
+			aesd_log(LOG_ERR, "thread creation failed");
+			// the rings already running must not keep accepting alongside the fallback mode
+			uring_server_stop();
+			return -1;
+		}
+		reactors[i].started = true;
+	}
+	aesd_log(LOG_INFO, "io_uring mode started with %i rings", num_reactors);
+	return 0;
+}
+
+void uring_server_stop_accepting(void)
+{
+	for(int i = 0; i < num_reactors; ++i) {
+		uint64_t wake = 1;
+		atomic_store(&reactors[i].stop_accepting, true);
+		if(reactors[i].started and write(reactors[i].wake_fd, &wake, sizeof wake) != sizeof wake) {
+			aesd_log(LOG_ERR, "error waking reactor %i", i);
+		}
+	}
+}
+
+void uring_server_stop(void)
+{
+	for(int i = 0; i < num_reactors; ++i) {
+		uint64_t wake = 1;
+		atomic_store(&reactors[i].stopping, true);
+		if(reactors[i].started and write(reactors[i].wake_fd, &wake, sizeof wake) != sizeof wake) {
+			aesd_log(LOG_ERR, "error waking reactor %i", i);
+		}
+	}
+
+	for(int i = 0; i < num_reactors; ++i) {
+		if(reactors[i].started) {
+			pthread_join(reactors[i].thread_handle, NULL);
+		}
+		uring_reactor_free(&reactors[i]);
+	}
+
+	free(reactors);
+	reactors = NULL;
+	num_reactors = 0;
+}
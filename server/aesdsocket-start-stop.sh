@@ -9,8 +9,13 @@ case "$1" in
 		echo "Stopping aesdsocket"
 		start-stop-daemon -K -n aesdsocket
 		;;
+	upgrade)
+		echo "Upgrading aesdsocket"
+		# the new daemon takes the listening socket over, the old one exits once its connections finish
+		/usr/bin/aesdsocket -d -u
+		;;
 	*)
-		echo "Usage: $0 {start|stop}"
+		echo "Usage: $0 {start|stop|upgrade}"
 	exit 1
 esac
 
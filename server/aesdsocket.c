@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // ppoll
 #include <syslog.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -6,6 +7,9 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -16,17 +20,19 @@
 #include <sys/queue.h>
 #include <pthread.h>
 #include <time.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <poll.h>
 #include "../aesd-char-driver/aesd_ioctl.h"
-
-#define NUM_CONNECTIONS (10)
-
-#define OUTPUT_FILENAME "/dev/aesdchar"
-
-struct thread_args_s {
-	int client_fd; 
-	bool terminate_thread;
-	struct sockaddr_storage their_addr;
-};
+#include "aesdsocket.h"
+#include "aesd-reply.h"
+#include "aesd-framer.h"
+#include "aesd-commit.h"
+#include "aesd-metrics.h"
+#include "aesd-log.h"
+#include "aesd-follow.h"
+#include "aesd-timer.h"
+#include "aesd-handoff.h"
 
 struct slist_data_s {
 	pthread_t thread_handle;
@@ -37,12 +43,39 @@ struct slist_data_s {
 SLIST_HEAD(slisthead, slist_data_s) head = SLIST_HEAD_INITIALIZER(head);
 struct slist_data_t *datap = NULL;
 
-pthread_mutex_t file_mutex;
+// connections inside connection_handler, so a blocked recv() can be woken at shutdown
+static LIST_HEAD(, thread_args_s) open_connections = LIST_HEAD_INITIALIZER(open_connections);
+static pthread_mutex_t open_connections_lock = PTHREAD_MUTEX_INITIALIZER;
+static int open_connections_shutdown = -1; // how aesd_shutdown_connections last shut them down, -1 if not yet
+
+struct aesd_config config = {
+	.is_daemon = false,
+	.mode = AESD_MODE_THREAD,
+	.num_threads = 0, // default to one per online CPU
+	.queue_depth = 64,
+	.overload_policy = AESD_OVERLOAD_BLOCK,
+	.force_copy_reply = false,
+	.keep_alive = false,
+	.commit_window_us = -1,
+	.admin_port = 0,
+	.storage = AESD_STORAGE_CHARDEV,
+	.storage_path = NULL,
+	.sync = AESD_STORAGE_SYNC_ALWAYS,
+	.sync_interval_ms = 0,
+	.timestamps = false,
+	.stats_interval_s = 0,
+	.idle_timeout_s = 0,
+	.upgrade = false,
+	.local_path = AESD_LOCAL_PATH,
+};
 
-pthread_t timestamp_thread_handle;
-bool time_thread_terminate = false;
+pthread_rwlock_t file_rwlock = PTHREAD_RWLOCK_INITIALIZER;
 
 int server_fd; // file descriptor for the server socket
+int local_fd = -1;
+
+volatile sig_atomic_t server_terminate = 0;
+volatile sig_atomic_t server_draining = 0;
 
 // get sockaddr, IPv4 or IPv6 -- from Beej's guide
 void *get_in_addr(struct sockaddr *sa)
@@ -54,23 +87,165 @@ void *get_in_addr(struct sockaddr *sa)
     return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
+int aesd_addr_string(const struct sockaddr_storage *addr, char *buf, size_t len)
+{
+	if(addr->ss_family == AF_UNIX) {
+		snprintf(buf, len, "local");
+		return 0;
+	}
+	const struct sockaddr_in6 *addr6 = (const struct sockaddr_in6*)addr;
+	if(addr->ss_family == AF_INET6 and IN6_IS_ADDR_V4MAPPED(&addr6->sin6_addr)) {
+		// the last four bytes of a v4-mapped address are the IPv4 address
+		return inet_ntop(AF_INET, &addr6->sin6_addr.s6_addr[12], buf, len) == NULL ? -1 : 0;
+	}
+	return inet_ntop(addr->ss_family, get_in_addr((struct sockaddr*)addr), buf, len) == NULL ? -1 : 0;
+}
+
+int aesd_listeners(int fds[AESD_MAX_LISTENERS])
+{
+	int count = 0;
+	fds[count++] = server_fd;
+	if(local_fd >= 0) {
+		fds[count++] = local_fd;
+	}
+	return count;
+}
+
+int aesd_create_thread(pthread_t *thread, void *(*start_routine)(void *), void *arg)
+{
+	sigset_t block_set, old_set;
+	sigemptyset(&block_set);
+	sigaddset(&block_set, SIGINT);
+	sigaddset(&block_set, SIGTERM);
+	sigaddset(&block_set, SIGUSR1);
+	sigaddset(&block_set, SIGUSR2);
+
+	// new threads inherit the creating thread's mask, so block the signals just while creating it
+	pthread_sigmask(SIG_BLOCK, &block_set, &old_set);
+	int result = pthread_create(thread, NULL, start_routine, arg);
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	return result;
+}
+
 void signal_handler(int signal) {
 	(void)signal; // silence compiler warning about unused variable, needs this function signature for signal
 	// Gracefully exits when SIGINT or SIGTERM is received, completing any open connection operations, closing any open sockets, and deleting the file /var/tmp/aesdsocketdata.
 	// Logs message to the syslog “Caught signal, exiting” when SIGINT or SIGTERM is received.	
 	syslog(LOG_INFO, "Caught signal, exiting");
+	// the main thread only takes the signal while waiting, it then shuts everything down in server_cleanup().
+	// server_fd isn't shut down to wake it, a replacement server may be sharing the socket.
+	server_terminate = 1;
+}
+
+/**
+ * SIGUSR1 logs one level more verbosely, SIGUSR2 one level less
+ */
+static void log_level_handler(int signal) {
+	aesd_log_set_level(aesd_log_get_level() + (signal == SIGUSR1 ? 1 : -1));
+}
+
+/**
+ * Join the connection threads which have finished so their list entries don't accumulate.
+ */
+static void reap_completed_threads(void) {
+	struct slist_data_s **link = &SLIST_FIRST(&head);
+	while(*link != NULL) {
+		struct slist_data_s *entry = *link;
+		if(atomic_load(&entry->args.thread_complete)) {
+			pthread_join(entry->thread_handle, NULL);
+			*link = SLIST_NEXT(entry, entries);
+			free(entry);
+		} else {
+			link = &SLIST_NEXT(entry, entries);
+		}
+	}
+}
+
+/**
+ * @return connections still being served, not counting followers, which can simply reconnect
+ */
+static long connections_open(void) {
+	long open = aesd_metrics_get(AESD_COUNTER_ACTIVE) - aesd_metrics_get(AESD_COUNTER_FOLLOWERS);
+	if(config.mode == AESD_MODE_POOL) {
+		open += pool_server_queued();
+	}
+	return open;
+}
+
+/**
+ * The listening sockets have been handed to a replacement server: stop accepting on them, let the replacement start and
+ * wait up to AESD_DRAIN_TIMEOUT_S for the connections this server has to finish.
+ */
+static void drain_connections(void) {
+	// in thread and pool mode the accept loop on this thread has already stopped
+	if(config.mode == AESD_MODE_EPOLL or config.mode == AESD_MODE_SHARD) {
+		epoll_server_stop_accepting();
+	} else if(config.mode == AESD_MODE_URING) {
+		uring_server_stop_accepting();
+	}
+	aesd_handoff_release();
+
+	uint64_t deadline = aesd_metrics_now() + AESD_DRAIN_TIMEOUT_S * 1000000000ULL;
+	long open;
+	while((open = connections_open()) > 0 and aesd_metrics_now() < deadline) {
+		nanosleep(&(struct timespec){.tv_sec = 0, .tv_nsec = 10000000L}, NULL);
+	}
+	if(open > 0) {
+		aesd_log(LOG_WARNING, "closing %li connections still open after draining for %i s", open, AESD_DRAIN_TIMEOUT_S);
+		// the other modes close their connections when stopped, handler threads have to be woken
+		aesd_shutdown_connections(SHUT_RDWR);
+	} else {
+		aesd_log(LOG_INFO, "connections drained");
+	}
+}
+
+/**
+ * Let the connection handlers finish the request they are on and see the client close, closing the connections
+ * which are still open after AESD_TERMINATE_GRACE_MS, such as one whose client isn't reading its reply
+ */
+static void finish_connections(void) {
+	aesd_shutdown_connections(SHUT_RD);
+	uint64_t deadline = aesd_metrics_now() + AESD_TERMINATE_GRACE_MS * 1000000ULL;
+	while(connections_open() > 0 and aesd_metrics_now() < deadline) {
+		nanosleep(&(struct timespec){.tv_sec = 0, .tv_nsec = 10000000L}, NULL);
+	}
+	if(connections_open() > 0) {
+		aesd_shutdown_connections(SHUT_RDWR);
+	}
+}
+
+static void server_cleanup(void) {
+	// the admin thread reads mode state which is about to be freed, and the replacement wants its port
+	aesd_metrics_stop();
+	// no more timestamps or flushes while the store is shutting down
+	aesd_timer_stop();
+	if(server_draining) {
+		drain_connections();
+	}
 	close(server_fd);
-	
-	// close timestamp thread
-/* don't have timestamp in assignment 8
-	time_thread_terminate = true;
-	pthread_join(timestamp_thread_handle, NULL);
-*/
+	if(local_fd >= 0) {
+		close(local_fd);
+		// a replacement server is still listening on it
+		if(not server_draining) {
+			unlink(config.local_path);
+		}
+	}
+
+	if(config.mode == AESD_MODE_THREAD or config.mode == AESD_MODE_POOL) {
+		// a keep-alive client may be idle with its handler blocked in recv()
+		finish_connections();
+	}
+	if(config.mode == AESD_MODE_EPOLL or config.mode == AESD_MODE_SHARD) {
+		epoll_server_stop();
+	} else if(config.mode == AESD_MODE_POOL) {
+		pool_server_stop();
+	} else if(config.mode == AESD_MODE_URING) {
+		uring_server_stop();
+	}
 
 	while(not SLIST_EMPTY(&head)) {
-		// signal thread should terminate and wait for it to join
+		// wait for the thread to finish its connection and join it
 		pthread_t thread_id = SLIST_FIRST(&head)->thread_handle;
-		SLIST_FIRST(&head)->args.terminate_thread = true;
 		pthread_join(thread_id, NULL);
 
 		// remove entry from the linked list and free memory
@@ -78,54 +253,241 @@ void signal_handler(int signal) {
 		SLIST_REMOVE_HEAD(&head, entries);
 		free(entry);
 	}
+
+	// every connection has finished, commit whatever they left queued
+	aesd_commit_stop();
+	aesd_follow_stop();
+	if(config.sync == AESD_STORAGE_SYNC_INTERVAL and aesd_storage_flush() != 0) {
+		aesd_log(LOG_ERR, "error flushing the %s store", aesd_storage_name());
+	}
+	aesd_storage_close();
+	// last, a replacement waiting to open the store is told it's closed
+	aesd_handoff_stop();
+	aesd_log_stop();
 	
 	//if(remove(OUTPUT_FILENAME) != 0) {
-	//	syslog(LOG_ERR, "error deleting OUTPUT_FILENAME");
+	//	aesd_log(LOG_ERR, "error deleting OUTPUT_FILENAME");
 	//}
 
 	exit(EXIT_SUCCESS);
 }
 
-void *timestamp_handler(void* args) {
+/**
+ * Append a timestamp line, every AESD_TIMESTAMP_INTERVAL_MS from the scheduler
+ */
+static void timestamp_job(void *args) {
 	(void)args;
-	time_t last_time = time(NULL);
-	if(last_time == (time_t)(-1)) {
-        syslog(LOG_ERR, "error getting current time.");
-    	exit(-1);
-    }
+	time_t cur_time = time(NULL);
+	if(cur_time == (time_t)(-1)) {
+		aesd_log(LOG_ERR, "error getting current time.");
+		return;
+	}
+	char time_data[100];
+	struct tm tm;
+	size_t len = strftime(time_data, sizeof time_data, "timestamp: %a, %d %b %Y %T %z\n", localtime_r(&cur_time, &tm));
 
-	while(not time_thread_terminate) {
-		time_t cur_time = time(NULL);
-		if(cur_time == (time_t)(-1)) {
-			syslog(LOG_ERR, "error getting current time.");
-			exit(-1);
+	struct aesd_storage_handle store;
+	if(aesd_storage_handle_open(&store) != 0) {
+		return;
+	}
+	pthread_rwlock_wrlock(&file_rwlock);
+	if(aesd_storage_write(&store, time_data, len) != 0) {
+		aesd_log(LOG_ERR, "error writing data to file.");
+		aesd_metrics_add(AESD_COUNTER_ERRORS, 1);
+	} else {
+		aesd_follow_publish(time_data, len);
+	}
+	pthread_rwlock_unlock(&file_rwlock);
+	aesd_storage_handle_close(&store);
+}
+
+/**
+ * Flush the store every config.sync_interval_ms under AESD_STORAGE_SYNC_INTERVAL
+ */
+static void sync_job(void *args) {
+	(void)args;
+	if(aesd_storage_flush() != 0) {
+		aesd_log(LOG_ERR, "error flushing the %s store", aesd_storage_name());
+	}
+}
+
+/**
+ * Log a summary of the counters every config.stats_interval_s
+ */
+static void stats_job(void *args) {
+	(void)args;
+	aesd_metrics_log();
+}
+
+/**
+ * Write one complete packet to @param store, holding the write lock only for the write itself.
+ * While group commit is running the packet goes through @param commit instead, if one is given.
+ * @return 0 on success, AESD_REQUEST_COMMITTING if the packet was queued without waiting, -1 on error
+ */
+static int commit_packet(struct aesd_storage_handle *store, const char *packet, size_t len, struct aesd_commit_req *commit) {
+	int retval = 0;
+
+	aesd_log(LOG_DEBUG, "write %zu bytes to buffer", len);
+	if(commit != NULL and aesd_commit_enabled()) {
+		commit->data = packet;
+		commit->len = len;
+		aesd_commit_submit(commit);
+		if(commit->complete != NULL) {
+			return AESD_REQUEST_COMMITTING;
 		}
-		if(difftime(cur_time, last_time) >= 10.0) {		
-			const int BUF_LEN = 100;
-			char time_data[BUF_LEN];
-			memset(time_data, 0, BUF_LEN);
-		
-			strftime(time_data, BUF_LEN, "timestamp: %a, %d %b %Y %T %z\n", localtime(&cur_time));
+		retval = aesd_commit_wait(commit);
+		commit->data = NULL;
+		return retval;
+	}
 
-			pthread_mutex_lock(&file_mutex);
-	
-			int data_fd = open(OUTPUT_FILENAME, O_CREAT | O_RDWR | O_APPEND, S_IRWXU | S_IRWXG | S_IRWXO);	
-			if(data_fd < 0) {
-				syslog(LOG_ERR, "error opening log file OUTPUT_FILENAME");
-				exit(-1);
-			}
-			if(write(data_fd, time_data, strlen(time_data)) != (ssize_t)strlen(time_data)) {
-				syslog(LOG_ERR, "error writing data to file.");
-				exit(-1);
-			}
-			close(data_fd);
-	
-			pthread_mutex_unlock(&file_mutex);
+	uint64_t start_ns = aesd_metrics_now();
+	pthread_rwlock_wrlock(&file_rwlock);
+	uint64_t locked_ns = aesd_metrics_now();
+	if(aesd_storage_write(store, packet, len) != 0) {
+		aesd_log(LOG_ERR, "error writing data to file.");
+		aesd_metrics_add(AESD_COUNTER_ERRORS, 1);
+		retval = -1;
+	} else {
+		aesd_follow_publish(packet, len);
+	}
+	pthread_rwlock_unlock(&file_rwlock);
+	aesd_metrics_observe(AESD_HIST_LOCK_WAIT, locked_ns - start_ns);
+	aesd_metrics_since(AESD_HIST_WRITE, locked_ns);
+	return retval;
+}
 
-			last_time = cur_time;
+/**
+ * Capture the read-back reply into @param reply under the read lock, so it is a consistent snapshot taken
+ * concurrently with other readers.  A seek command from @param seekto is applied under the same lock,
+ * otherwise the reply starts from the beginning of the file.
+ * @return 0 on success, -1 on error
+ */
+static int snapshot_reply(struct aesd_storage_handle *store, const struct aesd_seekto *seekto, struct aesd_reply *reply) {
+	int retval = 0;
+
+	uint64_t start_ns = aesd_metrics_now();
+	pthread_rwlock_rdlock(&file_rwlock);
+	uint64_t locked_ns = aesd_metrics_now();
+	if(aesd_storage_seek(store, seekto) != 0 and seekto != NULL) {
+		aesd_log(LOG_ERR, "error handling AESDCHAR_IOCSEEKTO command. seekto cmd=%u offset=%u", seekto->write_cmd, seekto->write_cmd_offset);
+		aesd_metrics_add(AESD_COUNTER_ERRORS, 1);
+		retval = -1;
+	}
+	if(retval == 0 and aesd_storage_fill_reply(store, reply) != 0) {
+		aesd_log(LOG_ERR, "error reading data from file.");
+		aesd_metrics_add(AESD_COUNTER_ERRORS, 1);
+		retval = -1;
+	}
+	pthread_rwlock_unlock(&file_rwlock);
+	aesd_metrics_observe(AESD_HIST_LOCK_WAIT, locked_ns - start_ns);
+	aesd_metrics_since(AESD_HIST_READ_BACK, locked_ns);
+	return retval;
+}
+
+int aesd_handle_requests(struct aesd_framer *framer, struct aesd_storage_handle *store, bool eof, struct aesd_reply *reply, struct aesd_commit_req *commit) {
+	const char *packet;
+	size_t len;
+	bool handled = false;
+
+	if(commit->data != NULL) {
+		// resuming after a packet queued by the previous call has been committed
+		commit->data = NULL;
+		if(commit->status != 0) {
+			return -1;
+		}
+		handled = true;
+		if(config.keep_alive) {
+			return snapshot_reply(store, NULL, reply) == 0 ? 1 : -1;
 		}
 	}
-	return (void*)0;
+
+	// check for AESDCHAR_IOCSEEKTO, if found issue ioctl command, if not append data
+	while(aesd_framer_next(framer, &packet, &len)) {
+		struct aesd_seekto seekto;
+		handled = true;
+		aesd_metrics_add(AESD_COUNTER_REQUESTS, 1);
+
+		if(aesd_parse_seekto(packet, len, &seekto)) {
+			aesd_log(LOG_DEBUG, "seek cmd:%u offset %u", seekto.write_cmd, seekto.write_cmd_offset);
+			// reply from the seek position, without keep-alive anything after the command is ignored
+			return snapshot_reply(store, &seekto, reply) == 0 ? 1 : -1;
+		}
+		if(aesd_parse_follow(packet, len)) {
+			return AESD_REQUEST_FOLLOW;
+		}
+
+		int result = commit_packet(store, packet, len, commit);
+		if(result != 0) {
+			return result;
+		}
+		if(config.keep_alive) {
+			// every packet gets its own reply
+			return snapshot_reply(store, NULL, reply) == 0 ? 1 : -1;
+		}
+	}
+
+	if(eof) {
+		// client closed before completing a packet, the driver holds the partial write until a newline arrives.
+		// It's written directly, the connection's earlier packets have all been committed by now.
+		len = aesd_framer_take_partial(framer, &packet);
+		if(len > 0 and commit_packet(store, packet, len, NULL) != 0) {
+			return -1;
+		}
+		if(config.keep_alive) {
+			// every complete request has been answered already
+			return 0;
+		}
+		return snapshot_reply(store, NULL, reply) == 0 ? 1 : -1;
+	}
+
+	// like the original chunked receive loop, reply once the received data ends on a packet boundary
+	if(handled and aesd_framer_pending(framer) == 0) {
+		aesd_log(LOG_DEBUG, "newline rx'd");
+		return snapshot_reply(store, NULL, reply) == 0 ? 1 : -1;
+	}
+	return 0;
+}
+
+/**
+ * Add @param args to open_connections, shutting its client socket down straight away if that has already
+ * happened to the rest
+ */
+static void connection_track(struct thread_args_s *args)
+{
+	pthread_mutex_lock(&open_connections_lock);
+	LIST_INSERT_HEAD(&open_connections, args, open_entries);
+	args->open = true;
+	if(open_connections_shutdown >= 0) {
+		shutdown(args->client_fd, open_connections_shutdown);
+	}
+	pthread_mutex_unlock(&open_connections_lock);
+}
+
+/**
+ * Remove @param args from open_connections, before its client socket is closed or handed on
+ */
+static void connection_untrack(struct thread_args_s *args)
+{
+	pthread_mutex_lock(&open_connections_lock);
+	if(args->open) {
+		LIST_REMOVE(args, open_entries);
+		args->open = false;
+	}
+	pthread_mutex_unlock(&open_connections_lock);
+}
+
+void aesd_shutdown_connections(int how)
+{
+	struct thread_args_s *args;
+
+	pthread_mutex_lock(&open_connections_lock);
+	if(open_connections_shutdown != SHUT_RDWR) {
+		open_connections_shutdown = how;
+	}
+	LIST_FOREACH(args, &open_connections, open_entries) {
+		shutdown(args->client_fd, how);
+	}
+	pthread_mutex_unlock(&open_connections_lock);
 }
 
 void *connection_handler(void* args) {
@@ -134,156 +496,409 @@ void *connection_handler(void* args) {
 	memset(client_ip, 0, INET6_ADDRSTRLEN);
 	int client_fd = ((struct thread_args_s*)args)->client_fd;
 	struct sockaddr_storage their_addr = ((struct thread_args_s*)args)->their_addr;
+	uint64_t accepted_ns = ((struct thread_args_s*)args)->accepted_ns;
 	
-	if(inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr*)&their_addr), client_ip, sizeof client_ip) == NULL) {	
-		syslog(LOG_ERR, "inet_ntop failed");
+	if(aesd_addr_string(&their_addr, client_ip, sizeof client_ip) != 0) {
+		aesd_log(LOG_ERR, "inet_ntop failed");
 		exit(-1);
 	}
 
-	syslog(LOG_INFO, "Accepted connection from %s", client_ip); 
-
-	pthread_mutex_lock(&file_mutex);
+	aesd_log(LOG_INFO, "Accepted connection from %s", client_ip); 
+	aesd_metrics_add(AESD_COUNTER_ACTIVE, 1);
+	connection_track(args);
 
 	// Receive data over the connection and appends to file /var/tmp/aesdsocketdata, creating this file if it doesn’t exist. 
 	//Your implementation should use a newline to separate data packets received.  In other words a packet is considered complete when a newline character is found in the input receive stream, and each newline should result in an append to the /var/tmp/aesdsocketdata file.
 	// You may assume the data stream does not include null characters (therefore can be processed using string handling functions).
 	// You may assume the length of the packet will be shorter than the available heap size.  In other words, as long as you handle malloc() associated failures with error messages you may discard associated over-length packets.
-	int rxdata_fd = open(OUTPUT_FILENAME, O_CREAT | O_RDWR | O_APPEND, S_IRWXU | S_IRWXG | S_IRWXO);	
-	if(rxdata_fd < 0) {
-		syslog(LOG_ERR, "error opening log file OUTPUT_FILENAME");
+	struct aesd_storage_handle store;
+	if(aesd_storage_handle_open(&store) != 0) {
 		exit(-1);
 	}
+	if(config.keep_alive) {
+		// replies are small and sent one per request, don't let Nagle hold them back
+		setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+	}
+	if(config.idle_timeout_s > 0) {
+		// this thread blocks in recv() and send(), let them time out on an idle connection
+		struct timeval timeout = {.tv_sec = config.idle_timeout_s, .tv_usec = 0};
+		setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+		setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+	}
 	
-	const int BUF_LEN = 100;
-	char rx_data[BUF_LEN];
-	memset(rx_data, 0, BUF_LEN);
-	int numbytes;
-	while((numbytes = recv(client_fd, rx_data, BUF_LEN - 1, 0)) > 0) {
-		// check for AESDCHAR_IOCSEEKTO, if found issue ioctl command, if not append data
-		unsigned int x,y;
-		const char* seek_cmd = "AESDCHAR_IOCSEEKTO:%u,%u";
-		syslog(LOG_INFO, "recieved %i bytes.", numbytes);
- 
-		if(sscanf(rx_data, seek_cmd, &x, &y) == 2) {
-			struct aesd_seekto seekto = {.write_cmd = x, .write_cmd_offset = y};
-			syslog(LOG_ERR, "seek cmd:%u offset %u", x, y);
-			if(ioctl(rxdata_fd, AESDCHAR_IOCSEEKTO, &seekto) != 0) {
-				syslog(LOG_ERR, "error handling AESDCHAR_IOCSEEKTO command. seekto cmd=%i offset=%i", seekto.write_cmd, seekto.write_cmd_offset);
-				pthread_mutex_unlock(&file_mutex);
-				close(rxdata_fd);
-				close(client_fd);
-				exit(-1);
+	struct aesd_framer framer;
+	struct aesd_reply reply;
+	struct aesd_commit_req commit = {0}; // no callback, wait for each group commit
+	aesd_framer_init(&framer);
+	aesd_reply_init(&reply, config.force_copy_reply);
+	ssize_t numbytes;
+	bool eof = false;
+	while(true) {
+		uint64_t request_ns = aesd_metrics_now();
+		int result = aesd_handle_requests(&framer, &store, eof, &reply, &commit);
+
+		if(result < 0) {
+			aesd_storage_handle_close(&store);
+			close(client_fd);
+			exit(-1);
+		}
+
+		if(result == AESD_REQUEST_FOLLOW) {
+			connection_untrack(args);
+			if(aesd_follow_add(client_fd, client_ip) == 0) {
+				client_fd = -1; // the follow hub owns the connection now
 			}
 			break;
-		} else {
-			syslog(LOG_INFO, "write %i bytes to buffer", numbytes);
-			if(write(rxdata_fd, rx_data, numbytes) != numbytes) {
-				syslog(LOG_ERR, "error writing data to file.");
-				pthread_mutex_unlock(&file_mutex);
-				close(rxdata_fd);
-				close(client_fd);
-				exit(-1);
+		}
+
+		if(result > 0) {
+			size_t sent_before = reply.bytes_sent;
+			result = aesd_reply_send(&reply, client_fd);
+			aesd_metrics_add(AESD_COUNTER_BYTES_OUT, reply.bytes_sent - sent_before);
+			if(result < 0) {
+				aesd_log(LOG_ERR, "error sending reply to %s", client_ip);
+				aesd_metrics_add(AESD_COUNTER_ERRORS, 1);
+				break;
+			}
+			if(result == 0) {
+				aesd_log(LOG_INFO, "Closing idle connection from %s", client_ip);
+				break; // the send timed out, the client stopped reading
 			}
-		
-			if(rx_data[numbytes - 1] == '\n') {
-				syslog(LOG_INFO, "newline rx'd");
-				lseek(rxdata_fd, 0, SEEK_SET);
+			aesd_metrics_since(AESD_HIST_REQUEST, request_ns);
+			if(not config.keep_alive) {
 				break;
 			}
+			// a pipelined request may already be buffered, handle it before receiving more
+			continue;
 		}
 
-		memset(rx_data, 0, BUF_LEN);
-	}
+		if(eof) {
+			break;
+		}
 
-	pthread_mutex_unlock(&file_mutex);
+		size_t avail;
+		char *rx_data = aesd_framer_space(&framer, AESD_RECV_LEN, &avail);
+		if(rx_data == NULL) {
+			aesd_log(LOG_ERR, "Error allocating receive buffer, discarding packet.");
+			aesd_metrics_add(AESD_COUNTER_ERRORS, 1);
+			break;
+		}
 
-	char tx_data[BUF_LEN];
-	memset(tx_data, 0, BUF_LEN);
-	while((numbytes = read(rxdata_fd, tx_data, BUF_LEN)) > 0) {
-		send(client_fd, tx_data, numbytes, 0);
-	}	
+		numbytes = recv(client_fd, rx_data, avail, 0);
+		if(numbytes < 0 and (errno == EAGAIN or errno == EWOULDBLOCK)) {
+			aesd_log(LOG_INFO, "Closing idle connection from %s", client_ip);
+			break;
+		}
+		if(numbytes <= 0) {
+			eof = true;
+			continue;
+		}
+		aesd_log(LOG_DEBUG, "recieved %zi bytes.", numbytes);
+		if(accepted_ns != 0) {
+			aesd_metrics_since(AESD_HIST_FIRST_BYTE, accepted_ns);
+			accepted_ns = 0;
+		}
+		aesd_metrics_add(AESD_COUNTER_BYTES_IN, numbytes);
+		aesd_framer_commit(&framer, numbytes);
+	}
+	aesd_framer_free(&framer);
+	aesd_reply_free(&reply);
 
-	fdatasync(rxdata_fd);	
-	close(rxdata_fd);
+	aesd_storage_handle_close(&store);
+	connection_untrack(args);
 
 	// Log message to the syslog “Closed connection from XXX” where XXX is the IP address of the connected client.
-	close(client_fd);
-	syslog(LOG_INFO, "Closed connection from %s", client_ip);
+	// A follower is closed and logged by the follow hub instead.
+	if(client_fd >= 0) {
+		close(client_fd);
+		aesd_log(LOG_INFO, "Closed connection from %s", client_ip);
+		aesd_metrics_add(AESD_COUNTER_ACTIVE, -1);
+	}
 
+	atomic_store(&((struct thread_args_s*)args)->thread_complete, true);
 	return (void*)0;
 }
 
 
-int main(int argc, char **argv) {
-	bool is_daemon = false;
-	openlog("aesdsocket", 0, LOG_USER);
-
-	// check that the arguments exist
-	if(argc > 2) {
-		syslog(LOG_ERR, "too many arguments - usage: %s [-d]", argv[0]);
-		return 1;
-	}
-
-	if(argc == 2) {
-		if(strncmp(argv[1], "-d", 3) == 0) {
-			is_daemon = true;
-		} else {
-			syslog(LOG_ERR, "invalid argument - usage: %s [-d]", argv[0]);
-			return 1;
-		}
-	}
-
-	// Set up linked list to track threads
-	SLIST_INIT(&head);
-
-	// Open a stream socket bound to port 9000, failing and returning -1 if any of the socket connection steps fail.
+/**
+ * Open server_fd, a stream socket bound to port 9000.  It is an IPv6 socket also taking IPv4 connections,
+ * or IPv4 only on a host without IPv6.
+ * @return 0 on success, -1 if any of the socket connection steps fail
+ */
+static int open_server_socket(void) {
 	struct addrinfo hints;
 	struct addrinfo* servinfo;
 	memset(&hints, 0, sizeof hints);
-	hints.ai_family = AF_INET;
+	hints.ai_family = AF_INET6;
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_flags = AI_PASSIVE;
-	if(getaddrinfo(NULL, "9000", &hints, &servinfo) != 0) {
-		syslog(LOG_ERR, "getaddrinfo failed");
-		return -1;
+	if(getaddrinfo(NULL, "9000", &hints, &servinfo) == 0) {
+		server_fd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
+		if(server_fd == -1 or setsockopt(server_fd, IPPROTO_IPV6, IPV6_V6ONLY, &(int){0}, sizeof(int)) < 0) {
+			aesd_log(LOG_INFO, "IPv6 unavailable, listening on IPv4 only");
+			if(server_fd != -1) {
+				close(server_fd);
+				server_fd = -1;
+			}
+			freeaddrinfo(servinfo);
+		}
+	}
+	if(server_fd == -1) {
+		hints.ai_family = AF_INET;
+		if(getaddrinfo(NULL, "9000", &hints, &servinfo) != 0) {
+			aesd_log(LOG_ERR, "getaddrinfo failed");
+			return -1;
+		}
+		server_fd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
 	}
-	server_fd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
 	if(server_fd == -1) {
-		syslog(LOG_ERR, "error opening socket");
+		aesd_log(LOG_ERR, "error opening socket");
         return -1;
 	}
 	if(setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0) {
-    	syslog(LOG_ERR, "setsockopt(SO_REUSEADDR) failed");
+    	aesd_log(LOG_ERR, "setsockopt(SO_REUSEADDR) failed");
 		return -1;
 	}
 	if(setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0) {
-        syslog(LOG_ERR, "setsockopt(SO_REUSEPORT) failed");
+        aesd_log(LOG_ERR, "setsockopt(SO_REUSEPORT) failed");
         return -1;
     }
 	if(bind(server_fd, servinfo->ai_addr, servinfo->ai_addrlen) != 0) {
-		syslog(LOG_ERR, "bind failed");
+		aesd_log(LOG_ERR, "bind failed");
 		return -1;
 	}
 	freeaddrinfo(servinfo);
+	return 0;
+}
+
+/**
+ * Open local_fd, a stream socket bound to config.local_path, replacing any socket file left there
+ * @return 0 on success, -1 on failure
+ */
+static int open_local_socket(void) {
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	if(strlen(config.local_path) >= sizeof addr.sun_path) {
+		aesd_log(LOG_ERR, "local socket path %s is too long", config.local_path);
+		return -1;
+	}
+	strcpy(addr.sun_path, config.local_path);
+
+	local_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(local_fd == -1) {
+		aesd_log(LOG_ERR, "error opening local socket");
+		return -1;
+	}
+	unlink(config.local_path);
+	if(bind(local_fd, (struct sockaddr*)&addr, sizeof addr) != 0) {
+		aesd_log(LOG_ERR, "error binding %s: %s", config.local_path, strerror(errno));
+		close(local_fd);
+		local_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+static void usage(const char *name) {
+	aesd_log(LOG_ERR, "usage: %s [-d] [-m thread|epoll|pool|uring|shard] [-n threads] [-q queue_depth] [-o block|rst|busy] [-c] [-k] [-g commit_window_us] [-a admin_port] [-l err|warning|notice|info|debug] [-b chardev|file|ring|log[:path]] [-y always|never|sync_interval_ms] [-t] [-s stats_interval_s] [-i idle_timeout_s] [-u] [-x local_path]", name);
+}
+
+int main(int argc, char **argv) {
+	int opt;
+	openlog("aesdsocket", 0, LOG_USER);
+
+	// -d runs as a daemon, -m selects how connections are handled, -n sets the number of epoll reactor or pool worker threads,
+	// -q and -o set the pool connection queue depth and what to do with new connections when it is full,
+	// -c copies replies through a buffer instead of splicing them, -k keeps connections open for more requests,
+	// -g batches packets from all connections into group commits collected over the given window,
+	// -a serves metrics on the given local port, -l sets the log level, SIGUSR1 and SIGUSR2 raise or lower it while running,
+	// -b selects where packets are kept, optionally with the path of the device, file or log directory,
+	// -y syncs the file or log on every write, never, or every given number of milliseconds,
+	// -t appends a timestamp every ten seconds, -s logs a metrics summary at the given interval,
+	// -i closes connections idle for the given number of seconds, -u takes over from the running server without dropping connections,
+	// -x sets the path of the local AF_UNIX socket
+	while((opt = getopt(argc, argv, "dm:n:q:o:ckg:a:l:b:y:ts:i:ux:")) != -1) {
+		switch(opt) {
+			case 'd':
+				config.is_daemon = true;
+				break;
+			case 'm':
+				if(strcmp(optarg, "thread") == 0) {
+					config.mode = AESD_MODE_THREAD;
+				} else if(strcmp(optarg, "epoll") == 0) {
+					config.mode = AESD_MODE_EPOLL;
+				} else if(strcmp(optarg, "pool") == 0) {
+					config.mode = AESD_MODE_POOL;
+				} else if(strcmp(optarg, "uring") == 0) {
+					config.mode = AESD_MODE_URING;
+				} else if(strcmp(optarg, "shard") == 0) {
+					config.mode = AESD_MODE_SHARD;
+				} else {
+					aesd_log(LOG_ERR, "invalid mode %s", optarg);
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'n':
+				config.num_threads = atoi(optarg);
+				if(config.num_threads <= 0) {
+					aesd_log(LOG_ERR, "invalid thread count %s", optarg);
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'q':
+				config.queue_depth = atoi(optarg);
+				if(config.queue_depth <= 0) {
+					aesd_log(LOG_ERR, "invalid queue depth %s", optarg);
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'o':
+				if(strcmp(optarg, "block") == 0) {
+					config.overload_policy = AESD_OVERLOAD_BLOCK;
+				} else if(strcmp(optarg, "rst") == 0) {
+					config.overload_policy = AESD_OVERLOAD_RST;
+				} else if(strcmp(optarg, "busy") == 0) {
+					config.overload_policy = AESD_OVERLOAD_BUSY;
+				} else {
+					aesd_log(LOG_ERR, "invalid overload policy %s", optarg);
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'c':
+				config.force_copy_reply = true;
+				break;
+			case 'k':
+				config.keep_alive = true;
+				break;
+			case 'g':
+				config.commit_window_us = atoi(optarg);
+				if(config.commit_window_us < 0) {
+					aesd_log(LOG_ERR, "invalid commit window %s", optarg);
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'a':
+				config.admin_port = atoi(optarg);
+				if(config.admin_port <= 0 or config.admin_port > 65535) {
+					aesd_log(LOG_ERR, "invalid admin port %s", optarg);
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'l':
+				if(aesd_log_parse_level(optarg) < 0) {
+					aesd_log(LOG_ERR, "invalid log level %s", optarg);
+					usage(argv[0]);
+					return 1;
+				}
+				aesd_log_set_level(aesd_log_parse_level(optarg));
+				break;
+			case 'b': {
+				char *path = strchr(optarg, ':');
+				if(path != NULL) {
+					*path++ = '\0';
+					config.storage_path = path;
+				}
+				int kind = aesd_storage_parse_kind(optarg);
+				if(kind < 0 or (kind == AESD_STORAGE_RING and path != NULL)) {
+					aesd_log(LOG_ERR, "invalid storage %s", optarg);
+					usage(argv[0]);
+					return 1;
+				}
+				config.storage = kind;
+				break;
+			}
+			case 'y':
+				if(aesd_storage_parse_sync(optarg, &config.sync, &config.sync_interval_ms) != 0) {
+					aesd_log(LOG_ERR, "invalid sync policy %s", optarg);
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 't':
+				config.timestamps = true;
+				break;
+			case 's':
+				config.stats_interval_s = atoi(optarg);
+				if(config.stats_interval_s <= 0) {
+					aesd_log(LOG_ERR, "invalid stats interval %s", optarg);
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'i':
+				config.idle_timeout_s = atoi(optarg);
+				if(config.idle_timeout_s <= 0) {
+					aesd_log(LOG_ERR, "invalid idle timeout %s", optarg);
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'u':
+				config.upgrade = true;
+				break;
+			case 'x':
+				config.local_path = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if(optind < argc) {
+		aesd_log(LOG_ERR, "too many arguments");
+		usage(argv[0]);
+		return 1;
+	}
+	if(config.num_threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		config.num_threads = cpus > 0 ? cpus : 1;
+	}
+	server_fd = -1;
+	local_fd = -1;
+	if(config.upgrade) {
+		aesd_handoff_receive();
+	}
+	// the log store's segments take one writer at a time, let the server being replaced close them first
+	aesd_handoff_finish(config.storage == AESD_STORAGE_LOG);
+	if(aesd_storage_open(config.storage, config.storage_path, config.sync) != 0) {
+		return -1;
+	}
+	aesd_log(LOG_INFO, "keeping packets in the %s store", aesd_storage_name());
+
+	// Set up linked list to track threads
+	SLIST_INIT(&head);
+
+	if(server_fd < 0 and open_server_socket() != 0) {
+		return -1;
+	}
+	if(local_fd < 0) {
+		// co-located clients can skip the TCP stack, but the server is still useful without it
+		open_local_socket();
+	}
 
 	
-	if(is_daemon) {
+	if(config.is_daemon) {
 		pid_t pid = fork();
 
 		if(pid == -1) { // error forking
-			syslog(LOG_ERR, "error when calling fork()");
+			aesd_log(LOG_ERR, "error when calling fork()");
 			return -1;
 		} else if(pid != 0) {  // parent thread
 			exit(EXIT_SUCCESS);
 		}
 
 		if(setsid() == -1) {
-			syslog(LOG_ERR, "error calling setsid()");
+			aesd_log(LOG_ERR, "error calling setsid()");
 			return -1;
 		}
 
 		if(chdir("/") == -1) {
-			syslog(LOG_ERR, "error calling chdir");
+			aesd_log(LOG_ERR, "error calling chdir");
 			return -1;
 		}
 
@@ -294,46 +909,143 @@ int main(int argc, char **argv) {
 	}
 
 	signal(SIGINT, signal_handler);
-	signal(SIGTERM, signal_handler);	
+	signal(SIGTERM, signal_handler);
+	signal(SIGUSR1, log_level_handler);
+	signal(SIGUSR2, log_level_handler);
+	// splice() can't be told MSG_NOSIGNAL, report clients which went away as EPIPE instead
+	signal(SIGPIPE, SIG_IGN);	
 
 	// Listen for and accept a connection
 	if(listen(server_fd, NUM_CONNECTIONS) < 0) {
-		syslog(LOG_ERR, "listen failed");
+		aesd_log(LOG_ERR, "listen failed");
 		return -1;
 	}
+	if(local_fd >= 0 and listen(local_fd, NUM_CONNECTIONS) < 0) {
+		aesd_log(LOG_ERR, "listen failed on %s", config.local_path);
+		close(local_fd);
+		local_fd = -1;
+	}
 
 	struct sockaddr_storage their_addr;
-	socklen_t addr_size = sizeof their_addr;
 
-	// set up timestamp thread
-/* don't want timestamp for assignment 8
-	if(pthread_create(&timestamp_thread_handle, NULL, timestamp_handler, NULL) != 0) {
-		syslog(LOG_ERR, "thread creation failed");
-        return -1;
+	if(aesd_log_start() != 0 or aesd_follow_start() != 0) {
+		return -1;
+	}
+	// periodic jobs, all on one sleeping scheduler thread
+	if(config.timestamps and aesd_timer_add("timestamp", AESD_TIMESTAMP_INTERVAL_MS, timestamp_job, NULL) != 0) {
+		return -1;
+	}
+	if(config.sync == AESD_STORAGE_SYNC_INTERVAL and aesd_timer_add("store flush", config.sync_interval_ms, sync_job, NULL) != 0) {
+		return -1;
+	}
+	if(config.stats_interval_s > 0 and aesd_timer_add("stats", config.stats_interval_s * 1000, stats_job, NULL) != 0) {
+		return -1;
+	}
+	if(aesd_timer_start() != 0) {
+		return -1;
+	}
+	if(config.commit_window_us >= 0 and aesd_commit_start(config.commit_window_us) != 0) {
+		return -1;
+	}
+	if(config.admin_port > 0 and aesd_metrics_start(config.admin_port) != 0) {
+		return -1;
+	}
+	if(aesd_handoff_start() != 0) {
+		aesd_log(LOG_ERR, "upgrades without downtime are unavailable");
+	}
+	
+	if(config.mode == AESD_MODE_URING and uring_server_start() != 0) {
+		aesd_log(LOG_INFO, "io_uring unavailable, falling back to thread mode");
+		config.mode = AESD_MODE_THREAD;
+	}
+
+	// SIGINT and SIGTERM are only taken while this thread waits, so neither can slip in unnoticed just before it blocks
+	sigset_t block_set, old_set;
+	sigemptyset(&block_set);
+	sigaddset(&block_set, SIGINT);
+	sigaddset(&block_set, SIGTERM);
+	sigprocmask(SIG_BLOCK, &block_set, &old_set);
+
+	if(config.mode == AESD_MODE_EPOLL or config.mode == AESD_MODE_SHARD or config.mode == AESD_MODE_URING) {
+		if(config.mode != AESD_MODE_URING and epoll_server_start() != 0) {
+			return -1;
+		}
+		// reactor threads do all the work, wait here for SIGINT or SIGTERM
+		while(not server_terminate) {
+			sigsuspend(&old_set);
+		}
+		server_cleanup();
+	}
+
+	if(config.mode == AESD_MODE_POOL and pool_server_start() != 0) {
+		return -1;
 	}
-*/
 	
 	// accept connections from new clients forever in a loop until SIGINT or SIGTERM is received.
+	struct pollfd listen_pfds[AESD_MAX_LISTENERS];
+	int listen_fds[AESD_MAX_LISTENERS];
+	int num_listeners = aesd_listeners(listen_fds);
+	int next_listener = 0;
+	for(int i = 0; i < num_listeners; ++i) {
+		listen_pfds[i] = (struct pollfd){.fd = listen_fds[i], .events = POLLIN};
+	}
 	while(true) {
-		int new_socket = accept(server_fd, (struct sockaddr*)&their_addr, &addr_size);
+		// checked first too, a blocked pool_server_submit may have taken the signal
+		if(server_terminate) {
+			server_cleanup();
+		}
+		if(ppoll(listen_pfds, num_listeners, NULL, &old_set) < 0 and errno != EINTR) {
+			aesd_log(LOG_ERR, "ppoll failed");
+			return -1;
+		}
+		if(server_terminate) {
+			server_cleanup();
+		}
+		// one connection per wakeup, taking turns between listeners which are both ready
+		int ready = -1;
+		for(int i = 0; i < num_listeners and ready < 0; ++i) {
+			int index = (next_listener + i) % num_listeners;
+			if(listen_pfds[index].revents & POLLIN) {
+				ready = index;
+			}
+		}
+		if(ready < 0) {
+			continue;
+		}
+		next_listener = ready + 1;
+		socklen_t addr_size = sizeof their_addr;
+		int new_socket = accept(listen_pfds[ready].fd, (struct sockaddr*)&their_addr, &addr_size);
 		if(new_socket < 0) {
-			syslog(LOG_ERR, "accept failed");
+			// a listening socket taken over from an epoll server is still non-blocking
+			if(errno == EINTR or errno == ECONNABORTED or errno == EAGAIN or errno == EWOULDBLOCK) {
+				continue;
+			}
+			aesd_log(LOG_ERR, "accept failed");
 			return -1;
 		}
+		aesd_metrics_add(AESD_COUNTER_ACCEPTED, 1);
+
+		if(config.mode == AESD_MODE_POOL) {
+			pool_server_submit(new_socket, &their_addr);
+			continue;
+		}
+
+		reap_completed_threads();
 
 		// create a thread to handle the connection
 		struct slist_data_s* thread_entry = malloc(sizeof(struct slist_data_s));
 		if(thread_entry == NULL) {
-			syslog(LOG_ERR, "Error creating thread handle linked list.");
+			aesd_log(LOG_ERR, "Error creating thread handle linked list.");
 			return -1;
 		}
 
 		thread_entry->args.client_fd = new_socket;
-		thread_entry->args.terminate_thread = false;
+		atomic_init(&thread_entry->args.thread_complete, false);
 		thread_entry->args.their_addr = their_addr;
+		thread_entry->args.accepted_ns = aesd_metrics_now();
 
-		if(pthread_create(&(thread_entry->thread_handle), NULL, connection_handler, &(thread_entry->args)) != 0) {
-			syslog(LOG_ERR, "thread creation failed");
+		if(aesd_create_thread(&(thread_entry->thread_handle), connection_handler, &(thread_entry->args)) != 0) {
+			aesd_log(LOG_ERR, "thread creation failed");
 			
             return -1;
 		}
@@ -343,4 +1055,3 @@ int main(int argc, char **argv) {
 
 	return 0;
 }
-
@@ -0,0 +1,260 @@
+/*
+ * aesdsocket.h
+ *
+ * Definitions shared between the aesdsocket connection handling modes.
+ */
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include "aesd-storage.h"
+
+#define OUTPUT_FILENAME "/dev/aesdchar"
+
+#define AESD_RECV_LEN (4096) // minimum buffer space offered to each recv()
+
+#define NUM_CONNECTIONS (10) // listen() backlog
+
+#define AESD_LOCAL_PATH "/var/run/aesdsocket.sock" // default path of the AF_UNIX listening socket
+
+#define AESD_MAX_LISTENERS (2) // server_fd and local_fd
+
+#define AESD_TIMESTAMP_INTERVAL_MS (10000)
+
+#define AESD_TERMINATE_GRACE_MS (1000) // how long thread and pool mode connections get to finish on exit
+
+#define AESD_IDLE_CHECK_MS (1000) // how often the epoll reactors look for idle connections
+
+/**
+ * How accepted connections are serviced
+ */
+enum aesd_server_mode {
+	AESD_MODE_THREAD,	// one thread created per accepted connection
+	AESD_MODE_EPOLL,	// fixed number of edge-triggered epoll reactor threads
+	AESD_MODE_POOL,		// fixed number of worker threads fed by a bounded connection queue
+	AESD_MODE_URING,	// fixed number of io_uring reactor threads, falls back to AESD_MODE_THREAD
+	AESD_MODE_SHARD,	// epoll reactors each with their own SO_REUSEPORT listening socket, pinned to a CPU
+};
+
+/**
+ * What the pool accept loop does with a new connection when the connection queue is full
+ */
+enum aesd_overload_policy {
+	AESD_OVERLOAD_BLOCK,	// stop accepting until a worker frees a queue slot
+	AESD_OVERLOAD_RST,		// reset the new connection
+	AESD_OVERLOAD_BUSY,		// send a busy reply and close the new connection
+};
+
+struct aesd_config {
+	bool is_daemon;
+	enum aesd_server_mode mode;
+	/**
+	 * Number of reactor threads used by AESD_MODE_EPOLL, AESD_MODE_URING and AESD_MODE_SHARD or worker threads
+	 * used by AESD_MODE_POOL
+	 */
+	int num_threads;
+	/**
+	 * Number of accepted connections AESD_MODE_POOL queues while all workers are busy
+	 */
+	int queue_depth;
+	enum aesd_overload_policy overload_policy;
+	/**
+	 * Copy replies through a user space buffer instead of splicing them, see aesd-reply.h
+	 */
+	bool force_copy_reply;
+	/**
+	 * Keep connections open after replying.  Each packet or seek command gets its own reply, in order,
+	 * and clients may pipeline requests without waiting for replies.
+	 */
+	bool keep_alive;
+	/**
+	 * Group commit window in microseconds, see aesd-commit.h.  Negative writes each packet as it completes.
+	 */
+	int commit_window_us;
+	/**
+	 * Local port serving metrics, see aesd-metrics.h.  0 disables it.
+	 */
+	int admin_port;
+	/**
+	 * Where packets are kept, see aesd-storage.h.  storage_path NULL uses the store's default.
+	 */
+	enum aesd_storage_kind storage;
+	const char *storage_path;
+	/**
+	 * How the file and log stores sync writes, and for AESD_STORAGE_SYNC_INTERVAL how often
+	 */
+	enum aesd_storage_sync sync;
+	unsigned int sync_interval_ms;
+	/**
+	 * Append a timestamp line every AESD_TIMESTAMP_INTERVAL_MS
+	 */
+	bool timestamps;
+	/**
+	 * Seconds between logged metrics summaries, 0 disables them
+	 */
+	int stats_interval_s;
+	/**
+	 * Seconds a connection may go without any traffic before it is closed, 0 never closes idle connections.
+	 * Pool mode with keep_alive sets a default, see aesd-pool.c.
+	 */
+	int idle_timeout_s;
+	/**
+	 * Take the listening socket over from the server already running instead of binding it, see aesd-handoff.h
+	 */
+	bool upgrade;
+	/**
+	 * Path of the AF_UNIX listening socket, which takes the same protocol as port 9000
+	 */
+	const char *local_path;
+};
+
+struct thread_args_s {
+	int client_fd; 
+	atomic_bool thread_complete; // set by connection_handler just before it returns
+	LIST_ENTRY(thread_args_s) open_entries; // in the list aesd_shutdown_connections walks while being serviced
+	bool open; // in that list
+	struct sockaddr_storage their_addr;
+	uint64_t accepted_ns; // aesd_metrics_now() when the connection was accepted
+};
+
+extern struct aesd_config config;
+
+/**
+ * Serializes access to the store, see aesd-storage.h.  Writers hold it exclusively only while committing a complete
+ * packet; read-back replies are captured under the shared lock so they run concurrently with each other
+ * and always see a consistent set of packets.
+ */
+extern pthread_rwlock_t file_rwlock;
+
+extern int server_fd; // file descriptor for the server socket, IPv6 dual-stack where available
+extern int local_fd; // AF_UNIX listening socket on config.local_path, -1 if not open
+
+extern volatile sig_atomic_t server_terminate; // set once SIGINT or SIGTERM is caught
+extern volatile sig_atomic_t server_draining; // set when server_fd has been handed to a replacement server
+
+void *get_in_addr(struct sockaddr *sa);
+
+/**
+ * Write the address of the peer @param addr to @param buf of @param len bytes, at least INET6_ADDRSTRLEN.
+ * IPv4 clients of the dual-stack socket are shown as plain IPv4 addresses and AF_UNIX clients as "local".
+ * @return 0 on success, -1 if the address can't be formatted
+ */
+int aesd_addr_string(const struct sockaddr_storage *addr, char *buf, size_t len);
+
+/**
+ * Fill @param fds with the listening sockets which are open, server_fd first
+ * @return how many there are
+ */
+int aesd_listeners(int fds[AESD_MAX_LISTENERS]);
+
+/**
+ * Create a thread with SIGINT and SIGTERM blocked so the signal handler always runs on the main thread.
+ * @return 0 on success, otherwise the pthread_create error number
+ */
+int aesd_create_thread(pthread_t *thread, void *(*start_routine)(void *), void *arg);
+
+struct aesd_framer;
+struct aesd_reply;
+struct aesd_commit_req;
+
+#define AESD_REQUEST_COMMITTING (2) // aesd_handle_requests queued a packet with the group commit stage
+#define AESD_REQUEST_FOLLOW (3) // aesd_handle_requests found a follow command, see aesd-follow.h
+
+/**
+ * Write each complete packet buffered in @param framer to @param store with one write per packet,
+ * stopping at a seek command, which is applied to @param store instead, or a follow command.  With config.keep_alive only
+ * one request is handled per call.  When @param eof is set the client has closed and any unterminated
+ * data is written as well.  Takes file_rwlock as needed.
+ * While group commit is running packets are handed to it through @param commit instead.  If @param commit
+ * has a completion callback the packet is only queued and AESD_REQUEST_COMMITTING returned; call again,
+ * with the framer untouched, once the callback has run.  Otherwise this waits for the batch to commit.
+ * @return 1 if requests were handled and the read-back reply has been captured in @param reply (the
+ * received data ends with a complete packet or a seek command), 0 if more data is needed, -1 on error,
+ * AESD_REQUEST_FOLLOW if the connection should be handed to aesd_follow_add, any later data is ignored
+ */
+int aesd_handle_requests(struct aesd_framer *framer, struct aesd_storage_handle *store, bool eof, struct aesd_reply *reply, struct aesd_commit_req *commit);
+
+/**
+ * Service one accepted connection described by @param args (a struct thread_args_s*) until it closes.
+ */
+void *connection_handler(void* args);
+
+/**
+ * shutdown() the client socket of every connection connection_handler is servicing with @param how, and of
+ * any it starts servicing from now on.  SHUT_RD lets each handler finish the request it is on and then see
+ * the client close, SHUT_RDWR also fails any reply still being sent.
+ */
+void aesd_shutdown_connections(int how);
+
+/**
+ * Start config.num_threads epoll reactor threads servicing the listening sockets, which must already be
+ * listening.  In AESD_MODE_SHARD only the first reactor uses server_fd, the others each open another listening socket
+ * on the same address with SO_REUSEPORT so the kernel spreads connections across them, and every reactor
+ * thread is pinned to its own CPU.  local_fd is shared by every reactor.
+ * @return 0 on success, -1 on failure
+ */
+int epoll_server_start(void);
+
+/**
+ * Stop the reactors accepting new connections, leaving the ones they have running.  Shard listening
+ * sockets other than server_fd and local_fd are shut down.
+ */
+void epoll_server_stop_accepting(void);
+
+/**
+ * Wake and join the reactor threads, closing any connections they still own.
+ */
+void epoll_server_stop(void);
+
+/**
+ * Write per reactor connection counts to @param out in the Prometheus text format, see aesd-metrics.h
+ */
+void epoll_server_write_metrics(FILE *out);
+
+/**
+ * Start config.num_threads io_uring reactor threads servicing the listening sockets, which must already be listening.
+ * @return 0 on success, -1 if io_uring is unavailable or couldn't be set up
+ */
+int uring_server_start(void);
+
+/**
+ * Cancel the io_uring reactors' accepts on the listening sockets, leaving the connections they have running.
+ */
+void uring_server_stop_accepting(void);
+
+/**
+ * Wake and join the io_uring reactor threads once their connections have drained.
+ */
+void uring_server_stop(void);
+
+/**
+ * Start config.num_threads pool workers and allocate the config.queue_depth connection queue.
+ * @return 0 on success, -1 on failure
+ */
+int pool_server_start(void);
+
+/**
+ * Queue the accepted @param client_fd for a pool worker, applying config.overload_policy if the queue is full.
+ * Ownership of @param client_fd always passes to the pool.
+ */
+void pool_server_submit(int client_fd, const struct sockaddr_storage *their_addr);
+
+/**
+ * @return the number of accepted connections waiting for a worker
+ */
+int pool_server_queued(void);
+
+/**
+ * Let the workers finish their current connections, join them and close any still queued connections.
+ */
+void pool_server_stop(void);
+
+#endif /* AESDSOCKET_H */
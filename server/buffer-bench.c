@@ -0,0 +1,144 @@
+/*
+ * buffer-bench.c
+ *
+ * Time aesd_circular_buffer_find_entry_offset_for_fpos, the lookup behind every read of the aesdchar driver
+ * and the ring and log stores, against the linear walk from out_offs it replaced.  For each capacity the
+ * buffer is filled with @p writes_per_entry and a half times as many packets of 1 to @p max_size bytes,
+ * so it has wrapped and evicted, and looked up at @p lookups random offsets.  The lookups the linear walk is timed
+ * on, all of them up to 1000 entries, are first checked against it, so the run also verifies the running
+ * offsets across wraparound and eviction.
+ *
+ * usage: buffer-bench [-n lookups] [-s max_size] [-w writes_per_entry]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <iso646.h>
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * The lookup as it was before the buffer kept running offsets
+ */
+static struct aesd_buffer_entry *linear_find(struct aesd_circular_buffer *buffer, size_t char_offset,
+		size_t *entry_offset_byte_rtn)
+{
+	for(uint32_t i = 0; i < aesd_circular_buffer_count(buffer); ++i) {
+		struct aesd_buffer_entry *entry = aesd_circular_buffer_entry_at(buffer, i);
+		if(entry->size > char_offset) {
+			*entry_offset_byte_rtn = char_offset;
+			return entry;
+		}
+		char_offset -= entry->size;
+	}
+	return NULL;
+}
+
+static void run_bench(uint32_t capacity, int lookups, size_t max_size, int writes_per_entry)
+{
+	static const char data[4096];
+	struct aesd_circular_buffer buffer;
+	struct aesd_buffer_entry *entries = malloc(capacity * sizeof *entries);
+	size_t *offsets = malloc(lookups * sizeof *offsets);
+	if(entries == NULL or offsets == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	aesd_circular_buffer_init_entries(&buffer, entries, capacity);
+
+	size_t writes = (size_t)capacity * writes_per_entry + capacity / 2;
+	for(size_t i = 0; i < writes; ++i) {
+		struct aesd_buffer_entry entry = {.buffptr = data, .size = 1 + rand() % max_size};
+		aesd_circular_buffer_add_entry(&buffer, &entry);
+	}
+
+	// a tenth of the lookups past the end, which must miss
+	size_t size = aesd_circular_buffer_size(&buffer);
+	for(int i = 0; i < lookups; ++i) {
+		offsets[i] = i % 10 == 0 ? size + rand() % 16 : (size_t)rand() % size;
+	}
+	// the linear walk gets slow, check and time fewer of them on large buffers
+	int linear_lookups = capacity > 1000 ? lookups / (int)(capacity / 1000) : lookups;
+	if(linear_lookups == 0) {
+		linear_lookups = 1;
+	}
+	for(int i = 0; i < linear_lookups; ++i) {
+		size_t indexed_offset = 0;
+		size_t linear_offset = 0;
+		struct aesd_buffer_entry *indexed = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offsets[i], &indexed_offset);
+		struct aesd_buffer_entry *linear = linear_find(&buffer, offsets[i], &linear_offset);
+		if(indexed != linear or indexed_offset != linear_offset) {
+			fprintf(stderr, "capacity %u: lookup of %zu differs from the linear walk\n", capacity, offsets[i]);
+			exit(1);
+		}
+	}
+
+	size_t found = 0;
+	double start = now_sec();
+	for(int i = 0; i < lookups; ++i) {
+		size_t offset;
+		found += aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offsets[i], &offset) != NULL;
+	}
+	double indexed_sec = now_sec() - start;
+
+	start = now_sec();
+	for(int i = 0; i < linear_lookups; ++i) {
+		size_t offset;
+		found += linear_find(&buffer, offsets[i], &offset) != NULL;
+	}
+	double linear_sec = now_sec() - start;
+
+	printf("%10u %14zu %14.0f %14.0f %10.1fx\n", capacity, size, lookups / indexed_sec, linear_lookups / linear_sec,
+			(lookups / indexed_sec) / (linear_lookups / linear_sec));
+	if(found == 0) {
+		fprintf(stderr, "no lookup hit\n");
+	}
+	free(offsets);
+	free(entries);
+}
+
+int main(int argc, char **argv)
+{
+	int lookups = 200000;
+	size_t max_size = 256;
+	int writes_per_entry = 2;
+	int opt;
+
+	while((opt = getopt(argc, argv, "n:s:w:")) != -1) {
+		switch(opt) {
+			case 'n':
+				lookups = atoi(optarg);
+				break;
+			case 's':
+				max_size = strtoul(optarg, NULL, 0);
+				break;
+			case 'w':
+				writes_per_entry = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-n lookups] [-s max_size] [-w writes_per_entry]\n", argv[0]);
+				return 1;
+		}
+	}
+	if(lookups < 100 or max_size == 0 or max_size > 4096 or writes_per_entry < 0) {
+		fprintf(stderr, "lookups must be at least 100, max_size 1 to 4096 and writes_per_entry not negative\n");
+		return 1;
+	}
+
+	srand(1);
+	printf("%10s %14s %14s %14s %11s\n", "capacity", "bytes held", "indexed/s", "linear/s", "speedup");
+	const uint32_t capacities[] = {AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, 100, 1000, 10000, 100000, 1000000};
+	for(size_t i = 0; i < sizeof capacities / sizeof capacities[0]; ++i) {
+		run_bench(capacities[i], lookups, max_size, writes_per_entry);
+	}
+	return 0;
+}
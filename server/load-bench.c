@@ -0,0 +1,591 @@
+/*
+ * load-bench.c
+ *
+ * Load generator for aesdsocket.  Worker threads each drive their share of the connections, sending one
+ * request per connection (a packet, or a seek command for the -S percentage of requests) and reading the
+ * reply until the server closes the connection, then report throughput and latency percentiles.
+ *
+ * usage: load-bench [-h host] [-p port] [-u local_path] [-c connections] [-t seconds] [-s size|min-max]
+ *                   [-S seek_percent] [-r requests_per_sec] [-k packets_per_reply [-P depth]]
+ * Without -r each connection sends its next request as soon as the previous reply is complete (closed
+ * loop), which measures the server's saturation throughput.  With -r requests are started on a fixed
+ * schedule spread across the connections (open loop), and latency is measured from the time each
+ * request was due rather than when it was sent, so a server falling behind isn't hidden by the
+ * generator slowing down with it.  -c then bounds the number of requests outstanding at once.
+ * Without -k replies are only complete once the server closes, so run the server without -k.  -u connects
+ * to the server's AF_UNIX socket instead of a TCP port.
+ *
+ * With -k, for a server run with -k, each connection stays open and carries its requests one after the
+ * other, or up to -P of them pipelined.  Every reply is the whole store, so a reply is complete once it
+ * has brought packets_per_reply newlines.  That only holds for a store keeping a fixed number of packets,
+ * such as the chardev and ring stores (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, 10), which the bench fills
+ * first, and while every packet written to it, by any client, ends in its only newline.
+ */
+
+#define _GNU_SOURCE // ppoll
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <iso646.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+
+#define SEEK_REQUEST "AESDCHAR_IOCSEEKTO:0,0\n" // always valid once the first packet is written
+#define RECV_LEN (64 * 1024)
+#define REPLY_TIMEOUT_NS (5000000000ULL) // longest a keep-alive connection waits for a reply to progress
+
+struct bench_config {
+	struct addrinfo *server;
+	int connections;
+	double seconds;
+	size_t min_size;
+	size_t max_size;
+	int seek_percent;
+	double rate; // requests per second across all connections, 0 for closed loop
+	int packets_per_reply; // newlines ending each reply on a keep-alive connection, 0 connects per request
+	int depth; // requests outstanding at once on a keep-alive connection
+};
+
+struct bench_worker {
+	pthread_t thread_handle;
+	int index;
+	unsigned int seed;
+
+	uint64_t *latencies; // nanoseconds
+	size_t count;
+	size_t cap;
+	unsigned long errors;
+	unsigned long seeks;
+	size_t bytes_sent;
+	size_t bytes_received;
+};
+
+static struct bench_config bench = {
+	.connections = 8,
+	.seconds = 5,
+	.min_size = 64,
+	.max_size = 64,
+	.seek_percent = 0,
+	.rate = 0,
+	.packets_per_reply = 0,
+	.depth = 1,
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline_ns)
+{
+	struct timespec ts = {.tv_sec = deadline_ns / 1000000000, .tv_nsec = deadline_ns % 1000000000};
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+	}
+}
+
+static int record_latency(struct bench_worker *worker, uint64_t ns)
+{
+	if(worker->count == worker->cap) {
+		size_t new_cap = worker->cap ? worker->cap * 2 : 4096;
+		uint64_t *new_latencies = realloc(worker->latencies, new_cap * sizeof(uint64_t));
+		if(new_latencies == NULL) {
+			return -1;
+		}
+		worker->latencies = new_latencies;
+		worker->cap = new_cap;
+	}
+	worker->latencies[worker->count++] = ns;
+	return 0;
+}
+
+static int send_all(int fd, const char *data, size_t len)
+{
+	while(len > 0) {
+		ssize_t numbytes = send(fd, data, len, MSG_NOSIGNAL);
+		if(numbytes < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		data += numbytes;
+		len -= numbytes;
+	}
+	return 0;
+}
+
+/**
+ * @return a socket connected to the server, or -1 on error
+ */
+static int connect_server(void)
+{
+	int fd = socket(bench.server->ai_family, bench.server->ai_socktype, bench.server->ai_protocol);
+	if(fd < 0) {
+		return -1;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+	if(connect(fd, bench.server->ai_addr, bench.server->ai_addrlen) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * Connect, send @param len bytes of @param request and read the reply until the server closes
+ * @return 0 on success, -1 on error
+ */
+static int run_request(struct bench_worker *worker, const char *request, size_t len, char *rx_buf)
+{
+	int fd = connect_server();
+	if(fd < 0) {
+		return -1;
+	}
+	if(send_all(fd, request, len) != 0) {
+		close(fd);
+		return -1;
+	}
+	worker->bytes_sent += len;
+
+	ssize_t numbytes;
+	while((numbytes = recv(fd, rx_buf, RECV_LEN, 0)) != 0) {
+		if(numbytes < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			close(fd);
+			return -1;
+		}
+		worker->bytes_received += numbytes;
+	}
+	close(fd);
+	return 0;
+}
+
+/**
+ * Pick the next request, a seek command for the -S percentage of them after the @param first, otherwise
+ * @param packet newline terminated at a random size.  Call restore_packet once it has been sent.
+ * @return its length, with the request itself in @param request
+ */
+static size_t next_request(struct bench_worker *worker, char *packet, bool first, const char **request)
+{
+	size_t len;
+
+	// the first request is always a packet so there's something to seek to
+	if(not first and (int)(rand_r(&worker->seed) % 100) < bench.seek_percent) {
+		*request = SEEK_REQUEST;
+		worker->seeks++;
+		return strlen(SEEK_REQUEST);
+	}
+	len = bench.min_size;
+	if(bench.max_size > bench.min_size) {
+		len += rand_r(&worker->seed) % (bench.max_size - bench.min_size + 1);
+	}
+	packet[len - 1] = '\n';
+	*request = packet;
+	return len;
+}
+
+/**
+ * Put back the letter next_request replaced with a newline in @param packet, if @param request was it
+ */
+static void restore_packet(struct bench_worker *worker, char *packet, const char *request, size_t len)
+{
+	if(request == packet) {
+		packet[len - 1] = 'a' + (worker->index + len - 1) % 26;
+	}
+}
+
+/**
+ * -k: send requests due every @param interval_ns from @param due_ns, or back to back if 0, until
+ * @param end_ns over one connection with up to bench.depth outstanding, counting the newlines of the replies
+ * to find where each ends.  The connection is reopened after an error, which fails the requests outstanding.
+ */
+static void run_keep_alive(struct bench_worker *worker, char *packet, char *rx_buf, uint64_t interval_ns,
+		uint64_t due_ns, uint64_t end_ns)
+{
+	uint64_t *sent_due = malloc(bench.depth * sizeof(uint64_t)); // when each outstanding request was due, oldest first
+	int oldest = 0;
+	int outstanding = 0;
+	int newlines = 0; // counted so far in the oldest request's reply
+	uint64_t progress_ns = 0; // when the replies last made progress
+	bool first = true;
+	int fd = -1;
+
+	if(sent_due == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	while(true) {
+		uint64_t now = now_ns();
+		if(interval_ns == 0) {
+			due_ns = now;
+		}
+		bool sending = due_ns < end_ns;
+		if(not sending and outstanding == 0) {
+			break;
+		}
+
+		if(sending and outstanding < bench.depth and due_ns <= now) {
+			if(fd < 0) {
+				fd = connect_server();
+			}
+			const char *request;
+			size_t len = next_request(worker, packet, first, &request);
+			int result = fd < 0 ? -1 : send_all(fd, request, len);
+			restore_packet(worker, packet, request, len);
+			if(result != 0) {
+				worker->errors += outstanding + 1;
+				outstanding = 0;
+				newlines = 0;
+				if(fd >= 0) {
+					close(fd);
+					fd = -1;
+				}
+			} else {
+				worker->bytes_sent += len;
+				first = false;
+				if(outstanding == 0) {
+					progress_ns = now;
+				}
+				sent_due[(oldest + outstanding++) % bench.depth] = due_ns;
+			}
+			due_ns += interval_ns;
+			continue;
+		}
+		if(outstanding == 0) {
+			sleep_until(due_ns);
+			continue;
+		}
+
+		// wait for the replies to progress, or until the next request is due
+		uint64_t wait_ns = progress_ns + REPLY_TIMEOUT_NS > now ? progress_ns + REPLY_TIMEOUT_NS - now : 0;
+		if(sending and outstanding < bench.depth and due_ns - now < wait_ns) {
+			wait_ns = due_ns - now;
+		}
+		struct pollfd pfd = {.fd = fd, .events = POLLIN};
+		struct timespec timeout = {.tv_sec = wait_ns / 1000000000, .tv_nsec = wait_ns % 1000000000};
+		int ready = ppoll(&pfd, 1, &timeout, NULL);
+		if(ready == 0 and now_ns() < progress_ns + REPLY_TIMEOUT_NS) {
+			continue;
+		}
+		ssize_t numbytes = ready > 0 ? recv(fd, rx_buf, RECV_LEN, 0) : -1;
+		if(numbytes < 0 and errno == EINTR) {
+			continue;
+		}
+		if(numbytes <= 0) {
+			if(ready == 0) {
+				fprintf(stderr, "no reply for %.0f s, does the store hold -k packets?\n", REPLY_TIMEOUT_NS / 1e9);
+			}
+			worker->errors += outstanding;
+			outstanding = 0;
+			newlines = 0;
+			close(fd);
+			fd = -1;
+			continue;
+		}
+		worker->bytes_received += numbytes;
+		now = now_ns();
+		progress_ns = now;
+		for(char *newline = rx_buf; outstanding > 0 and (newline = memchr(newline, '\n', rx_buf + numbytes - newline)) != NULL; ++newline) {
+			if(++newlines < bench.packets_per_reply) {
+				continue;
+			}
+			newlines = 0;
+			if(record_latency(worker, now - sent_due[oldest]) != 0) {
+				fprintf(stderr, "out of memory\n");
+				exit(1);
+			}
+			oldest = (oldest + 1) % bench.depth;
+			outstanding--;
+		}
+	}
+	if(fd >= 0) {
+		close(fd);
+	}
+	free(sent_due);
+}
+
+/**
+ * Fill the store with bench.packets_per_reply packets, so every reply holds that many from the start
+ * @return 0 on success, -1 on error
+ */
+static int fill_store(void)
+{
+	int fd = connect_server();
+	char *packet = malloc(bench.min_size);
+	char rx_buf[4096];
+	int result = -1;
+
+	if(fd >= 0 and packet != NULL) {
+		memset(packet, 'a', bench.min_size - 1);
+		packet[bench.min_size - 1] = '\n';
+		result = 0;
+		for(int i = 0; i < bench.packets_per_reply and result == 0; ++i) {
+			result = send_all(fd, packet, bench.min_size);
+		}
+		// the server closes once it has answered every packet
+		shutdown(fd, SHUT_WR);
+		ssize_t numbytes;
+		while(result == 0 and (numbytes = recv(fd, rx_buf, sizeof rx_buf, 0)) != 0) {
+			if(numbytes < 0 and errno != EINTR) {
+				result = -1;
+			}
+		}
+	}
+	if(fd >= 0) {
+		close(fd);
+	}
+	free(packet);
+	return result;
+}
+
+static void *worker_handler(void *args)
+{
+	struct bench_worker *worker = args;
+	char *packet = malloc(bench.max_size);
+	char *rx_buf = malloc(RECV_LEN);
+	if(packet == NULL or rx_buf == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for(size_t i = 0; i < bench.max_size; ++i) {
+		packet[i] = 'a' + (worker->index + i) % 26;
+	}
+
+	// open loop: this connection's requests are due every interval, offset so the connections interleave
+	uint64_t interval_ns = bench.rate > 0 ? (uint64_t)(bench.connections / bench.rate * 1e9) : 0;
+	uint64_t start_ns = now_ns();
+	uint64_t end_ns = start_ns + (uint64_t)(bench.seconds * 1e9);
+	uint64_t due_ns = start_ns + interval_ns * worker->index / bench.connections;
+	bool first = true;
+
+	if(bench.packets_per_reply > 0) {
+		run_keep_alive(worker, packet, rx_buf, interval_ns, due_ns, end_ns);
+		free(packet);
+		free(rx_buf);
+		return NULL;
+	}
+	while(true) {
+		if(interval_ns > 0) {
+			if(due_ns >= end_ns) {
+				break;
+			}
+			sleep_until(due_ns);
+		} else {
+			due_ns = now_ns();
+			if(due_ns >= end_ns) {
+				break;
+			}
+		}
+
+		const char *request;
+		size_t len = next_request(worker, packet, first, &request);
+		first = false;
+
+		if(run_request(worker, request, len, rx_buf) != 0) {
+			worker->errors++;
+		} else if(record_latency(worker, now_ns() - due_ns) != 0) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		restore_packet(worker, packet, request, len);
+		due_ns += interval_ns;
+	}
+
+	free(packet);
+	free(rx_buf);
+	return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t *sorted, size_t count, double p)
+{
+	if(count == 0) {
+		return 0;
+	}
+	size_t index = (size_t)(p * count);
+	if(index >= count) {
+		index = count - 1;
+	}
+	return sorted[index] / 1e3;
+}
+
+static int parse_size(const char *arg)
+{
+	char *end;
+	bench.min_size = strtoul(arg, &end, 0);
+	bench.max_size = bench.min_size;
+	if(*end == '-') {
+		bench.max_size = strtoul(end + 1, &end, 0);
+	}
+	return (*end == '\0' and bench.min_size > 0 and bench.max_size >= bench.min_size) ? 0 : -1;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-h host] [-p port] [-u local_path] [-c connections] [-t seconds] [-s size|min-max] [-S seek_percent] [-r requests_per_sec] [-k packets_per_reply [-P depth]]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	const char *host = "127.0.0.1";
+	const char *port = "9000";
+	const char *local_path = NULL;
+	int opt;
+
+	while((opt = getopt(argc, argv, "h:p:u:c:t:s:S:r:k:P:")) != -1) {
+		switch(opt) {
+			case 'h':
+				host = optarg;
+				break;
+			case 'p':
+				port = optarg;
+				break;
+			case 'u':
+				local_path = optarg;
+				break;
+			case 'c':
+				bench.connections = atoi(optarg);
+				break;
+			case 't':
+				bench.seconds = atof(optarg);
+				break;
+			case 's':
+				if(parse_size(optarg) != 0) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'S':
+				bench.seek_percent = atoi(optarg);
+				break;
+			case 'r':
+				bench.rate = atof(optarg);
+				break;
+			case 'k':
+				bench.packets_per_reply = atoi(optarg);
+				break;
+			case 'P':
+				bench.depth = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if(bench.connections <= 0 or bench.seconds <= 0 or bench.rate < 0 or bench.seek_percent < 0 or bench.seek_percent > 100 or
+			bench.packets_per_reply < 0 or bench.depth <= 0 or (bench.depth > 1 and bench.packets_per_reply == 0)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	struct addrinfo hints;
+	struct sockaddr_un local_addr = {.sun_family = AF_UNIX};
+	struct addrinfo local_server = {
+		.ai_family = AF_UNIX,
+		.ai_socktype = SOCK_STREAM,
+		.ai_addr = (struct sockaddr*)&local_addr,
+		.ai_addrlen = sizeof local_addr,
+	};
+	if(local_path != NULL) {
+		if(strlen(local_path) >= sizeof local_addr.sun_path) {
+			fprintf(stderr, "%s: path too long\n", local_path);
+			return 1;
+		}
+		strcpy(local_addr.sun_path, local_path);
+		bench.server = &local_server;
+	} else {
+		memset(&hints, 0, sizeof hints);
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		int result = getaddrinfo(host, port, &hints, &bench.server);
+		if(result != 0) {
+			fprintf(stderr, "%s: %s\n", host, gai_strerror(result));
+			return 1;
+		}
+	}
+
+	if(bench.packets_per_reply > 0 and fill_store() != 0) {
+		fprintf(stderr, "error filling the store: %s\n", strerror(errno));
+		return 1;
+	}
+
+	struct bench_worker *workers = calloc(bench.connections, sizeof(struct bench_worker));
+	if(workers == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	uint64_t start_ns = now_ns();
+	for(int i = 0; i < bench.connections; ++i) {
+		workers[i].index = i;
+		workers[i].seed = start_ns + i;
+		if(pthread_create(&workers[i].thread_handle, NULL, worker_handler, &workers[i]) != 0) {
+			fprintf(stderr, "thread creation failed\n");
+			return 1;
+		}
+	}
+
+	size_t total = 0;
+	unsigned long errors = 0;
+	unsigned long seeks = 0;
+	size_t bytes = 0;
+	for(int i = 0; i < bench.connections; ++i) {
+		pthread_join(workers[i].thread_handle, NULL);
+		total += workers[i].count;
+		errors += workers[i].errors;
+		seeks += workers[i].seeks;
+		bytes += workers[i].bytes_sent + workers[i].bytes_received;
+	}
+	double elapsed = (now_ns() - start_ns) / 1e9;
+
+	uint64_t *latencies = malloc((total ? total : 1) * sizeof(uint64_t));
+	if(latencies == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	size_t offset = 0;
+	for(int i = 0; i < bench.connections; ++i) {
+		memcpy(latencies + offset, workers[i].latencies, workers[i].count * sizeof(uint64_t));
+		offset += workers[i].count;
+		free(workers[i].latencies);
+	}
+	qsort(latencies, total, sizeof(uint64_t), compare_u64);
+
+	printf("%s loop, %i connections, %.1f s, packets %zu-%zu bytes, %i%% seeks\n",
+			bench.rate > 0 ? "open" : "closed", bench.connections, elapsed, bench.min_size, bench.max_size, bench.seek_percent);
+	if(bench.packets_per_reply > 0) {
+		printf("keep-alive, %i requests pipelined, %i packets per reply\n", bench.depth, bench.packets_per_reply);
+	}
+	printf("requests %zu (%lu seeks), errors %lu\n", total, seeks, errors);
+	printf("throughput %.0f req/s, %.1f MiB/s\n", total / elapsed, bytes / elapsed / (1024 * 1024));
+	printf("latency us p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+			percentile_us(latencies, total, 0.5), percentile_us(latencies, total, 0.9),
+			percentile_us(latencies, total, 0.99), percentile_us(latencies, total, 0.999),
+			total ? latencies[total - 1] / 1e3 : 0);
+
+	free(latencies);
+	free(workers);
+	if(local_path == NULL) {
+		freeaddrinfo(bench.server);
+	}
+	return errors > 0 ? 2 : 0;
+}
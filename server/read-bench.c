@@ -0,0 +1,262 @@
+/*
+ * read-bench.c
+ *
+ * Measure how reads of the aesdchar device scale with the threads reading it.  The device is first sent
+ * @p packets newline terminated packets of @p packet_size bytes, then for 1, 2, 4... up to @p threads
+ * threads each thread opens the device and reads it in @p read_size byte reads for @p seconds, seeking
+ * back to the start at the end of the data.  Reports reads and bytes per second, and the speedup over one
+ * thread, which stays near 1 while readers serialize on the device and approaches the thread count, up to
+ * the cores available, when they don't.  With -W a thread keeps writing packets throughout, so the reads
+ * run against a changing buffer.  Every read is checked to be a piece of one of the packets written.
+ *
+ * usage: read-bench [-c chardev_path] [-t threads] [-d seconds] [-s packet_size] [-n packets] [-r read_size] [-W]
+ * The device, by default OUTPUT_FILENAME, needs the aesdchar driver loaded.  Any other path is read the
+ * same way, which only measures the bench itself.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <iso646.h>
+#include <sys/stat.h>
+#include "aesdsocket.h"
+
+struct reader {
+	pthread_t thread_handle;
+	unsigned long reads;
+	unsigned long long bytes;
+};
+
+static struct {
+	const char *path;
+	size_t packet_size;
+	size_t read_size;
+	volatile bool stop;
+} bench;
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Packets are one letter, which differs from one packet to the next, repeated up to a newline
+ */
+static void fill_packet(char *packet, unsigned long index)
+{
+	memset(packet, 'a' + index % 26, bench.packet_size - 1);
+	packet[bench.packet_size - 1] = '\n';
+}
+
+/**
+ * @return true if the @param len bytes at @param buf can be a piece of the packets written, one letter
+ * up to each newline
+ */
+static bool check_read(const char *buf, size_t len)
+{
+	for(size_t i = 0; i < len; ++i) {
+		if(buf[i] == '\n') {
+			continue;
+		}
+		if(buf[i] < 'a' or buf[i] > 'z' or (i > 0 and buf[i - 1] != '\n' and buf[i] != buf[i - 1])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static int write_packets(int fd, unsigned long first, unsigned long count)
+{
+	char *packet = malloc(bench.packet_size);
+	if(packet == NULL) {
+		return -1;
+	}
+	for(unsigned long i = first; i < first + count; ++i) {
+		fill_packet(packet, i);
+		if(write(fd, packet, bench.packet_size) != (ssize_t)bench.packet_size) {
+			free(packet);
+			return -1;
+		}
+	}
+	free(packet);
+	return 0;
+}
+
+static void *reader_handler(void *args)
+{
+	struct reader *reader = args;
+	char *buf = malloc(bench.read_size);
+	int fd = open(bench.path, O_RDONLY);
+	if(buf == NULL or fd < 0) {
+		perror("reader");
+		exit(1);
+	}
+	while(not bench.stop) {
+		ssize_t numbytes = read(fd, buf, bench.read_size);
+		if(numbytes < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			perror("read");
+			exit(1);
+		}
+		if(numbytes == 0) {
+			lseek(fd, 0, SEEK_SET);
+			continue;
+		}
+		if(not check_read(buf, numbytes)) {
+			fprintf(stderr, "read %zd bytes which aren't a piece of the packets written\n", numbytes);
+			exit(1);
+		}
+		reader->reads++;
+		reader->bytes += numbytes;
+	}
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+static void *writer_handler(void *args)
+{
+	int fd = *(int*)args;
+	for(unsigned long i = 0; not bench.stop; i += 16) {
+		if(write_packets(fd, i, 16) != 0) {
+			perror("write");
+			exit(1);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Read with @param threads threads for @param seconds
+ * @return reads per second
+ */
+static double run_bench(int threads, double seconds, bool writing, int write_fd, double single)
+{
+	struct reader *readers = calloc(threads, sizeof *readers);
+	pthread_t writer_handle;
+	if(readers == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	bench.stop = false;
+	if(writing and pthread_create(&writer_handle, NULL, writer_handler, &write_fd) != 0) {
+		fprintf(stderr, "thread creation failed\n");
+		exit(1);
+	}
+	double start = now_sec();
+	for(int i = 0; i < threads; ++i) {
+		if(pthread_create(&readers[i].thread_handle, NULL, reader_handler, &readers[i]) != 0) {
+			fprintf(stderr, "thread creation failed\n");
+			exit(1);
+		}
+	}
+	struct timespec duration = {.tv_sec = (time_t)seconds, .tv_nsec = (long)((seconds - (time_t)seconds) * 1e9)};
+	nanosleep(&duration, NULL);
+	bench.stop = true;
+	unsigned long reads = 0;
+	unsigned long long bytes = 0;
+	for(int i = 0; i < threads; ++i) {
+		pthread_join(readers[i].thread_handle, NULL);
+		reads += readers[i].reads;
+		bytes += readers[i].bytes;
+	}
+	double elapsed = now_sec() - start;
+	if(writing) {
+		pthread_join(writer_handle, NULL);
+	}
+	double rate = reads / elapsed;
+	printf("%8d %14.0f %14.1f %10.2fx\n", threads, rate, bytes / elapsed / (1024 * 1024), single > 0 ? rate / single : 1.0);
+	free(readers);
+	return rate;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-c chardev_path] [-t threads] [-d seconds] [-s packet_size] [-n packets] [-r read_size] [-W]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	double seconds = 2;
+	unsigned long packets = 10;
+	bool writing = false;
+	int opt;
+
+	bench.path = OUTPUT_FILENAME;
+	bench.packet_size = 256;
+	bench.read_size = 4096;
+	while((opt = getopt(argc, argv, "c:t:d:s:n:r:W")) != -1) {
+		switch(opt) {
+			case 'c':
+				bench.path = optarg;
+				break;
+			case 't':
+				threads = atoi(optarg);
+				break;
+			case 'd':
+				seconds = atof(optarg);
+				break;
+			case 's':
+				bench.packet_size = strtoul(optarg, NULL, 0);
+				break;
+			case 'n':
+				packets = strtoul(optarg, NULL, 0);
+				break;
+			case 'r':
+				bench.read_size = strtoul(optarg, NULL, 0);
+				break;
+			case 'W':
+				writing = true;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if(threads <= 0 or seconds <= 0 or bench.packet_size < 2 or bench.read_size == 0 or packets == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	struct stat st;
+	if(stat(bench.path, &st) != 0) {
+		fprintf(stderr, "%s: %s\n", bench.path, strerror(errno));
+		return 1;
+	}
+	if(not S_ISCHR(st.st_mode)) {
+		printf("%s is not a character device, measuring reads of it anyway\n", bench.path);
+	}
+	int write_fd = open(bench.path, O_WRONLY | O_APPEND);
+	if(write_fd < 0 or write_packets(write_fd, 0, packets) != 0) {
+		fprintf(stderr, "error writing %s: %s\n", bench.path, strerror(errno));
+		return 1;
+	}
+
+	printf("%8s %14s %14s %11s\n", "threads", "reads/s", "MiB/s", "speedup");
+	double single = 0;
+	for(int count = 1; ; count *= 2) {
+		if(count > threads) {
+			count = threads;
+		}
+		double rate = run_bench(count, seconds, writing, write_fd, single);
+		if(single == 0) {
+			single = rate;
+		}
+		if(count == threads) {
+			break;
+		}
+	}
+	close(write_fd);
+	return 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * reply-bench.c
+ *
+ * Compare the original 100 byte read()/send() reply loop with the aesd-reply.h copy and splice paths.
+ * Each method sends the whole source file to a socket @p replies times while a thread drains the other
+ * end, then reports syscalls per reply, replies per second and throughput.
+ *
+ * usage: reply-bench [-s reply_size] [-n replies] [-f source_file]
+ * Without -f a temporary file of reply_size bytes is used as the source, pass -f /dev/aesdchar to
+ * measure against the driver (sources which refuse splice() fall back to the copy path, so the
+ * splice row then matches the copy row).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <iso646.h>
+#include <sys/socket.h>
+#include "aesd-reply.h"
+
+#define LEGACY_BUF_LEN (100)
+
+enum bench_method {
+	BENCH_LEGACY,
+	BENCH_COPY,
+	BENCH_SPLICE,
+};
+
+static const char *method_names[] = {"legacy-100B", "copy", "splice"};
+
+static void *drain_handler(void *args)
+{
+	int fd = *(int*)args;
+	char buf[64 * 1024];
+	while(read(fd, buf, sizeof buf) > 0) {
+	}
+	return NULL;
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Send one reply from @param src_fd to @param sock_fd the way connection_handler originally did.
+ * @return number of syscalls issued
+ */
+static unsigned long legacy_reply(int src_fd, int sock_fd, size_t *bytes)
+{
+	char tx_data[LEGACY_BUF_LEN];
+	unsigned long syscalls = 1;
+	ssize_t numbytes;
+
+	while((numbytes = read(src_fd, tx_data, LEGACY_BUF_LEN)) > 0) {
+		send(sock_fd, tx_data, numbytes, 0);
+		*bytes += numbytes;
+		syscalls += 2;
+	}
+	return syscalls;
+}
+
+static void run_bench(enum bench_method method, int src_fd, int replies)
+{
+	int sv[2];
+	pthread_t drain_thread;
+	struct aesd_reply reply;
+	unsigned long syscalls = 0;
+	size_t bytes = 0;
+
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		perror("socketpair");
+		exit(1);
+	}
+	pthread_create(&drain_thread, NULL, drain_handler, &sv[1]);
+	aesd_reply_init(&reply, method == BENCH_COPY);
+
+	double start = now_sec();
+	for(int i = 0; i < replies; ++i) {
+		lseek(src_fd, 0, SEEK_SET);
+		if(method == BENCH_LEGACY) {
+			syscalls += legacy_reply(src_fd, sv[0], &bytes);
+		} else if(aesd_reply_fill(&reply, src_fd) != 0 or aesd_reply_send(&reply, sv[0]) != 1) {
+			fprintf(stderr, "%s reply failed\n", method_names[method]);
+			exit(1);
+		}
+	}
+	double elapsed = now_sec() - start;
+
+	if(method != BENCH_LEGACY) {
+		syscalls = reply.syscalls;
+		bytes = reply.bytes_sent;
+	}
+	aesd_reply_free(&reply);
+	shutdown(sv[0], SHUT_WR);
+	pthread_join(drain_thread, NULL);
+	close(sv[0]);
+	close(sv[1]);
+
+	printf("%-12s %10.1f %12.0f %12.1f %12zu\n", method_names[method], (double)syscalls / replies,
+			replies / elapsed, bytes / elapsed / (1024 * 1024), bytes / replies);
+}
+
+int main(int argc, char **argv)
+{
+	size_t reply_size = 4096;
+	int replies = 20000;
+	const char *source = NULL;
+	char tmp_name[] = "/tmp/reply-bench-XXXXXX";
+	int src_fd;
+	int opt;
+
+	while((opt = getopt(argc, argv, "s:n:f:")) != -1) {
+		switch(opt) {
+			case 's':
+				reply_size = strtoul(optarg, NULL, 0);
+				break;
+			case 'n':
+				replies = atoi(optarg);
+				break;
+			case 'f':
+				source = optarg;
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-s reply_size] [-n replies] [-f source_file]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	if(source != NULL) {
+		src_fd = open(source, O_RDONLY);
+	} else {
+		// fill a scratch file with newline terminated packets
+		src_fd = mkstemp(tmp_name);
+		if(src_fd >= 0) {
+			unlink(tmp_name);
+			for(size_t i = 0; i < reply_size; ++i) {
+				char c = (i % 64 == 63) ? '\n' : 'a' + i % 26;
+				if(write(src_fd, &c, 1) != 1) {
+					perror("write");
+					return 1;
+				}
+			}
+		}
+	}
+	if(src_fd < 0) {
+		perror("open");
+		return 1;
+	}
+
+	printf("%-12s %10s %12s %12s %12s\n", "method", "syscalls", "replies/s", "MiB/s", "bytes/reply");
+	run_bench(BENCH_LEGACY, src_fd, replies);
+	run_bench(BENCH_COPY, src_fd, replies);
+	run_bench(BENCH_SPLICE, src_fd, replies);
+	close(src_fd);
+	return 0;
+}
@@ -0,0 +1,259 @@
+/*
+ * storage-bench.c
+ *
+ * Compare the aesd-storage.h stores.  Each store is sent @p packets newline terminated packets of
+ * @p packet_size bytes through aesd_storage_write, the way the commit path appends them, and every
+ * @p reply_every packets a reply is taken: a seek to the oldest packet still held followed by
+ * aesd_storage_fill_reply, sent to a socket a thread drains.  Reports packets and replies per second
+ * and the bytes a reply carried on average.  With @p write_size each packet is written in pieces of that
+ * many bytes, as a server passing data through as it arrives would, which streams large packets through
+ * the partial write accumulation, e.g. -s 4194304 -n 20 -w 100.  Afterwards every packet still held is
+ * read back and compared with what was written.
+ *
+ * usage: storage-bench [-s packet_size] [-n packets] [-r reply_every] [-w write_size] [-c chardev_path] [-y always|never]
+ * The chardev row needs the aesdchar driver loaded, it is skipped unless the -c path (by default
+ * OUTPUT_FILENAME) is a character device.  The file and log rows use a temporary file and directory and
+ * sync every write unless run with -y never.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <limits.h>
+#include <dirent.h>
+#include <iso646.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+#include "aesd-storage.h"
+#include "aesd-reply.h"
+#include "aesdsocket.h"
+
+static void *drain_handler(void *args)
+{
+	int fd = *(int*)args;
+	char buf[64 * 1024];
+	while(read(fd, buf, sizeof buf) > 0) {
+	}
+	return NULL;
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Read everything @param handle holds from the start, checking it is whole copies of the @param packet_size
+ * bytes at @param packet
+ */
+static void check_packets(struct aesd_storage_handle *handle, const char *packet, size_t packet_size)
+{
+	char *check = malloc(packet_size);
+	if(check == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	if(aesd_storage_seek(handle, NULL) != 0) {
+		fprintf(stderr, "%s: seek failed\n", aesd_storage_name());
+		exit(1);
+	}
+	int held = 0;
+	while(true) {
+		size_t filled = 0;
+		ssize_t numbytes = 1;
+		while(filled < packet_size and (numbytes = aesd_storage_read(handle, check + filled, packet_size - filled)) > 0) {
+			filled += numbytes;
+		}
+		if(numbytes < 0 or (filled > 0 and (filled < packet_size or memcmp(check, packet, packet_size) != 0))) {
+			fprintf(stderr, "%s: packet %d didn't read back as written\n", aesd_storage_name(), held);
+			exit(1);
+		}
+		if(filled == 0) {
+			break;
+		}
+		held++;
+	}
+	if(held == 0) {
+		fprintf(stderr, "%s: no packets read back\n", aesd_storage_name());
+		exit(1);
+	}
+	free(check);
+}
+
+/**
+ * Write the @param packet_size bytes at @param packet to @param handle in pieces of at most @param write_size,
+ * in one piece if that is 0
+ */
+static int write_packet(struct aesd_storage_handle *handle, const char *packet, size_t packet_size, size_t write_size)
+{
+	if(write_size == 0) {
+		return aesd_storage_write(handle, packet, packet_size);
+	}
+	for(size_t offset = 0; offset < packet_size; offset += write_size) {
+		size_t len = packet_size - offset < write_size ? packet_size - offset : write_size;
+		if(aesd_storage_write(handle, packet + offset, len) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void run_bench(enum aesd_storage_kind kind, const char *path, enum aesd_storage_sync sync, size_t packet_size,
+		int packets, int reply_every, size_t write_size)
+{
+	int sv[2];
+	pthread_t drain_thread;
+	struct aesd_reply reply;
+	struct aesd_storage_handle handle;
+
+	if(aesd_storage_open(kind, path, sync) != 0 or aesd_storage_handle_open(&handle) != 0) {
+		fprintf(stderr, "%s: can't open store\n", aesd_storage_name());
+		exit(1);
+	}
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		perror("socketpair");
+		exit(1);
+	}
+	pthread_create(&drain_thread, NULL, drain_handler, &sv[1]);
+	aesd_reply_init(&reply, false);
+
+	char *packet = malloc(packet_size);
+	if(packet == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for(size_t i = 0; i < packet_size; ++i) {
+		packet[i] = 'a' + i % 26;
+	}
+	packet[packet_size - 1] = '\n';
+
+	int replies = 0;
+	double write_sec = 0;
+	double reply_sec = 0;
+	for(int i = 0; i < packets; ++i) {
+		double start = now_sec();
+		if(write_packet(&handle, packet, packet_size, write_size) != 0) {
+			fprintf(stderr, "%s: write failed\n", aesd_storage_name());
+			exit(1);
+		}
+		double written = now_sec();
+		write_sec += written - start;
+
+		if(reply_every > 0 and (i + 1) % reply_every == 0) {
+			// the stores keep different amounts of history, ask each for the oldest packet it still has
+			int held = i + 1 < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED ? i + 1 : AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+			struct aesd_seekto seekto = {.write_cmd = kind == AESD_STORAGE_FILE ? i + 1 - held : 0, .write_cmd_offset = 0};
+			if(aesd_storage_seek(&handle, &seekto) != 0 or aesd_storage_fill_reply(&handle, &reply) != 0 or
+					aesd_reply_send(&reply, sv[0]) != 1) {
+				fprintf(stderr, "%s: reply failed\n", aesd_storage_name());
+				exit(1);
+			}
+			replies++;
+			reply_sec += now_sec() - written;
+		}
+	}
+
+	check_packets(&handle, packet, packet_size);
+
+	size_t reply_bytes = reply.bytes_sent;
+	aesd_reply_free(&reply);
+	shutdown(sv[0], SHUT_WR);
+	pthread_join(drain_thread, NULL);
+	close(sv[0]);
+	close(sv[1]);
+	free(packet);
+
+	printf("%-8s %12.0f %12.1f %12.0f %12zu\n", aesd_storage_name(), packets / write_sec,
+			packets * packet_size / write_sec / (1024 * 1024), replies > 0 ? replies / reply_sec : 0,
+			replies > 0 ? reply_bytes / replies : 0);
+	aesd_storage_handle_close(&handle);
+	aesd_storage_close();
+}
+
+static void remove_dir(const char *path)
+{
+	char name[PATH_MAX];
+	DIR *dir = opendir(path);
+	if(dir == NULL) {
+		return;
+	}
+	struct dirent *dirent;
+	while((dirent = readdir(dir)) != NULL) {
+		if(strcmp(dirent->d_name, ".") != 0 and strcmp(dirent->d_name, "..") != 0) {
+			snprintf(name, sizeof name, "%s/%s", path, dirent->d_name);
+			unlink(name);
+		}
+	}
+	closedir(dir);
+	rmdir(path);
+}
+
+int main(int argc, char **argv)
+{
+	size_t packet_size = 256;
+	int packets = 100000;
+	int reply_every = 100;
+	size_t write_size = 0;
+	const char *chardev = OUTPUT_FILENAME;
+	enum aesd_storage_sync sync = AESD_STORAGE_SYNC_ALWAYS;
+	char tmp_name[] = "/tmp/storage-bench-XXXXXX";
+	char tmp_dir[] = "/tmp/storage-bench-log-XXXXXX";
+	int opt;
+
+	while((opt = getopt(argc, argv, "s:n:r:w:c:y:")) != -1) {
+		switch(opt) {
+			case 's':
+				packet_size = strtoul(optarg, NULL, 0);
+				break;
+			case 'n':
+				packets = atoi(optarg);
+				break;
+			case 'r':
+				reply_every = atoi(optarg);
+				break;
+			case 'w':
+				write_size = strtoul(optarg, NULL, 0);
+				break;
+			case 'c':
+				chardev = optarg;
+				break;
+			case 'y':
+				sync = strcmp(optarg, "never") == 0 ? AESD_STORAGE_SYNC_NEVER : AESD_STORAGE_SYNC_ALWAYS;
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-s packet_size] [-n packets] [-r reply_every] [-w write_size] [-c chardev_path] [-y always|never]\n", argv[0]);
+				return 1;
+		}
+	}
+	if(packet_size == 0 or packets <= 0) {
+		fprintf(stderr, "packet_size and packets must be positive\n");
+		return 1;
+	}
+
+	int tmp_fd = mkstemp(tmp_name);
+	if(tmp_fd < 0 or mkdtemp(tmp_dir) == NULL) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(tmp_fd);
+
+	printf("%-8s %12s %12s %12s %12s\n", "store", "packets/s", "MiB/s", "replies/s", "bytes/reply");
+	struct stat st;
+	if(stat(chardev, &st) == 0 and S_ISCHR(st.st_mode)) {
+		run_bench(AESD_STORAGE_CHARDEV, chardev, sync, packet_size, packets, reply_every, write_size);
+	} else {
+		printf("%-8s skipped, %s is not a character device\n", "chardev", chardev);
+	}
+	run_bench(AESD_STORAGE_FILE, tmp_name, sync, packet_size, packets, reply_every, write_size);
+	run_bench(AESD_STORAGE_RING, NULL, sync, packet_size, packets, reply_every, write_size);
+	run_bench(AESD_STORAGE_LOG, tmp_dir, sync, packet_size, packets, reply_every, write_size);
+	unlink(tmp_name);
+	remove_dir(tmp_dir);
+	return 0;
+}
@@ -0,0 +1,137 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+static const char *const strings[] = {
+    "a\n", "bb\n", "ccc\n", "dddd\n", "eeeee\n", "f\n", "gggggggggggg\n", "hh\n", "iiiiiii\n", "j\n",
+    "kkkkkkkkkkkkkkkkkk\n", "lll\n", "mmmmmm\n",
+};
+
+#define NUM_STRINGS (sizeof strings / sizeof strings[0])
+
+/**
+ * Check every offset of @param buffer, which holds strings[first] to strings[first + count - 1], against
+ * the strings concatenated end to end, and that the offsets from the end of the data on aren't found
+ */
+static void verify_find(struct aesd_circular_buffer *buffer, unsigned int first, unsigned int count)
+{
+    size_t offset = 0;
+    size_t entry_offset;
+
+    for(unsigned int i = first; i < first + count; ++i) {
+        size_t size = strlen(strings[i]);
+        for(size_t byte = 0; byte < size; ++byte) {
+            struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, offset + byte,
+                    &entry_offset);
+            TEST_ASSERT_NOT_NULL_MESSAGE(entry, "offset inside the data not found");
+            TEST_ASSERT_EQUAL_PTR_MESSAGE(strings[i], entry->buffptr, "offset found in the wrong entry");
+            TEST_ASSERT_EQUAL_UINT64_MESSAGE(byte, entry_offset, "wrong byte within the entry");
+        }
+        offset += size;
+    }
+    TEST_ASSERT_EQUAL_UINT64(offset, aesd_circular_buffer_size(buffer));
+    entry_offset = SIZE_MAX;
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(buffer, offset, &entry_offset),
+            "char_offset == size should not be found");
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(SIZE_MAX, entry_offset, "entry_offset_byte_rtn set when not found");
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(buffer, offset + 1, &entry_offset));
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(buffer, SIZE_MAX, &entry_offset));
+}
+
+/**
+ * Add the strings one at a time to a buffer of @param capacity entries whose end starts at @param end,
+ * checking every lookup after each add
+ */
+static void verify_find_all(uint32_t capacity, size_t end)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entries[NUM_STRINGS];
+
+    aesd_circular_buffer_init_entries(&buffer, entries, capacity);
+    buffer.end = end;
+    verify_find(&buffer, 0, 0);
+    for(unsigned int i = 0; i < NUM_STRINGS; ++i) {
+        struct aesd_buffer_entry entry = {.buffptr = strings[i], .size = strlen(strings[i])};
+        aesd_circular_buffer_add_entry(&buffer, &entry);
+        unsigned int count = i + 1 < capacity ? i + 1 : capacity;
+        verify_find(&buffer, i + 1 - count, count);
+    }
+}
+
+void test_circular_buffer_find_every_count()
+{
+    // odd and even counts, and powers of two, take different paths through the binary search
+    for(uint32_t capacity = 1; capacity <= NUM_STRINGS; ++capacity) {
+        verify_find_all(capacity, 0);
+    }
+}
+
+void test_circular_buffer_find_across_wrapped_end()
+{
+    // the entry starts wrap past SIZE_MAX part way through, offsets are relative to the oldest entry
+    for(uint32_t capacity = 1; capacity <= NUM_STRINGS; ++capacity) {
+        verify_find_all(capacity, SIZE_MAX - 20);
+        verify_find_all(capacity, SIZE_MAX);
+    }
+}
+
+void test_circular_buffer_find_entry_boundaries()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entries[4];
+    size_t entry_offset;
+
+    aesd_circular_buffer_init_entries(&buffer, entries, 4);
+    buffer.end = SIZE_MAX - 6;
+    for(unsigned int i = 0; i < 6; ++i) {
+        struct aesd_buffer_entry entry = {.buffptr = strings[i], .size = strlen(strings[i])};
+        aesd_circular_buffer_add_entry(&buffer, &entry);
+    }
+    // holds "ccc\n" "dddd\n" "eeeee\n" "f\n", the first start before SIZE_MAX and the rest after it
+    TEST_ASSERT_EQUAL_UINT64(17, aesd_circular_buffer_size(&buffer));
+    TEST_ASSERT_EQUAL_PTR(strings[2], aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 0, &entry_offset)->buffptr);
+    TEST_ASSERT_EQUAL_UINT64(0, entry_offset);
+    TEST_ASSERT_EQUAL_PTR(strings[2], aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 3, &entry_offset)->buffptr);
+    TEST_ASSERT_EQUAL_UINT64(3, entry_offset);
+    TEST_ASSERT_EQUAL_PTR(strings[3], aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 4, &entry_offset)->buffptr);
+    TEST_ASSERT_EQUAL_UINT64(0, entry_offset);
+    TEST_ASSERT_EQUAL_PTR(strings[3], aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 8, &entry_offset)->buffptr);
+    TEST_ASSERT_EQUAL_UINT64(4, entry_offset);
+    TEST_ASSERT_EQUAL_PTR(strings[4], aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 9, &entry_offset)->buffptr);
+    TEST_ASSERT_EQUAL_UINT64(0, entry_offset);
+    TEST_ASSERT_EQUAL_PTR(strings[5], aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 15, &entry_offset)->buffptr);
+    TEST_ASSERT_EQUAL_UINT64(0, entry_offset);
+    TEST_ASSERT_EQUAL_PTR(strings[5], aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 16, &entry_offset)->buffptr);
+    TEST_ASSERT_EQUAL_UINT64(1, entry_offset);
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 17, &entry_offset));
+
+    // the wrapped starts are only meaningful relative to the oldest
+    TEST_ASSERT_EQUAL_UINT64(0, aesd_circular_buffer_offset_of(&buffer, 0));
+    TEST_ASSERT_EQUAL_UINT64(4, aesd_circular_buffer_offset_of(&buffer, 1));
+    TEST_ASSERT_EQUAL_UINT64(9, aesd_circular_buffer_offset_of(&buffer, 2));
+    TEST_ASSERT_EQUAL_UINT64(15, aesd_circular_buffer_offset_of(&buffer, 3));
+    TEST_ASSERT_EQUAL_UINT64(17, aesd_circular_buffer_offset_of(&buffer, 4));
+    TEST_ASSERT_TRUE_MESSAGE(aesd_circular_buffer_entry_at(&buffer, 0)->start > aesd_circular_buffer_entry_at(&buffer, 1)->start,
+            "the starts should have wrapped between the first and second entry");
+}
+
+void test_circular_buffer_find_after_remove()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entries[5];
+
+    aesd_circular_buffer_init_entries(&buffer, entries, 5);
+    buffer.end = SIZE_MAX - 10;
+    for(unsigned int i = 0; i < 8; ++i) {
+        struct aesd_buffer_entry entry = {.buffptr = strings[i], .size = strlen(strings[i])};
+        aesd_circular_buffer_add_entry(&buffer, &entry);
+    }
+    // offsets count from the new oldest entry as entries are removed
+    for(unsigned int i = 3; i < 8; ++i) {
+        verify_find(&buffer, i, 8 - i);
+        aesd_circular_buffer_remove_entry(&buffer);
+    }
+    verify_find(&buffer, 8, 0);
+}
@@ -0,0 +1,144 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+static const char *const strings[] = {
+    "write1\n", "write22\n", "write333\n", "write4444\n", "write55555\n", "write666666\n",
+    "write7777777\n", "write88888888\n", "write999999999\n",
+};
+
+/**
+ * Add strings[first] to strings[first + count - 1] to @param buffer
+ */
+static void add_strings(struct aesd_circular_buffer *buffer, unsigned int first, unsigned int count)
+{
+    for(unsigned int i = first; i < first + count; ++i) {
+        struct aesd_buffer_entry entry = {.buffptr = strings[i], .size = strlen(strings[i])};
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+}
+
+/**
+ * Verify @param buffer holds strings[first] to strings[first + count - 1], oldest first, at the offsets
+ * they'd have concatenated end to end
+ */
+static void verify_strings(struct aesd_circular_buffer *buffer, unsigned int first, unsigned int count)
+{
+    size_t offset = 0;
+    size_t entry_offset;
+
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(count, aesd_circular_buffer_count(buffer), "wrong number of entries held");
+    for(unsigned int i = 0; i < count; ++i) {
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_entry_at(buffer, i);
+        TEST_ASSERT_NOT_NULL_MESSAGE(entry, "missing entry");
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(strings[first + i], entry->buffptr, "entry out of order");
+        TEST_ASSERT_EQUAL_UINT32_MESSAGE(offset, aesd_circular_buffer_offset_of(buffer, i), "wrong entry offset");
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(entry, aesd_circular_buffer_find_entry_offset_for_fpos(buffer, offset, &entry_offset),
+                "entry not found at its offset");
+        TEST_ASSERT_EQUAL_UINT32(0, entry_offset);
+        offset += entry->size;
+    }
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(offset, aesd_circular_buffer_size(buffer), "wrong buffer size");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_entry_at(buffer, count), "entry returned past the count");
+}
+
+void test_circular_buffer_resize_shrink_wrapped()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entries[4];
+    struct aesd_buffer_entry smaller[2];
+
+    aesd_circular_buffer_init_entries(&buffer, entries, 4);
+    add_strings(&buffer, 0, 6);
+    TEST_ASSERT_TRUE_MESSAGE(buffer.full, "buffer should be full");
+    TEST_ASSERT_NOT_EQUAL_MESSAGE(0, buffer.out_offs, "buffer should have wrapped");
+    verify_strings(&buffer, 2, 4);
+
+    // the two oldest are dropped, the newest two kept in order
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(entries, aesd_circular_buffer_resize(&buffer, smaller, 2),
+            "resize should return the caller's previous entry array");
+    TEST_ASSERT_TRUE(buffer.full);
+    verify_strings(&buffer, 4, 2);
+
+    add_strings(&buffer, 6, 1);
+    verify_strings(&buffer, 5, 2);
+}
+
+void test_circular_buffer_resize_grow()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entries[6];
+
+    aesd_circular_buffer_init(&buffer);
+    add_strings(&buffer, 0, 3);
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_resize(&buffer, entries, 6),
+            "resize should return NULL when moving off the default entries");
+    TEST_ASSERT_FALSE(buffer.full);
+    verify_strings(&buffer, 0, 3);
+
+    // fills up to the new capacity before dropping anything
+    add_strings(&buffer, 3, 3);
+    TEST_ASSERT_TRUE(buffer.full);
+    verify_strings(&buffer, 0, 6);
+    add_strings(&buffer, 6, 3);
+    verify_strings(&buffer, 3, 6);
+}
+
+void test_circular_buffer_grow_full_wrapped()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entries[3];
+    struct aesd_buffer_entry larger[5];
+
+    aesd_circular_buffer_init_entries(&buffer, entries, 3);
+    add_strings(&buffer, 0, 5);
+    verify_strings(&buffer, 2, 3);
+    TEST_ASSERT_EQUAL_PTR(entries, aesd_circular_buffer_resize(&buffer, larger, 5));
+    TEST_ASSERT_FALSE_MESSAGE(buffer.full, "a grown buffer has room again");
+    verify_strings(&buffer, 2, 3);
+    add_strings(&buffer, 5, 2);
+    TEST_ASSERT_TRUE(buffer.full);
+    verify_strings(&buffer, 2, 5);
+}
+
+void test_circular_buffer_remove_to_empty()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entries[3];
+    size_t entry_offset;
+
+    aesd_circular_buffer_init_entries(&buffer, entries, 3);
+    add_strings(&buffer, 0, 4);
+    for(unsigned int i = 1; i < 4; ++i) {
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(strings[i], aesd_circular_buffer_remove_entry(&buffer), "removed out of order");
+        verify_strings(&buffer, i + 1, 3 - i);
+    }
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_remove_entry(&buffer), "removed from an empty buffer");
+    TEST_ASSERT_EQUAL_UINT32(0, aesd_circular_buffer_size(&buffer));
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 0, &entry_offset));
+
+    // and it fills again from where it left off
+    add_strings(&buffer, 4, 3);
+    TEST_ASSERT_TRUE(buffer.full);
+    verify_strings(&buffer, 4, 3);
+}
+
+void test_circular_buffer_entry_at_past_count()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entries[4];
+
+    aesd_circular_buffer_init_entries(&buffer, entries, 4);
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_entry_at(&buffer, 0), "entry returned from an empty buffer");
+    add_strings(&buffer, 0, 6);
+    aesd_circular_buffer_remove_entry(&buffer);
+    // out_offs is past the middle, so an index past the count would land on a stale slot after wrapping
+    TEST_ASSERT_NOT_NULL(aesd_circular_buffer_entry_at(&buffer, 2));
+    TEST_ASSERT_NULL(aesd_circular_buffer_entry_at(&buffer, 3));
+    TEST_ASSERT_NULL(aesd_circular_buffer_entry_at(&buffer, 4));
+    TEST_ASSERT_NULL(aesd_circular_buffer_entry_at(&buffer, UINT32_MAX));
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(aesd_circular_buffer_size(&buffer), aesd_circular_buffer_offset_of(&buffer, 3),
+            "the offset past the last entry is the buffer size");
+}